@@ -0,0 +1,125 @@
+// Reads a uint64_t and a std::string ConfigVar from 64 threads at once,
+// while another thread sets them every millisecond: directly, through a
+// ConfigHandle, and looked up by name and cast each time.  Compares that to
+// reading copies guarded by a std::mutex, and a std::string published
+// through std::atomic_load of a std::shared_ptr.
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "config.h"
+
+using namespace Mordor2;
+
+static const int kReaders = 64;
+static const std::chrono::milliseconds kDuration(1000);
+
+// read() returns something derived from what it read, so it is not
+// optimized out; write(i) sets the values for the i'th time
+template <class Read, class Write>
+static void run(const char *name, Read read, Write write) {
+    std::atomic<bool> stop(false);
+    std::atomic<uint64_t> reads(0), checksum(0);
+    std::vector<std::thread> readers;
+    for (int i = 0; i < kReaders; ++i) {
+        readers.push_back(std::thread([&] {
+            uint64_t n = 0, sum = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                for (int j = 0; j < 64; ++j)
+                    sum += read();
+                n += 64;
+            }
+            reads += n;
+            checksum += sum;
+        }));
+    }
+    std::thread writer([&] {
+        for (uint64_t i = 0; !stop.load(std::memory_order_relaxed); ++i) {
+            write(i);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+    auto start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(kDuration);
+    stop = true;
+    for (std::thread &reader : readers)
+        reader.join();
+    writer.join();
+    double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+    std::cout << name << ": " << ns / reads << " ns/read, " << reads * 1000 / ns
+              << "M reads/s";
+    if (!checksum)
+        std::cout << " (failed)";
+    std::cout << std::endl;
+}
+
+static std::string value(uint64_t i) {
+    return "http://server" + std::to_string(i % 16) + ".example.com/";
+}
+
+int main() {
+    ConfigVar<uint64_t>::ptr number =
+        Config::lookup<uint64_t>("bench.number", 1, "");
+    ConfigVar<std::string>::ptr string =
+        Config::lookup<std::string>("bench.string", value(0), "");
+
+    run("ConfigVar<uint64_t>::val", [&] { return number->val(); },
+        [&](uint64_t i) { number->val(i + 1); });
+    run("ConfigVar<std::string>::val", [&] { return string->val().size(); },
+        [&](uint64_t i) { string->val(value(i)); });
+
+    ConfigHandle<uint64_t> numberHandle("bench.number");
+    ConfigHandle<std::string> stringHandle("bench.string");
+    run("ConfigHandle<uint64_t>::val", [&] { return numberHandle.val(); },
+        [&](uint64_t i) { number->val(i + 1); });
+    run("ConfigHandle<std::string>::val",
+        [&] { return stringHandle.val().size(); },
+        [&](uint64_t i) { string->val(value(i)); });
+    run("Config::lookup + dynamic_pointer_cast", [&] {
+            ConfigVar<uint64_t>::ptr var =
+                std::dynamic_pointer_cast<ConfigVar<uint64_t>>(
+                    Config::lookup("bench.number"));
+            return var ? var->val() : 0;
+        },
+        [&](uint64_t i) { number->val(i + 1); });
+
+    std::mutex mutex;
+    uint64_t lockedNumber = 1;
+    std::string lockedString = value(0);
+    run("std::mutex uint64_t", [&] {
+            std::lock_guard<std::mutex> lock(mutex);
+            return lockedNumber;
+        },
+        [&](uint64_t i) {
+            std::lock_guard<std::mutex> lock(mutex);
+            lockedNumber = i + 1;
+        });
+    run("std::mutex std::string", [&] {
+            std::lock_guard<std::mutex> lock(mutex);
+            return std::string(lockedString).size();
+        },
+        [&](uint64_t i) {
+            std::string v = value(i);
+            std::lock_guard<std::mutex> lock(mutex);
+            lockedString.swap(v);
+        });
+
+    std::shared_ptr<const std::string> shared =
+        std::make_shared<const std::string>(value(0));
+    run("std::atomic_load std::shared_ptr", [&] {
+            return std::string(*std::atomic_load(&shared)).size();
+        },
+        [&](uint64_t i) {
+            std::atomic_store(&shared,
+                              std::make_shared<const std::string>(value(i)));
+        });
+    return 0;
+}
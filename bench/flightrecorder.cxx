@@ -0,0 +1,57 @@
+// Compares recording TRACE messages in the flight recorder with formatting
+// them.
+
+#include <chrono>
+#include <iostream>
+
+#include "binarylog.h"
+#include "config.h"
+#include "flightrecorder.h"
+#include "log.h"
+
+using namespace Mordor2;
+
+class NullLogSink : public LogSink {
+public:
+    void log(const std::string &, int64_t, tid_t, Log::Level,
+             const std::string &, const char *, int) {}
+};
+
+static const int kIterations = 1000000;
+
+template <class F> static void run(const char *name, F f) {
+    for (int i = 0; i < 1000; ++i)
+        f(i);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kIterations; ++i)
+        f(i);
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    end - start)
+                    .count();
+    std::cout << name << ": " << ns / kIterations << " ns/message"
+              << std::endl;
+}
+
+int main() {
+    Logger::ptr formatted = Log::lookup("mordor:bench:formatted");
+    formatted->addSink(LogSink::ptr(new NullLogSink()));
+    formatted->level(Log::Level::TRACE);
+    Logger::ptr recorded = Log::lookup("mordor:bench:recorded");
+    Config::lookup("log.flightrecorder")->fromString("1");
+
+    run("MORDOR_LOG_TRACE, formatted", [&](int i) {
+        MORDOR_LOG_TRACE(formatted) << "request " << i << " from "
+                                    << "client" << " took " << 1.5 << "ms";
+    });
+    run("MORDOR_LOG_BINARY_TRACE, formatted", [&](int i) {
+        MORDOR_LOG_BINARY_TRACE(formatted, "request {} from {} took {}ms", i,
+                                "client", 1.5);
+    });
+    run("MORDOR_LOG_BINARY_TRACE, recorded below level", [&](int i) {
+        MORDOR_LOG_BINARY_TRACE(recorded, "request {} from {} took {}ms", i,
+                                "client", 1.5);
+    });
+    FlightRecorder::dump(1, 3);
+    return 0;
+}
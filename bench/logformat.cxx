@@ -0,0 +1,90 @@
+// Compares the cost of MORDOR_LOGF_* statements with the equivalent
+// MORDOR_LOG_* statements streaming the same arguments, with a sink that
+// discards every message.
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+
+#include "log.h"
+#include "logformat.h"
+
+using namespace Mordor2;
+
+static std::atomic<uint64_t> g_allocations(0);
+
+void *operator new(size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+// Not inlined, where GCC would take free() of what new returned for a
+// mismatch
+__attribute__((noinline)) void operator delete(void *p) noexcept { free(p); }
+
+class NullLogSink : public LogSink {
+public:
+    void log(const std::string &, int64_t, tid_t, Log::Level,
+             const std::string &, const char *, int) {}
+};
+
+static const int kIterations = 1000000;
+
+template <class F> static void run(const char *name, F f) {
+    // Warm up, so thread-local buffers have reached their working size
+    for (int i = 0; i < 1000; ++i)
+        f(i);
+    uint64_t allocations = g_allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kIterations; ++i)
+        f(i);
+    auto end = std::chrono::steady_clock::now();
+    allocations = g_allocations.load() - allocations;
+    double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    end - start)
+                    .count();
+    std::cout << name << ": " << ns / kIterations << " ns/message, "
+              << static_cast<double>(allocations) / kIterations
+              << " allocations/message" << std::endl;
+}
+
+int main() {
+    Logger::ptr log = Log::lookup("mordor:bench:logformat");
+    log->addSink(LogSink::ptr(new NullLogSink()));
+    std::string client = "client";
+
+    run("MORDOR_LOG_INFO integers", [&](int i) {
+        MORDOR_LOG_INFO(log) << "request " << i << " of " << kIterations
+                             << " read " << i * 4096LL << " bytes";
+    });
+    run("MORDOR_LOGF_INFO integers", [&](int i) {
+        MORDOR_LOGF_INFO(log, "request {} of {} read {} bytes", i,
+                         kIterations, i * 4096LL);
+    });
+    run("MORDOR_LOG_INFO doubles", [&](int i) {
+        MORDOR_LOG_INFO(log) << "took " << i / 1000.0 << "ms, "
+                             << i * 0.37 << "% of " << 1.5 << "s";
+    });
+    run("MORDOR_LOGF_INFO doubles", [&](int i) {
+        MORDOR_LOGF_INFO(log, "took {}ms, {}% of {}s", i / 1000.0, i * 0.37,
+                         1.5);
+    });
+    run("MORDOR_LOG_INFO mixed", [&](int i) {
+        MORDOR_LOG_INFO(log) << "request " << i << " from " << client
+                             << " took " << 1.5 << "ms";
+    });
+    run("MORDOR_LOGF_INFO mixed", [&](int i) {
+        MORDOR_LOGF_INFO(log, "request {} from {} took {}ms", i, client, 1.5);
+    });
+    run("disabled MORDOR_LOGF_TRACE", [&](int i) {
+        MORDOR_LOGF_TRACE(log, "request {} from {} took {}ms", i, client,
+                          1.5);
+    });
+    return 0;
+}
@@ -0,0 +1,40 @@
+// Measures how long changing a log.*mask ConfigVar takes to re-evaluate every
+// Logger, with many Loggers registered.
+
+#include <chrono>
+#include <iostream>
+#include <sstream>
+
+#include "config.h"
+#include "log.h"
+
+using namespace Mordor2;
+
+static const int kLoggers = 100000;
+
+static void run(const char *name, const char *var, const std::string &mask) {
+    auto start = std::chrono::steady_clock::now();
+    Config::lookup(var)->fromString(mask);
+    auto end = std::chrono::steady_clock::now();
+    double ms = std::chrono::duration_cast<std::chrono::microseconds>(
+                    end - start)
+                    .count() /
+                1000.0;
+    std::cout << name << ": " << ms << " ms for " << kLoggers << " loggers"
+              << std::endl;
+}
+
+int main() {
+    for (int i = 0; i < kLoggers; ++i) {
+        std::ostringstream os;
+        os << "mordor:bench:" << i % 100 << ":logger" << i;
+        Log::lookup(os.str());
+    }
+
+    run("exact", "log.debugmask",
+        "mordor:bench:1:logger1|mordor:bench:2:logger2");
+    run("prefix", "log.debugmask", "mordor:bench:1:.*|mordor:bench:2:.*");
+    run("glob", "log.debugmask", "mordor:.*:logger1.*");
+    run("regex", "log.debugmask", "mordor:bench:[0-9]:logger[0-9]+");
+    return 0;
+}
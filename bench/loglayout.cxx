@@ -0,0 +1,55 @@
+// Measures how long LogLayout takes to format a record, with the timestamp
+// advancing a microsecond per record, so the second changes about once per
+// million records, as it would for a busy logger.
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "log.h"
+#include "loglayout.h"
+
+using namespace Mordor2;
+
+static const int kIterations = 10000000;
+
+static void run(const char *name, const char *pattern) {
+    LogLayout layout(pattern);
+    std::string message = "request 42 from client took 1.5ms";
+    LogRecord record;
+    record.loggerId = LogRecord::kNoLoggerId;
+    record.logger.data = "mordor:bench:loglayout";
+    record.logger.len = 22;
+    record.now = 1700000000000000LL;
+    record.thread = 12345;
+    record.level = Log::Level::INFO;
+    record.str.data = message.data();
+    record.str.len = message.size();
+    record.file = "loglayout.cxx";
+    record.line = 42;
+
+    std::string buf;
+    size_t bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kIterations; ++i) {
+        buf.clear();
+        layout.format(buf, record);
+        bytes += buf.size();
+        ++record.now;
+    }
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    end - start)
+                    .count();
+    std::cout << name << ": " << ns / kIterations << " ns/record ("
+              << bytes / kIterations << " bytes)" << std::endl;
+}
+
+int main() {
+    run("timestamp", "%d");
+    run("timestamp with milliseconds", "%d{%T.%ms}");
+    run("stdout default", "%d{%F %T.%us} [%l] %t %n %f:%L - %m");
+    run("file default", "[%d{%F %T.%us}] %l %t  %n %f:%L %m");
+    run("no timestamp", "[%l] %t %n %f:%L - %m");
+    return 0;
+}
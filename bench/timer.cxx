@@ -0,0 +1,94 @@
+// Schedules and cancels a few million timers on a TimerManager, and on a
+// std::multimap ordered by expiry, the usual ordered timer queue, then has
+// the TimerManager fire a million timers spread over a second.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <vector>
+
+#include "timer.h"
+
+using namespace Mordor2;
+
+static const size_t kTimers = 4000000;
+static const size_t kFired = 1000000;
+
+static double nsPer(std::chrono::steady_clock::time_point start, size_t n) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - start)
+               .count() /
+           static_cast<double>(n);
+}
+
+int main() {
+    std::mt19937_64 random(42);
+    // Up to an hour away, as connection and retry timeouts are
+    std::vector<Duration> delays(kTimers);
+    for (Duration &delay : delays)
+        delay = Duration::fromMicroseconds(random() % 3600000000ULL);
+    std::vector<size_t> order(kTimers);
+    for (size_t i = 0; i < kTimers; ++i)
+        order[i] = i;
+    std::shuffle(order.begin(), order.end(), random);
+
+    {
+        TimerManager manager;
+        std::vector<Timer::ptr> timers(kTimers);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < kTimers; ++i)
+            timers[i] = manager.registerTimer(delays[i], [] {});
+        std::cout << "TimerManager register: " << nsPer(start, kTimers)
+                  << " ns/timer" << std::endl;
+        start = std::chrono::steady_clock::now();
+        for (size_t i : order)
+            timers[i]->cancel();
+        std::cout << "TimerManager cancel: " << nsPer(start, kTimers)
+                  << " ns/timer" << std::endl;
+    }
+
+    {
+        typedef std::multimap<int64_t, std::function<void()>> Queue;
+        Queue queue;
+        std::vector<Queue::iterator> timers(kTimers);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < kTimers; ++i) {
+            int64_t expiry = (MonotonicTimestamp::Now() + delays[i])
+                                 .nanoseconds();
+            timers[i] = queue.insert(std::make_pair(expiry, [] {}));
+        }
+        std::cout << "std::multimap insert: " << nsPer(start, kTimers)
+                  << " ns/timer" << std::endl;
+        start = std::chrono::steady_clock::now();
+        for (size_t i : order)
+            queue.erase(timers[i]);
+        std::cout << "std::multimap erase: " << nsPer(start, kTimers)
+                  << " ns/timer" << std::endl;
+    }
+
+    {
+        TimerManager manager;
+        std::atomic<size_t> fired(0);
+        for (size_t i = 0; i < kFired; ++i)
+            manager.registerTimer(
+                Duration::fromMicroseconds(random() % 1000000),
+                [&] { fired.fetch_add(1, std::memory_order_relaxed); });
+        std::chrono::nanoseconds busy(0);
+        Duration wait;
+        while (manager.nextTimer(wait)) {
+            std::this_thread::sleep_for(
+                std::chrono::nanoseconds(wait.nanoseconds()));
+            auto start = std::chrono::steady_clock::now();
+            manager.processTimers();
+            busy += std::chrono::steady_clock::now() - start;
+        }
+        std::cout << "TimerManager fire: "
+                  << busy.count() / static_cast<double>(kFired)
+                  << " ns/timer, " << fired << " fired" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,121 @@
+// Compares Timestamp::formatTo and Timestamp::parse with formatting through
+// gmtime_r/localtime_r and snprintf/strftime, and parsing with strptime, as
+// FormattedString() and the log tools used to.  Timestamps advance a
+// millisecond per call, so formatting goes through a new second every
+// thousand calls.
+//
+// Then compares Timestamp::MicrosecondsNow with each time.clocksource to
+// std::chrono::system_clock.
+
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "timestamp.h"
+
+using namespace Mordor2;
+
+static const int kIterations = 2000000;
+static const int64_t kStart = 1700000000000000LL;
+
+template <class F> static void run(const char *name, F f) {
+    size_t bytes = 0;
+    for (int i = 0; i < 1000; ++i)
+        bytes += f(i);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kIterations; ++i)
+        bytes += f(i);
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    end - start)
+                    .count();
+    std::cout << name << ": " << ns / kIterations << " ns/call, "
+              << 1000 * kIterations / ns << "M calls/s";
+    if (!bytes)
+        std::cout << " (failed)";
+    std::cout << std::endl;
+}
+
+static int64_t at(int i) { return kStart + i * 1000LL; }
+
+int main() {
+    run("gmtime_r + snprintf", [](int i) -> size_t {
+        int64_t us = at(i);
+        time_t seconds = us / 1000000;
+        struct tm tm_time;
+        gmtime_r(&seconds, &tm_time);
+        char buf[64];
+        return snprintf(buf, sizeof(buf), "%4d%02d%02d %02d:%02d:%02d.%06d",
+                        tm_time.tm_year + 1900, tm_time.tm_mon + 1,
+                        tm_time.tm_mday, tm_time.tm_hour, tm_time.tm_min,
+                        tm_time.tm_sec, static_cast<int>(us % 1000000));
+    });
+    run("FormattedString", [](int i) -> size_t {
+        return Timestamp(at(i)).FormattedString().size();
+    });
+    run("formatTo UTC", [](int i) -> size_t {
+        char buf[Timestamp::kMaxFormattedSize];
+        return Timestamp(at(i)).formatTo(buf, sizeof(buf));
+    });
+    run("localtime_r + strftime", [](int i) -> size_t {
+        int64_t us = at(i);
+        time_t seconds = us / 1000000;
+        struct tm tm_time;
+        localtime_r(&seconds, &tm_time);
+        char buf[64];
+        size_t len = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm_time);
+        return len + snprintf(buf + len, sizeof(buf) - len, ".%06d%+03ld:%02ld",
+                              static_cast<int>(us % 1000000),
+                              tm_time.tm_gmtoff / 3600,
+                              tm_time.tm_gmtoff / 60 % 60);
+    });
+    run("formatTo LOCAL", [](int i) -> size_t {
+        char buf[Timestamp::kMaxFormattedSize];
+        return Timestamp(at(i)).formatTo(buf, sizeof(buf),
+                                         Timestamp::Format::LOCAL);
+    });
+    run("formatTo ISO8601", [](int i) -> size_t {
+        char buf[Timestamp::kMaxFormattedSize];
+        return Timestamp(at(i)).formatTo(buf, sizeof(buf),
+                                         Timestamp::Format::ISO8601);
+    });
+
+    std::vector<std::string> lines;
+    for (int i = 0; i < 4096; ++i) {
+        std::string line;
+        Timestamp(at(i * 7919)).formatTo(line, Timestamp::Format::ISO8601_UTC);
+        lines.push_back(line);
+    }
+    run("strptime + strtol", [&](int i) -> size_t {
+        const std::string &line = lines[i % lines.size()];
+        struct tm tm_time;
+        memset(&tm_time, 0, sizeof(tm_time));
+        const char *p = strptime(line.c_str(), "%Y-%m-%dT%H:%M:%S", &tm_time);
+        if (!p || *p != '.')
+            return 0;
+        long micros = strtol(p + 1, NULL, 10);
+        return (timegm(&tm_time) * 1000000LL + micros) != 0;
+    });
+    run("parse ISO8601", [&](int i) -> size_t {
+        const std::string &line = lines[i % lines.size()];
+        Timestamp t;
+        return Timestamp::parse(line, t);
+    });
+
+    run("system_clock::now", [](int) -> size_t {
+        return std::chrono::system_clock::now().time_since_epoch().count() !=
+               0;
+    });
+    for (const char *source : {"system", "coarse", "tsc", "cached"}) {
+        Config::lookup("time.clocksource")->fromString(source);
+        std::string name = std::string("MicrosecondsNow ") + source;
+        run(name.c_str(),
+            [](int) -> size_t { return Timestamp::MicrosecondsNow() != 0; });
+    }
+    return 0;
+}
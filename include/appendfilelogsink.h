@@ -0,0 +1,105 @@
+#ifndef __MORDOR_APPENDFILELOGSINK_H__
+#define __MORDOR_APPENDFILELOGSINK_H__
+
+#include "log.h"
+#include "noncopyable.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace Mordor2 {
+
+/// A LogSink that appends messages to a file with batched write(2)s
+///
+/// Messages are formatted as by FileLogSink, but the file is a raw O_APPEND
+/// descriptor instead of a std::ofstream, and messages are grouped into
+/// batches that are each written with a single system call.  A batch is
+/// written as soon as it holds batchBytes, or batchInterval after its first
+/// message, whichever comes first; the thread that fills a batch writes it
+/// while other threads start the next one.  A batch only ever contains
+/// whole messages, so several processes can append to the same file and
+/// their messages will be intermingled, but each one will be atomic.
+///
+/// A batch is already contiguous in memory, so it is written with write(2)
+/// rather than writev(2), which would be no more atomic.  If the write is
+/// short, the rest of the batch is dropped rather than written after
+/// whatever other processes have appended since, which could split a
+/// message.
+///
+/// With a batchInterval of 0, every message is written immediately, with a
+/// single write(2).
+///
+/// The log.file.batchbytes and log.file.batchusec ConfigVars provide the
+/// defaults; setting log.file.mode=append makes log.file use this sink.
+class AppendFileLogSink : public LogSink, public Noncopyable {
+public:
+    /// @param file The file to open and log to.  If it does not exist, it is
+    /// created.
+    /// @param batchBytes Size at which a batch is written; 0 uses
+    /// log.file.batchbytes
+    /// @param batchInterval Longest a message waits in a batch; negative uses
+    /// log.file.batchusec
+    /// @throws std::system_error If the file cannot be opened
+    AppendFileLogSink(const std::string &file, size_t batchBytes = 0,
+                      std::chrono::microseconds batchInterval =
+                          std::chrono::microseconds(-1));
+    /// Writes any pending messages, and closes the file
+    ~AppendFileLogSink();
+
+    void log(const std::string &logger, int64_t now, tid_t thread,
+             Log::Level level, const std::string &str, const char *file,
+             int line);
+    /// Adds all of the messages to the batch at once
+    void logBatch(const LogRecord *records, size_t count);
+
+    /// Writes every message logged before the call
+    void flush();
+
+    std::string file() const { return m_file; }
+    /// @return The number of bytes of messages dropped because a write
+    /// failed, or was short, usually because the disk was full
+    uint64_t dropped() const {
+        return m_dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    /// Wait until the batch can take more messages
+    /// @return If it is empty
+    bool reserve(std::unique_lock<std::mutex> &lock);
+    /// Start writing the batch if it is full, or its timer if it was empty
+    void appended(std::unique_lock<std::mutex> &lock, bool first);
+    /// Write batches until the pending one is smaller than threshold; the
+    /// lock is released while writing
+    void commit(std::unique_lock<std::mutex> &lock, size_t threshold);
+    /// Write buf with a single write(2), counting what it did not write as
+    /// dropped
+    void writeBatch(const char *buf, size_t len);
+    void run();
+
+private:
+    std::string m_file;
+    int m_fd;
+    size_t m_batchBytes;
+    std::chrono::microseconds m_batchInterval;
+
+    std::mutex m_mutex;
+    // Signalled when a batch is started, or the sink is stopping
+    std::condition_variable m_cond;
+    // Signalled when a batch has been written
+    std::condition_variable m_written;
+    // The batch messages are appended to, and the one being written
+    std::string m_batch;
+    std::string m_writing;
+    bool m_busy;
+    bool m_stopping;
+    std::atomic<uint64_t> m_dropped;
+    std::thread m_thread;
+};
+
+} // namespace Mordor2
+
+#endif
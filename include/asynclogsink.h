@@ -0,0 +1,144 @@
+#ifndef __MORDOR_ASYNCLOGSINK_H__
+#define __MORDOR_ASYNCLOGSINK_H__
+
+#include "log.h"
+#include "noncopyable.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Mordor2 {
+
+/// A LogSink that hands messages off to another LogSink on a background thread
+///
+/// Messages are copied into a bounded, lock-free multi-producer ring and the
+/// wrapped LogSink is invoked from a single dedicated writer thread, so a slow
+/// sink (i.e. a FileLogSink on a busy disk) never stalls the threads that are
+/// logging.  The writer thread flushes the wrapped sink whenever the ring
+/// drains, and at least every log.async.flushinterval microseconds while it
+/// stays busy.
+///
+/// When the ring is full, producers either wait for room (log.async.blocking)
+/// or drop the message; dropped messages are counted and reported to the
+/// wrapped sink once there is room again.
+///
+/// The writer thread passes plain text messages to the wrapped sink's
+/// logBatch(), up to 256 at a time, straight out of the ring.
+///
+/// The log.async.* ConfigVars provide the defaults for newly constructed
+/// AsyncLogSinks; setting log.async wraps the log.stdout and log.file sinks.
+class AsyncLogSink : public LogSink, public Noncopyable {
+public:
+    typedef std::shared_ptr<AsyncLogSink> ptr;
+
+public:
+    /// @param sink The LogSink to deliver messages to from the writer thread
+    /// @param capacity The number of messages the ring can hold; it is
+    /// rounded up to a power of two.  0 uses log.async.capacity
+    AsyncLogSink(LogSink::ptr sink, size_t capacity = 0);
+    /// Delivers all queued messages and stops the writer thread
+    ~AsyncLogSink();
+
+    void log(const std::string &logger, int64_t now, tid_t thread,
+             Log::Level level, const std::string &str, const char *file,
+             int line);
+    void logBinary(const std::string &logger, int64_t now, tid_t thread,
+                   Log::Level level, const BinaryLogSite &site,
+                   const char *args, size_t len);
+    void logFields(const std::string &logger, int64_t now, tid_t thread,
+                   Log::Level level, const std::string &str,
+                   const LogField *fields, size_t count, const char *file,
+                   int line);
+
+    /// Blocks until every message queued before the call has been delivered
+    /// to, and flushed by, the wrapped LogSink
+    void flush();
+
+    /// @return The LogSink messages are delivered to
+    LogSink::ptr sink() const { return m_sink; }
+    /// @return The number of messages the ring can hold
+    size_t capacity() const { return m_mask + 1; }
+    /// @return The number of messages dropped because the ring was full
+    uint64_t dropped() const {
+        return m_dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Record {
+        std::string logger;
+        // The message, or the encoded arguments of a binary message
+        std::string str;
+        const BinaryLogSite *site;
+        // Copies of a structured message's fields, whose string values point
+        // into fieldData
+        bool structured;
+        std::vector<LogField> fields;
+        std::string fieldData;
+        int64_t now;
+        tid_t thread;
+        Log::Level level;
+        const char *file;
+        int line;
+    };
+
+    struct Slot {
+        std::atomic<size_t> seq;
+        Record record;
+    };
+
+    bool tryPush(const std::string &logger, int64_t now, tid_t thread,
+                 Log::Level level, const BinaryLogSite *site, const char *str,
+                 size_t len, const LogField *fields, size_t count,
+                 const char *file, int line);
+    void push(const std::string &logger, int64_t now, tid_t thread,
+              Log::Level level, const BinaryLogSite *site, const char *str,
+              size_t len, const LogField *fields, size_t count,
+              const char *file, int line);
+    size_t drain();
+    void deliverBatch();
+    bool empty() const;
+    void wake();
+    void reportDropped();
+    void run();
+
+private:
+    LogSink::ptr m_sink;
+    std::unique_ptr<Slot[]> m_slots;
+    size_t m_mask;
+    bool m_blocking;
+    std::chrono::microseconds m_flushInterval;
+
+    // Producers claim slots on one cache line, and the writer thread frees
+    // them on another.  Padded rather than aligned: a C++11 new does not
+    // honor alignment beyond the fundamental one
+    char m_tailPad[64];
+    std::atomic<size_t> m_tail;
+    char m_headPad[64];
+    size_t m_head;
+    // Only used by the writer thread: the records being gathered for
+    // logBatch(), which still occupy the slots before m_head, and the last
+    // logger name looked up
+    std::vector<LogRecord> m_batch;
+    std::string m_batchLogger;
+    uint32_t m_batchLoggerId;
+    uint64_t m_reportedDropped;
+    char m_droppedPad[64];
+    std::atomic<uint64_t> m_dropped;
+    std::atomic<bool> m_sleeping;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::condition_variable m_flushed;
+    std::atomic<uint64_t> m_flushRequested;
+    uint64_t m_flushCompleted;
+    std::atomic<bool> m_stopping;
+    std::thread m_thread;
+};
+
+} // namespace Mordor2
+
+#endif
@@ -0,0 +1,386 @@
+#ifndef __MORDOR_BINARYLOG_H__
+#define __MORDOR_BINARYLOG_H__
+
+#include "log.h"
+#include "noncopyable.h"
+
+#include <atomic>
+#include <cstring>
+#include <istream>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+namespace Mordor2 {
+
+/// Binary logging defers formatting of a message until it is read.
+///
+/// Each MORDOR_LOG_BINARY statement registers its format string and the types
+/// of its arguments once, as a BinaryLogSite.  Afterwards, logging only
+/// encodes the raw argument values; a BinaryLogSink writes them together with
+/// the site id, timestamp and thread id, and the mordor2-logdecode tool turns
+/// the file back into text later.  LogSinks that do not understand binary
+/// messages receive them formatted as usual.
+///
+/// The format string uses {} for each argument, and {{ and }} for literal
+/// braces:
+///
+/// MORDOR_LOG_BINARY_INFO(g_log, "read {} bytes from {}", n, path);
+
+/// Type of an argument captured by a binary log statement
+enum class BinaryLogArg : uint8_t {
+    BOOL,
+    CHAR,
+    INT,
+    UINT,
+    DOUBLE,
+    STRING,
+    POINTER,
+};
+
+/// Static description of a binary log statement
+struct BinaryLogSite {
+    uint32_t id;
+    Log::Level level;
+    const char *file;
+    int line;
+    const char *format;
+    std::vector<BinaryLogArg> args;
+};
+
+/// Encoding of the supported argument types; other types do not compile
+template <class T, class Enable = void> struct BinaryLogTraits;
+
+template <> struct BinaryLogTraits<bool> {
+    static const BinaryLogArg type = BinaryLogArg::BOOL;
+    static void encode(std::string &buf, bool v) { buf.push_back(v ? 1 : 0); }
+};
+
+template <> struct BinaryLogTraits<char> {
+    static const BinaryLogArg type = BinaryLogArg::CHAR;
+    static void encode(std::string &buf, char v) { buf.push_back(v); }
+};
+
+template <class T>
+struct BinaryLogTraits<
+    T, typename std::enable_if<std::is_integral<T>::value &&
+                               std::is_signed<T>::value>::type> {
+    static const BinaryLogArg type = BinaryLogArg::INT;
+    static void encode(std::string &buf, T v);
+};
+
+template <class T>
+struct BinaryLogTraits<
+    T, typename std::enable_if<std::is_integral<T>::value &&
+                               std::is_unsigned<T>::value>::type> {
+    static const BinaryLogArg type = BinaryLogArg::UINT;
+    static void encode(std::string &buf, T v);
+};
+
+template <class T>
+struct BinaryLogTraits<T, typename std::enable_if<std::is_enum<T>::value>::type>
+    : BinaryLogTraits<typename std::underlying_type<T>::type> {
+    static void encode(std::string &buf, T v) {
+        BinaryLogTraits<typename std::underlying_type<T>::type>::encode(
+            buf, static_cast<typename std::underlying_type<T>::type>(v));
+    }
+};
+
+template <class T>
+struct BinaryLogTraits<
+    T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+    static const BinaryLogArg type = BinaryLogArg::DOUBLE;
+    static void encode(std::string &buf, T v);
+};
+
+template <> struct BinaryLogTraits<const char *> {
+    static const BinaryLogArg type = BinaryLogArg::STRING;
+    static void encode(std::string &buf, const char *v);
+};
+
+template <> struct BinaryLogTraits<char *> : BinaryLogTraits<const char *> {};
+
+template <> struct BinaryLogTraits<std::string> {
+    static const BinaryLogArg type = BinaryLogArg::STRING;
+    static void encode(std::string &buf, const std::string &v);
+};
+
+template <class T> struct BinaryLogTraits<T *> {
+    static const BinaryLogArg type = BinaryLogArg::POINTER;
+    static void encode(std::string &buf, const T *v);
+};
+
+/// Receives the binary messages that are below their Logger's level; only
+/// MORDOR_LOG_BINARY statements have one to give it
+/// @sa BinaryLog::recorder, FlightRecorder
+typedef void (*BinaryLogRecorder)(const std::string &logger, Log::Level level,
+                                  const BinaryLogSite &site, const char *args,
+                                  size_t len);
+
+/// Static class implementing the MORDOR_LOG_BINARY macros and wire format
+class BinaryLog {
+private:
+    BinaryLog();
+
+public:
+    /// Register a call site; called once per statement by MORDOR_LOG_BINARY
+    template <class... Args>
+    static const BinaryLogSite *registerSite(Log::Level level,
+                                             const char *file, int line,
+                                             const char *format,
+                                             const Args &...) {
+        std::vector<BinaryLogArg> args = {
+            BinaryLogTraits<typename std::decay<Args>::type>::type...};
+        return registerSite(level, file, line, format, args);
+    }
+    static const BinaryLogSite *
+    registerSite(Log::Level level, const char *file, int line,
+                 const char *format, const std::vector<BinaryLogArg> &args);
+
+    /// @return The site registered with id, or NULL
+    static const BinaryLogSite *site(uint32_t id);
+
+    /// Encode args, and log them from logger; the format is the site's
+    template <class... Args>
+    static void log(const std::shared_ptr<Logger> &logger, Log::Level level,
+                    const BinaryLogSite &site, const char * /* format */,
+                    const Args &... args) {
+        EncodeBuffer buf;
+        encode(buf.str(), args...);
+        logger->logBinary(level, site, buf.str().data(), buf.str().size());
+    }
+
+    /// Encode args, and pass them to the recorder, instead of logging them
+    template <class... Args>
+    static void record(const std::shared_ptr<Logger> &logger, Log::Level level,
+                       const BinaryLogSite &site, const char * /* format */,
+                       const Args &... args) {
+        BinaryLogRecorder fn = s_recorder.load(std::memory_order_acquire);
+        if (!fn)
+            return;
+        EncodeBuffer buf;
+        encode(buf.str(), args...);
+        fn(logger->name(), level, site, buf.str().data(), buf.str().size());
+    }
+
+    /// Have MORDOR_LOG_BINARY statements that are compiled in, but below
+    /// their Logger's level, encode their arguments and pass them to
+    /// recorder; NULL stops it.  Other statements below their level are not
+    /// passed to it, since they would have to be formatted.
+    static void recorder(BinaryLogRecorder recorder) {
+        s_recorder.store(recorder, std::memory_order_release);
+    }
+    /// @return If there is a recorder
+    static bool recording() {
+        return s_recorder.load(std::memory_order_relaxed) != NULL;
+    }
+
+    /// Format arguments encoded for site as text
+    /// @throws std::runtime_error If args are truncated
+    static void format(const BinaryLogSite &site, const char *args, size_t len,
+                       std::string &result);
+
+    static void writeVarint(std::string &buf, uint64_t v);
+    /// @return Bytes consumed from buf, or 0 if it is truncated
+    static size_t readVarint(const char *buf, size_t len, uint64_t &v);
+    static void writeString(std::string &buf, const char *str, size_t len);
+
+private:
+    static std::atomic<BinaryLogRecorder> s_recorder;
+
+    /// The per-thread buffer arguments are encoded into, or a buffer of its
+    /// own if a sink logs from within logBinary
+    class EncodeBuffer : public Noncopyable {
+    public:
+        EncodeBuffer();
+        ~EncodeBuffer();
+
+        std::string &str() { return *m_buf; }
+
+    private:
+        std::string *m_buf;
+        std::string m_own;
+    };
+
+    static void encode(std::string &) {}
+    template <class T, class... Rest>
+    static void encode(std::string &buf, const T &v, const Rest &... rest) {
+        BinaryLogTraits<typename std::decay<T>::type>::encode(buf, v);
+        encode(buf, rest...);
+    }
+};
+
+template <class T>
+void BinaryLogTraits<
+    T, typename std::enable_if<std::is_integral<T>::value &&
+                               std::is_signed<T>::value>::type>::
+    encode(std::string &buf, T v) {
+    // zigzag, so small negative numbers stay small
+    int64_t n = v;
+    BinaryLog::writeVarint(buf, (static_cast<uint64_t>(n) << 1) ^
+                                    static_cast<uint64_t>(n >> 63));
+}
+
+template <class T>
+void BinaryLogTraits<
+    T, typename std::enable_if<std::is_integral<T>::value &&
+                               std::is_unsigned<T>::value>::type>::
+    encode(std::string &buf, T v) {
+    BinaryLog::writeVarint(buf, v);
+}
+
+template <class T>
+void BinaryLogTraits<
+    T, typename std::enable_if<std::is_floating_point<T>::value>::type>::
+    encode(std::string &buf, T v) {
+    double d = v;
+    buf.append(reinterpret_cast<const char *>(&d), sizeof(d));
+}
+
+inline void BinaryLogTraits<const char *>::encode(std::string &buf,
+                                                  const char *v) {
+    if (!v)
+        v = "(null)";
+    BinaryLog::writeString(buf, v, strlen(v));
+}
+
+inline void BinaryLogTraits<std::string>::encode(std::string &buf,
+                                                 const std::string &v) {
+    BinaryLog::writeString(buf, v.data(), v.size());
+}
+
+template <class T>
+void BinaryLogTraits<T *>::encode(std::string &buf, const T *v) {
+    uint64_t p = reinterpret_cast<uintptr_t>(v);
+    buf.append(reinterpret_cast<const char *>(&p), sizeof(p));
+}
+
+/// A LogSink that writes a compact binary file
+///
+/// Binary messages are written as their site id and raw arguments, preceded
+/// the first time by the site's definition, so the file is self-describing;
+/// other messages are stored as text.  Each sink starts a new session in the
+/// file, so it can be appended to by successive processes, but not by several
+/// processes at once.  Use mordor2-logdecode to read it.
+class BinaryLogSink : public LogSink, public Noncopyable {
+public:
+    /// @param file The file to open and log to.  If it does not exist, it is
+    /// created.
+    /// @throws std::system_error If the file cannot be opened
+    BinaryLogSink(const std::string &file);
+    ~BinaryLogSink();
+
+    void log(const std::string &logger, int64_t now, tid_t thread,
+             Log::Level level, const std::string &str, const char *file,
+             int line);
+    void logBinary(const std::string &logger, int64_t now, tid_t thread,
+                   Log::Level level, const BinaryLogSite &site,
+                   const char *args, size_t len);
+    void flush();
+
+    std::string file() const { return m_file; }
+
+private:
+    uint32_t loggerId(const std::string &logger);
+    void writeBuffer();
+
+private:
+    std::string m_file;
+    int m_fd;
+    std::mutex m_mutex;
+    std::string m_buf;
+    std::vector<bool> m_sites;
+    std::unordered_map<std::string, uint32_t> m_loggers;
+};
+
+/// Reads the messages written by a BinaryLogSink
+class BinaryLogReader : public Noncopyable {
+public:
+    struct Message {
+        std::string logger;
+        int64_t now;
+        tid_t thread;
+        Log::Level level;
+        std::string str;
+        std::string file;
+        int line;
+    };
+
+public:
+    BinaryLogReader(std::istream &is);
+
+    /// Read the next message
+    /// @return false at the end of the input
+    /// @throws std::runtime_error If the input is not a valid binary log
+    bool next(Message &message);
+
+private:
+    uint8_t readByte();
+    uint64_t readVarint();
+    std::string readString();
+    /// A site or logger id, which the reader keeps a table of
+    uint64_t readId();
+    /// A level byte, which must be one that messages are logged at
+    Log::Level readLevel();
+    void readArgs(const BinaryLogSite &site, std::string &args);
+    void checkSession();
+
+private:
+    std::istream &m_is;
+    bool m_session;
+    std::vector<std::unique_ptr<BinaryLogSite>> m_sites;
+    std::vector<std::unique_ptr<std::string>> m_strings;
+    std::vector<std::string> m_loggers;
+};
+
+/// @addtogroup LogMacros
+/// @{
+
+/// Log a binary message at a particular level; the arguments are a format
+/// string literal and its arguments.  Below its Logger's level, it is still
+/// encoded for the BinaryLog::recorder, if there is one.
+#define MORDOR_LOG_BINARY(lg, level, ...)                                      \
+    do {                                                                       \
+        bool _mordor_enabled = MORDOR_LOG_ENABLED(lg, level);                  \
+        if (_mordor_enabled ||                                                 \
+            (static_cast<int>(level) <= MORDOR_LOG_MIN_LEVEL &&                \
+             ::Mordor2::BinaryLog::recording())) {                             \
+            static const ::Mordor2::BinaryLogSite *_mordor_site =              \
+                ::Mordor2::BinaryLog::registerSite(level, __FILENAME__,        \
+                                                   __LINE__, __VA_ARGS__);     \
+            if (_mordor_enabled)                                               \
+                ::Mordor2::BinaryLog::log((lg), level, *_mordor_site,          \
+                                          __VA_ARGS__);                        \
+            else                                                               \
+                ::Mordor2::BinaryLog::record((lg), level, *_mordor_site,       \
+                                             __VA_ARGS__);                     \
+        }                                                                      \
+    } while (0)
+/// Log a fatal error in binary
+#define MORDOR_LOG_BINARY_FATAL(log, ...)                                      \
+    MORDOR_LOG_BINARY(log, ::Mordor2::Log::Level::FATAL, __VA_ARGS__)
+/// Log an error in binary
+#define MORDOR_LOG_BINARY_ERROR(log, ...)                                      \
+    MORDOR_LOG_BINARY(log, ::Mordor2::Log::Level::ERROR, __VA_ARGS__)
+/// Log a warning in binary
+#define MORDOR_LOG_BINARY_WARNING(log, ...)                                    \
+    MORDOR_LOG_BINARY(log, ::Mordor2::Log::Level::WARNING, __VA_ARGS__)
+/// Log an informational message in binary
+#define MORDOR_LOG_BINARY_INFO(log, ...)                                       \
+    MORDOR_LOG_BINARY(log, ::Mordor2::Log::Level::INFO, __VA_ARGS__)
+/// Log a verbose message in binary
+#define MORDOR_LOG_BINARY_VERBOSE(log, ...)                                    \
+    MORDOR_LOG_BINARY(log, ::Mordor2::Log::Level::VERBOSE, __VA_ARGS__)
+/// Log a debug message in binary
+#define MORDOR_LOG_BINARY_DEBUG(log, ...)                                      \
+    MORDOR_LOG_BINARY(log, ::Mordor2::Log::Level::DEBUG, __VA_ARGS__)
+/// Log a trace message in binary
+#define MORDOR_LOG_BINARY_TRACE(log, ...)                                      \
+    MORDOR_LOG_BINARY(log, ::Mordor2::Log::Level::TRACE, __VA_ARGS__)
+/// @}
+
+} // namespace Mordor2
+
+#endif
@@ -3,13 +3,18 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
 #include "noncopyable.h"
+#include "rcu.h"
 
 #include <assert.h>
+#include <atomic>
 #include <functional>
 #include <map>
 #include <memory>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
+#include <vector>
 
 namespace Mordor2 {
 
@@ -36,7 +41,9 @@ double.  To access the specific value it is necessary the use the correctly
 templated ConfigVar object.  e.g. ConfigVar<std::string> to read a string.
 For convenience the toString() and fromString() can be used to
 access the value in a general way, for example when iterating through all the
-configuration variables.
+configuration variables.  fromString() parses the value with operator>>,
+except that a ConfigVar<std::string> takes the whole string, spaces and all,
+rather than its first word.
 
 A ConfigVar can only be defined once (via the templated version of
 Config::lookup()), and this typically happens at global scope in a source code
@@ -69,6 +76,13 @@ ConfigVar<bool>::ptr boolVar = boost::dynamic_pointer_cast<ConfigVar<bool>
 In this case the type specified must exactly match the type used when the
 ConfigVar was defined.
 
+Code that reads a ConfigVar it does not own on a hot path can resolve it once
+into a ConfigHandle instead, which checks the type up front and reads through
+a per-thread copy:
+
+static ConfigHandle<std::string> servername("myapp.server");
+connect(servername.val());
+
 In addition to programmatic access it is possible to override the default
 value of a ConfigVar using built in support for reading environmental
 variables (Config::loadFromEnvironment()), Windows registry settings
@@ -113,18 +127,97 @@ public:
     }
 
     virtual std::string toString() const = 0;
+    /// Parse str with operator>>; a std::string is taken whole
     /// @return If the new value was accepted
     virtual bool fromString(const std::string &str) = 0;
 
+protected:
+    /// Count a change to the value, once it is visible to readers
+    static void changed() {
+        s_generation.fetch_add(1, std::memory_order_release);
+    }
+
 protected:
     std::function<void()> m_cb;
 private:
+    friend class Config;
+
     std::string m_name, m_description;
     bool m_lockable;
+    static std::atomic<uint64_t> s_generation;
 };
 
 template <class T> bool isConfigNotLocked(const T &);
 
+/// Holds the value of a ConfigVar, so that it can be read without a lock
+/// while it is being set; reading it is on the hot path of whatever the
+/// ConfigVar configures
+template <class T, bool Word = std::is_trivially_copyable<T>::value &&
+                               sizeof(T) <= sizeof(uint64_t)>
+class ConfigVarValue;
+
+/// A value that fits in a word is held in a std::atomic
+template <class T> class ConfigVarValue<T, true> : public Noncopyable {
+public:
+    explicit ConfigVarValue(const T &v) : m_val(v) {}
+
+    T load() const { return m_val.load(std::memory_order_acquire); }
+
+    /// @return false if it already was v
+    bool store(const T &v) {
+        T old = m_val.load(std::memory_order_relaxed);
+        do {
+            if (old == v)
+                return false;
+        } while (!m_val.compare_exchange_weak(old, v,
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed));
+        return true;
+    }
+
+private:
+    std::atomic<T> m_val;
+};
+
+/// Any other value is copied into an immutable snapshot, which is published
+/// by swapping a pointer to it in.  Readers copy the value out inside an
+/// Rcu::ReadLock, and a writer retires the snapshot it replaced, to be freed
+/// once none of them can still be copying it; so setting the value waits for
+/// the readers, but reading it never does.
+template <class T> class ConfigVarValue<T, false> : public Noncopyable {
+public:
+    explicit ConfigVarValue(const T &v) : m_current(new T(v)) {}
+    ~ConfigVarValue() { delete m_current.load(std::memory_order_relaxed); }
+
+    T load() const {
+        Rcu::ReadLock lock;
+        return *m_current.load(std::memory_order_seq_cst);
+    }
+
+    /// @return false if it already was v
+    bool store(const T &v) {
+        std::unique_ptr<const T> snapshot(new T(v));
+        const T *old;
+        {
+            // Another writer may free old as soon as it replaces it
+            Rcu::ReadLock lock;
+            old = m_current.load(std::memory_order_seq_cst);
+            do {
+                if (*old == v)
+                    return false;
+            } while (!m_current.compare_exchange_weak(
+                old, snapshot.get(), std::memory_order_seq_cst));
+        }
+        snapshot.release();
+        Rcu::retire(old);
+        Rcu::reclaim();
+        return true;
+    }
+
+private:
+    std::atomic<const T *> m_current;
+};
+
 template <class T> class ConfigVar : public ConfigVarBase {
 public:
     struct BreakOnFailureCombiner {
@@ -153,7 +246,7 @@ public:
 
     std::string toString() const {
         std::stringstream ss;
-        ss << m_val;
+        ss << val();
         return ss.str();
     }
 
@@ -169,13 +262,12 @@ public:
         }
     }
 
-    // TODO: atomicCompareExchange and/or mutex
-    T val() const { return m_val; }
+    /// Safe to call while the value is being set, without taking a lock
+    T val() const { return m_val.load(); }
+    /// Calls the monitor once the new value is visible to readers
     bool val(const T &v) {
-        T oldVal = m_val;
-        if (oldVal != v) {
-            m_val = v;
-
+        if (m_val.store(v)) {
+            changed();
             if (m_cb)
                 m_cb();
         }
@@ -183,9 +275,17 @@ public:
     }
 
 private:
-    T m_val;
+    ConfigVarValue<T> m_val;
 };
 
+/// Strings are taken whole; operator>> would stop at the first space, and
+/// cut a value such as the log.pattern "%d [%l] %m" short when it is set from
+/// the environment or the command line
+template <>
+inline bool ConfigVar<std::string>::fromString(const std::string &str) {
+    return val(str);
+}
+
 class Config {
 private:
     static std::string getName(const ConfigVarBase::ptr &var) {
@@ -228,6 +328,12 @@ public:
     static void lock(bool locked) { s_locked = locked; }
     static bool isLocked() { return s_locked; }
 
+    /// Changes whenever any ConfigVar's value does, after the new value is
+    /// visible to readers
+    static uint64_t generation() {
+        return ConfigVarBase::s_generation.load(std::memory_order_acquire);
+    }
+
 private:
     static ConfigVarSet &vars() {
         static ConfigVarSet vars;
@@ -240,6 +346,87 @@ template <class T> bool isConfigNotLocked(const T &) {
     return !Config::isLocked();
 }
 
+/// A ConfigVar looked up by name once, and read through a per-thread copy
+///
+/// Each thread keeps a copy of the value of each handle it reads, tagged
+/// with Config::generation() as it was when the copy was made; while the
+/// generation has not changed, reading the value is an atomic load and a
+/// compare, without going near the registry or the ConfigVar.  Any change
+/// to any ConfigVar makes every thread copy its handles' values again, which
+/// is cheap since values change rarely.
+///
+/// The copies are indexed by handle, and the indexes are not reused, so
+/// handles are meant to be long-lived, like the ConfigVars themselves.
+template <class T> class ConfigHandle {
+public:
+    /// @throws std::invalid_argument With what() == name if there is no
+    /// ConfigVar<T> with the name
+    explicit ConfigHandle(const std::string &name)
+        : m_var(std::dynamic_pointer_cast<ConfigVar<T>>(Config::lookup(name))),
+          m_index(nextIndex()) {
+        if (!m_var)
+            throw std::invalid_argument(name);
+    }
+    explicit ConfigHandle(typename ConfigVar<T>::ptr var)
+        : m_var(var), m_index(nextIndex()) {
+        assert(m_var);
+    }
+
+    /// This thread's copy of the value.  The reference stays valid for as
+    /// long as the thread, but the value it refers to is replaced when the
+    /// thread reads the handle after a change.
+    const T &val() const {
+        uint64_t generation = Config::generation();
+        std::vector<std::unique_ptr<Copy>> &copies = threadCopies();
+        if (m_index < copies.size()) {
+            const Copy *copy = copies[m_index].get();
+            if (copy && copy->generation == generation)
+                return copy->value;
+        }
+        return update(generation);
+    }
+
+    typename ConfigVar<T>::ptr var() const { return m_var; }
+
+private:
+    struct Copy {
+        Copy(const T &v, uint64_t g) : value(v), generation(g) {}
+
+        T value;
+        uint64_t generation;
+    };
+
+    static size_t nextIndex() {
+        static std::atomic<size_t> next(0);
+        return next.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /// Each thread's copies of the handles of T, by index.  Each copy is
+    /// allocated on its own, so references to it survive the vector growing
+    static std::vector<std::unique_ptr<Copy>> &threadCopies() {
+        static thread_local std::vector<std::unique_ptr<Copy>> copies;
+        return copies;
+    }
+
+    const T &update(uint64_t generation) const {
+        std::vector<std::unique_ptr<Copy>> &copies = threadCopies();
+        if (m_index >= copies.size())
+            copies.resize(m_index + 1);
+        std::unique_ptr<Copy> &copy = copies[m_index];
+        if (copy) {
+            copy->value = m_var->val();
+            copy->generation = generation;
+        } else {
+            copy.reset(new Copy(m_var->val(), generation));
+        }
+        return copy->value;
+    }
+
+private:
+    typename ConfigVar<T>::ptr m_var;
+    size_t m_index;
+};
+
 /// helper class to allow temporarily change the ConfigVar Value
 ///
 /// When an instance is created, the specified ConfigVar is hijacked to the @c
@@ -0,0 +1,117 @@
+#ifndef __MORDOR_DEDUPLOGSINK_H__
+#define __MORDOR_DEDUPLOGSINK_H__
+
+#include "log.h"
+#include "noncopyable.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace Mordor2 {
+
+/// A LogSink that collapses repeated messages before passing them on to
+/// another LogSink
+///
+/// A message is a repeat if the same logger logged it at the same level, from
+/// the same file and line, with the same text, less than window after the
+/// first time.  The first occurrence is passed on immediately, and repeats
+/// are only counted; once the window is over, the count is passed on as
+/// "last message repeated N times", with the logger, level, file, line,
+/// thread and timestamp of the last repeat.  Binary messages are compared by
+/// their encoded arguments, and structured messages by their text with the
+/// fields formatted; both are passed on as they came.
+///
+/// Recent messages are kept in a bounded table, split into stripes with a
+/// lock each, so threads logging different messages rarely contend.  When a
+/// message's place in the table is taken, the least recently logged message
+/// there is evicted, and its repeats are reported early.  Repeats that are
+/// not followed by another occurrence are reported by whichever message is
+/// logged after their window ends, or by flush().
+///
+/// The log.dedup.* ConfigVars provide the defaults for newly constructed
+/// DedupLogSinks; setting log.dedup wraps the log.stdout and log.file sinks.
+class DedupLogSink : public LogSink, public Noncopyable {
+public:
+    typedef std::shared_ptr<DedupLogSink> ptr;
+
+public:
+    /// @param sink The LogSink to pass messages on to
+    /// @param window How long repeats of a message are collapsed for; negative
+    /// uses log.dedup.windowusec
+    /// @param entries The number of distinct messages remembered; 0 uses
+    /// log.dedup.entries
+    DedupLogSink(LogSink::ptr sink,
+                 std::chrono::microseconds window =
+                     std::chrono::microseconds(-1),
+                 size_t entries = 0);
+    /// Reports any pending repeats
+    ~DedupLogSink();
+
+    void log(const std::string &logger, int64_t now, tid_t thread,
+             Log::Level level, const std::string &str, const char *file,
+             int line);
+    void logBinary(const std::string &logger, int64_t now, tid_t thread,
+                   Log::Level level, const BinaryLogSite &site,
+                   const char *args, size_t len);
+    void logFields(const std::string &logger, int64_t now, tid_t thread,
+                   Log::Level level, const std::string &str,
+                   const LogField *fields, size_t count, const char *file,
+                   int line);
+
+    /// Reports every pending repeat, and flushes the wrapped LogSink
+    void flush();
+
+    /// @return The LogSink messages are passed on to
+    LogSink::ptr sink() const { return m_sink; }
+    /// @return The number of messages collapsed so far
+    uint64_t suppressed() const {
+        return m_suppressed.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Entry {
+        bool used;
+        size_t hash;
+        std::string logger;
+        Log::Level level;
+        const char *file;
+        int line;
+        const BinaryLogSite *site;
+        // The message, or the encoded arguments of a binary message
+        std::string str;
+        int64_t first;
+        int64_t last;
+        tid_t thread;
+        uint64_t repeats;
+    };
+
+    // Padded so neighbouring stripes' mutexes are a cache line apart; a
+    // C++11 new[] does not honor alignment beyond the fundamental one
+    struct Stripe {
+        std::mutex mutex;
+        std::unique_ptr<Entry[]> entries;
+        char pad[64];
+    };
+
+    bool admit(const std::string &logger, int64_t now, tid_t thread,
+               Log::Level level, const BinaryLogSite *site, const char *str,
+               size_t len, const char *file, int line);
+    void sweep(int64_t now, bool all);
+    void report(const Entry &entry);
+
+private:
+    LogSink::ptr m_sink;
+    int64_t m_window;
+    size_t m_sets;
+    std::unique_ptr<Stripe[]> m_stripes;
+    char m_nextSweepPad[64];
+    std::atomic<int64_t> m_nextSweep;
+    std::atomic<uint64_t> m_suppressed;
+};
+
+} // namespace Mordor2
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef __MORDOR_FLIGHTRECORDER_H__
+#define __MORDOR_FLIGHTRECORDER_H__
+
+#include "log.h"
+
+#include <string>
+
+namespace Mordor2 {
+
+/// Keeps the most recent messages of every thread in memory, to dump when
+/// the process crashes
+///
+/// Each thread records into a ring of fixed-size slots of its own, so
+/// recording takes no lock.  A message's arguments are recorded raw when it
+/// comes from MORDOR_LOG_BINARY, and formatted only if it is dumped; other
+/// messages are recorded as text, truncated to fit their slot.
+///
+/// While the recorder is enabled, it also captures MORDOR_LOG_BINARY
+/// statements that are below their Logger's level, which costs them only
+/// encoding their arguments.  Only those are captured below their level:
+/// MORDOR_LOG, MORDOR_LOGF and MORDOR_LOG_KV statements below their
+/// Logger's level are skipped as usual, since formatting them is the cost
+/// that their level avoids, so the recorder only has them when their level
+/// is enabled and it gets them through sink().  Use MORDOR_LOG_BINARY for
+/// the detail that should only be kept in case of a crash.
+///
+/// dump() writes the last messages of all threads in timestamp order, using
+/// only async-signal-safe calls, so it can be called from a signal handler;
+/// enabling the recorder installs handlers that do so on SIGSEGV, SIGBUS,
+/// SIGFPE, SIGILL and SIGABRT.  Timestamps in a dump are in UTC, since local
+/// time cannot be computed safely in a signal handler.
+///
+/// Setting log.flightrecorder enables it, and adds sink() to the root Logger;
+/// the log.flightrecorder.* ConfigVars configure it.
+class FlightRecorder {
+private:
+    FlightRecorder();
+
+public:
+    /// Start capturing MORDOR_LOG_BINARY messages below their Logger's
+    /// level, and install the crash handlers
+    static void enable();
+    /// Stop capturing MORDOR_LOG_BINARY messages below their Logger's level
+    static void disable();
+
+    /// @return The LogSink that records the messages it receives
+    static LogSink::ptr sink();
+
+    /// Record a message in the calling thread's ring
+    static void record(const std::string &logger, int64_t now, tid_t thread,
+                       Log::Level level, const std::string &str,
+                       const char *file, int line);
+    /// Record a binary message in the calling thread's ring
+    static void recordBinary(const std::string &logger, int64_t now,
+                             tid_t thread, Log::Level level,
+                             const BinaryLogSite &site, const char *args,
+                             size_t len);
+
+    /// Write the last count messages recorded to fd; async-signal-safe
+    static void dump(int fd, size_t count);
+    /// Write the last log.flightrecorder.dumpcount messages to
+    /// log.flightrecorder.dumpfile, or stderr; async-signal-safe
+    static void dump();
+};
+
+/// A LogSink that records messages in the FlightRecorder
+class FlightRecorderLogSink : public LogSink {
+public:
+    void log(const std::string &logger, int64_t now, tid_t thread,
+             Log::Level level, const std::string &str, const char *file,
+             int line);
+    void logBinary(const std::string &logger, int64_t now, tid_t thread,
+                   Log::Level level, const BinaryLogSite &site,
+                   const char *args, size_t len);
+};
+
+} // namespace Mordor2
+
+#endif
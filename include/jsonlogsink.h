@@ -0,0 +1,58 @@
+#ifndef __MORDOR_JSONLOGSINK_H__
+#define __MORDOR_JSONLOGSINK_H__
+
+#include "log.h"
+#include "noncopyable.h"
+
+#include <string>
+
+namespace Mordor2 {
+
+/// A LogSink that appends messages to a file as JSON, one object per line
+///
+/// Each message is an object with "time" (UTC, ISO 8601 with microseconds),
+/// "level", "logger", "thread", "file", "line" and "msg" members, followed by
+/// the message's structured fields with their own types; a field with the
+/// same key as one of the fixed members follows it, so most parsers keep the
+/// field.  Strings are escaped as JSON requires, and otherwise written as
+/// they are, so they should be UTF-8.
+///
+/// Objects are serialized into a per-thread buffer that is reused, so once
+/// it has grown to fit, writing a message does not allocate.  The file is
+/// opened with O_APPEND and each object is written with a single write, so
+/// threads and processes logging to the same file do not interleave.
+///
+/// Setting log.json adds one to the root Logger.
+class JsonLogSink : public LogSink, public Noncopyable {
+public:
+    /// @param file The file to open and log to.  If it does not exist, it is
+    /// created.
+    /// @throws std::system_error If the file cannot be opened
+    JsonLogSink(const std::string &file);
+    ~JsonLogSink();
+
+    void log(const std::string &logger, int64_t now, tid_t thread,
+             Log::Level level, const std::string &str, const char *file,
+             int line);
+    void logFields(const std::string &logger, int64_t now, tid_t thread,
+                   Log::Level level, const std::string &str,
+                   const LogField *fields, size_t count, const char *file,
+                   int line);
+    /// Writes all of the messages with a single write
+    void logBatch(const LogRecord *records, size_t count);
+
+    std::string file() const { return m_file; }
+
+private:
+    static void format(std::string &buf, const LogRecord &record,
+                       const LogField *fields, size_t count);
+    void write(const std::string &buf);
+
+private:
+    std::string m_file;
+    int m_fd;
+};
+
+} // namespace Mordor2
+
+#endif
@@ -2,16 +2,26 @@
 #define __MORDOR_LOG_H__
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <atomic>
+#include <cstring>
 #include <fstream>
 #include <functional>
+#include <initializer_list>
 #include <list>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
 
 // For tid_t
 #include <pthread.h>
 
+#include "noncopyable.h"
+#include "timestamp.h"
+
 namespace Mordor2 {
 
 using tid_t = pid_t;
@@ -88,6 +98,9 @@ public:
     };
 
     /// Find (or create) a logger with the specified name
+    ///
+    /// Finding an existing logger is a lock-free hash table lookup, and does
+    /// not allocate.
     static std::shared_ptr<Logger> lookup(const std::string &name);
 
     /// Call dg for each registered Logger.
@@ -98,11 +111,126 @@ public:
     /// Return the root of the Logger hierarchy
     static std::shared_ptr<Logger> root();
 
+    /// @return The id of the Logger named name, creating it if necessary
+    /// @sa Logger::id
+    static uint32_t intern(const std::string &name);
+    /// @return The id of the Logger named name, or LogRecord::kNoLoggerId if
+    /// there is none; a lock-free lookup, which never creates a Logger
+    static uint32_t findId(const std::string &name);
+
     /// Enable all logs whose level is smaller than the specification
     static void setLogLevel(Log::Level level);
 };
 
 class Stream;
+struct BinaryLogSite;
+
+/// A reference to characters owned by someone else
+struct LogStringRef {
+    const char *data;
+    size_t len;
+};
+
+/// A typed field of a structured log message
+///
+/// Fields are made with kv(), and are passed to LogSinks as they are, so
+/// only sinks that write text ever format them.  A field only references its
+/// key and string value; both must outlive the log statement, which string
+/// literals and temporaries created in the statement do.
+/// @sa MORDOR_LOG_KV
+struct LogField {
+    enum class Type : uint8_t { BOOL, INT, UINT, DOUBLE, STRING };
+
+    typedef LogStringRef StringRef;
+
+    const char *key;
+    Type type;
+    union {
+        bool b;
+        int64_t i;
+        uint64_t u;
+        double d;
+        StringRef str;
+    };
+
+    /// Append " key=value" to buf for each field; string values are quoted
+    /// if they are empty, or contain spaces, quotes or '='
+    static void format(std::string &buf, const LogField *fields,
+                       size_t count);
+};
+
+/// @return A field of a structured log message
+inline LogField kv(const char *key, bool value) {
+    LogField field;
+    field.key = key;
+    field.type = LogField::Type::BOOL;
+    field.b = value;
+    return field;
+}
+template <class T>
+typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value,
+                        LogField>::type
+kv(const char *key, T value) {
+    LogField field;
+    field.key = key;
+    field.type = LogField::Type::INT;
+    field.i = value;
+    return field;
+}
+template <class T>
+typename std::enable_if<std::is_integral<T>::value &&
+                            std::is_unsigned<T>::value,
+                        LogField>::type
+kv(const char *key, T value) {
+    LogField field;
+    field.key = key;
+    field.type = LogField::Type::UINT;
+    field.u = value;
+    return field;
+}
+template <class T>
+typename std::enable_if<std::is_floating_point<T>::value, LogField>::type
+kv(const char *key, T value) {
+    LogField field;
+    field.key = key;
+    field.type = LogField::Type::DOUBLE;
+    field.d = value;
+    return field;
+}
+inline LogField kv(const char *key, const char *value, size_t len) {
+    LogField field;
+    field.key = key;
+    field.type = LogField::Type::STRING;
+    field.str.data = value;
+    field.str.len = len;
+    return field;
+}
+inline LogField kv(const char *key, const char *value) {
+    return kv(key, value, value ? strlen(value) : 0);
+}
+inline LogField kv(const char *key, const std::string &value) {
+    return kv(key, value.data(), value.size());
+}
+
+/// A single log message, as passed to LogSink::logBatch
+///
+/// The strings only reference their storage, which is valid during the call.
+struct LogRecord {
+    /// For a record whose logger was not looked up, or is not a registered
+    /// Logger; 0 is a real id, the root Logger's
+    static const uint32_t kNoLoggerId = UINT32_MAX;
+
+    /// The interned id of logger, or kNoLoggerId
+    /// @sa Logger::id
+    uint32_t loggerId;
+    LogStringRef logger;
+    int64_t now;
+    tid_t thread;
+    Log::Level level;
+    LogStringRef str;
+    const char *file;
+    int line;
+};
 
 /// @sa LogMacros
 
@@ -130,22 +258,66 @@ public:
     virtual void log(const std::string &logger, int64_t now, tid_t thread,
                      Log::Level level, const std::string &str, const char *file,
                      int line) = 0;
+
+    /// @brief Receives details of a single binary log message
+    ///
+    /// The default implementation formats the message and passes it to log().
+    /// @param site The statement that generated the message
+    /// @param args The message's arguments, encoded as described by site
+    /// @param len The size of args
+    /// @sa BinaryLog
+    virtual void logBinary(const std::string &logger, int64_t now,
+                           tid_t thread, Log::Level level,
+                           const BinaryLogSite &site, const char *args,
+                           size_t len);
+
+    /// @brief Receives several log messages at once
+    ///
+    /// Sinks that hand messages off in bulk, such as AsyncLogSink, call this
+    /// instead of log(), so that a sink can format and write all of them
+    /// together.  The default implementation passes each one to log().
+    /// @param records The messages, in the order they were logged
+    /// @param count The number of messages
+    virtual void logBatch(const LogRecord *records, size_t count);
+
+    /// @brief Receives details of a single structured log message
+    ///
+    /// The default implementation appends the fields to the message as
+    /// LogField::format() does, and passes it to log().
+    /// @param fields The message's fields; they are only valid during the
+    /// call
+    /// @param count The number of fields
+    /// @sa MORDOR_LOG_KV
+    virtual void logFields(const std::string &logger, int64_t now,
+                           tid_t thread, Log::Level level,
+                           const std::string &str, const LogField *fields,
+                           size_t count, const char *file, int line);
+
+    /// @brief Pushes any buffered messages to their destination
+    virtual void flush() {}
 };
 
 /// A LogSink that dumps message to stdout (std::cout)
+///
+/// Messages are laid out by log.pattern, or
+/// "%d{%F %T.%us} [%l] %t %n %f:%L - %m"
+/// @sa LogLayout
 class StdoutLogSink : public LogSink {
 public:
     void log(const std::string &logger, int64_t now, tid_t thread,
              Log::Level level, const std::string &str, const char *file,
              int line);
+
+    void flush();
 };
 
 /// A LogSink that appends messages to a file
 ///
-/// The file is opened in append mode, so multiple processes and threads can
-/// log to the same file simultaneously, without fear of corrupting each
-/// others' messages.  The messages will still be intermingled, but each one
-/// will be atomic
+/// The file is opened in append mode, and flushed after every message, so
+/// multiple threads and processes can log to the same file; a message longer
+/// than the stream's buffer may be split between several writes, though.
+/// AppendFileLogSink guarantees that each message is atomic, and batches
+/// writes.
 class FileLogSink : public LogSink {
 public:
     /// @param file The file to open and log to.  If it does not exist, it is
@@ -155,43 +327,200 @@ public:
     void log(const std::string &logger, int64_t now, tid_t thread,
              Log::Level level, const std::string &str, const char *file,
              int line);
+    /// Writes all of the messages with a single flush
+    void logBatch(const LogRecord *records, size_t count);
+
+    void flush();
 
     std::string file() const { return m_file; }
 
+    /// Append record, formatted as FileLogSink writes it (log.pattern, or
+    /// "[%d{%F %T.%us}] %l %t  %n %f:%L %m"), and a newline, to buf; other
+    /// file sinks use it to write the same format
+    /// @sa LogLayout
+    static void format(std::string &buf, const LogRecord &record);
+    static void format(std::string &buf, const std::string &logger,
+                       int64_t now, tid_t thread, Log::Level level,
+                       const std::string &str, const char *file, int line);
+
 private:
     std::string m_file;
+    std::mutex m_mutex;
     std::shared_ptr<std::ofstream> m_stream;
 };
 
+/// A std::streambuf that formats into a growable, reusable character buffer
+///
+/// Unlike std::stringbuf, the storage is kept between messages, so once it has
+/// grown to fit the messages a thread logs, formatting does not allocate.
+class LogStreamBuf : public std::streambuf {
+public:
+    LogStreamBuf();
+
+    /// Discard the current contents, keeping the storage
+    void reset();
+    /// @return The characters written since the last reset()
+    const std::string &str();
+
+    /// Write characters directly, bypassing std::ostream
+    void append(const char *s, size_t n) {
+        if (static_cast<size_t>(epptr() - pptr()) < n)
+            grow(n);
+        memcpy(pptr(), s, n);
+        pbump(static_cast<int>(n));
+    }
+    void append(char c) {
+        if (pptr() == epptr())
+            grow(1);
+        *pptr() = c;
+        pbump(1);
+    }
+
+protected:
+    int_type overflow(int_type ch);
+    std::streamsize xsputn(const char *s, std::streamsize n);
+
+private:
+    void grow(size_t needed);
+
+private:
+    std::string m_buf;
+};
+
+class LogStream;
+
 /// LogEvent is an intermediary class.  It is returned by Logger::log, owns a
 /// std::ostream, and on destruction it will log whatever was streamed to it.
 /// It *is* copyable, because it is returned from Logger::log, but shouldn't
 /// be copied, because when it destructs it will log whatever was built up so
 /// far, in addition to the copy logging it.
+///
+/// The std::ostream is borrowed from a small per-thread pool, so a typical
+/// message is formatted without any heap allocation.
 struct LogEvent {
     friend class Logger;
 
 private:
     LogEvent(std::shared_ptr<Logger> logger, Log::Level level, const char *file,
-             int line)
-        : m_logger(logger), m_level(level), m_file(file), m_line(line) {}
+             int line);
 
 public:
-    LogEvent(const LogEvent &copy)
-        : m_logger(copy.m_logger),
-          m_level(copy.m_level),
-          m_file(copy.m_file),
-          m_line(copy.m_line) {}
+    LogEvent(const LogEvent &copy);
 
     ~LogEvent();
-    std::ostream &os() { return m_os; }
+    std::ostream &os();
+    /// @return The buffer os() writes to, to format into directly
+    LogStreamBuf &buf();
 
 private:
     std::shared_ptr<Logger> m_logger;
     Log::Level m_level;
     const char *m_file;
     int m_line;
-    std::ostringstream m_os;
+    LogStream *m_stream;
+};
+
+/// Per-statement cache of whether a Logger is enabled at a level
+///
+/// Each logging macro keeps one in static storage.  It remembers the decision
+/// for the first Logger the statement logs to, tagged with the generation of
+/// Logger levels it was made in; changing any Logger's level starts a new
+/// generation, which invalidates every cached decision.
+struct LogSiteCache {
+    std::atomic<const Logger *> logger;
+    /// generation << 4 | level << 1 | enabled
+    std::atomic<uint32_t> state;
+};
+
+/// Per-statement state of the rate limited logging macros
+///
+/// Each of MORDOR_LOG_EVERY_N, MORDOR_LOG_FIRST_N, MORDOR_LOG_EVERY_T and
+/// MORDOR_LOG_RATE_LIMITED keeps one in static storage, and updates it with
+/// atomic operations only.  Calls that are not allowed through are counted,
+/// and the count is logged at the statement's level as "suppressed N
+/// messages" at most every log.ratelimit.summaryinterval seconds, by the
+/// first call after the interval has passed, whether it is allowed through
+/// (before its message) or not.
+struct LogRateLimit {
+    std::atomic<uint64_t> count;
+    /// For the token bucket: when it will be full again, in nanoseconds of
+    /// the coarse monotonic clock (the "theoretical arrival time" of GCRA)
+    std::atomic<int64_t> full;
+    std::atomic<uint64_t> suppressed;
+    std::atomic<int64_t> lastSummary;
+
+    /// @return If this is the first of every n calls
+    bool everyN(Logger &logger, Log::Level level, const char *file, int line,
+                uint64_t n) {
+        if (n <= 1 || count.fetch_add(1, std::memory_order_relaxed) % n == 0)
+            return allow(logger, level, file, line);
+        return suppress(logger, level, file, line);
+    }
+
+    /// @return If this is one of the first n calls
+    bool firstN(Logger &logger, Log::Level level, const char *file, int line,
+                uint64_t n) {
+        // Stop writing to the counter once it can no longer matter
+        if (count.load(std::memory_order_relaxed) < n &&
+            count.fetch_add(1, std::memory_order_relaxed) < n)
+            return allow(logger, level, file, line);
+        return suppress(logger, level, file, line);
+    }
+
+    /// @return If seconds have passed since the last call allowed through
+    bool everyT(Logger &logger, Log::Level level, const char *file, int line,
+                double seconds) {
+        if (seconds <= 0)
+            return allow(logger, level, file, line);
+        return rate(logger, level, file, line, 1 / seconds, 1);
+    }
+
+    /// @return If a token was available in a bucket holding burst tokens,
+    /// that is refilled at perSecond tokens a second
+    bool rate(Logger &logger, Log::Level level, const char *file, int line,
+              double perSecond, double burst);
+
+private:
+    bool allow(Logger &logger, Log::Level level, const char *file, int line) {
+        if (suppressed.load(std::memory_order_relaxed))
+            summarizeIfDue(logger, level, file, line, monotonicNow());
+        return true;
+    }
+    bool suppress(Logger &logger, Log::Level level, const char *file,
+                  int line);
+    /// Log the count of suppressed calls, if the interval has passed since
+    /// the last summary
+    void summarizeIfDue(Logger &logger, Log::Level level, const char *file,
+                        int line, int64_t now);
+    void summarize(Logger &logger, Log::Level level, const char *file,
+                   int line);
+    static int64_t monotonicNow();
+};
+
+/// Logs how long the scope it is declared in took, if at least threshold
+/// @sa MORDOR_LOG_SCOPED_LATENCY
+class LogScopedLatency : public Noncopyable {
+public:
+    LogScopedLatency(Logger &logger, Log::Level level, Duration threshold,
+                     const char *file, int line)
+        : m_logger(logger), m_level(level), m_threshold(threshold),
+          m_file(file), m_line(line) {}
+    ~LogScopedLatency() {
+        Duration elapsed = m_stopwatch.elapsed();
+        if (elapsed >= m_threshold)
+            report(elapsed);
+    }
+
+private:
+    void report(Duration elapsed);
+
+private:
+    Logger &m_logger;
+    Log::Level m_level;
+    Duration m_threshold;
+    const char *m_file;
+    int m_line;
+    Stopwatch m_stopwatch;
 };
 
 struct LoggerLess {
@@ -200,6 +529,16 @@ struct LoggerLess {
 };
 
 /// An individual Logger.
+///
+/// Loggers are safe to use and reconfigure from any thread.  Logging never
+/// takes a lock: the level is atomic, and the sinks are an immutable snapshot
+/// that is replaced (and the old one reclaimed once no thread is still
+/// logging to it) whenever they change.  The snapshot already includes the
+/// sinks inherited from ancestors, so dispatching a message is a single pass
+/// over it, without touching the sinks' reference counts.  Since the sinks
+/// are called while the snapshot is in use, changing them waits for the
+/// messages being written; a sink may still change them from its own log(),
+/// which leaves the old snapshot to be freed by a later change.
 /// @sa Log
 /// @sa LogMacros
 class Logger : public std::enable_shared_from_this<Logger> {
@@ -218,23 +557,36 @@ public:
 
     /// @return If this logger is enabled at level
     bool enabled(Log::Level level);
+    /// @return If this logger is enabled at level, using the decision cached
+    /// by the calling statement if it is still current
+    bool enabled(Log::Level level, LogSiteCache &cache) {
+        uint32_t state = cache.state.load(std::memory_order_relaxed);
+        if ((state & ~1u) ==
+                ((s_generation.load(std::memory_order_relaxed) << 4) |
+                 (static_cast<uint32_t>(level) << 1)) &&
+            cache.logger.load(std::memory_order_relaxed) == this)
+            return state & 1;
+        return enabledSlow(level, cache);
+    }
     /// Set this logger to level
     /// @param level The level to set it to
     /// @param propagate Automatically set all child Loggers to this level also
     void level(Log::Level level, bool propagate = true);
     /// @return The current level this Logger is set to
-    Log::Level level() const { return m_level; }
+    Log::Level level() const { return m_level.load(std::memory_order_relaxed); }
 
     /// @return If this logger will inherit LogSinks from its parent
-    bool inheritSinks() const { return m_inheritSinks; }
+    bool inheritSinks() const {
+        return m_inheritSinks.load(std::memory_order_relaxed);
+    }
     /// Set if this logger will inherit LogSinks from its parent
-    void inheritSinks(bool inherit) { m_inheritSinks = inherit; }
+    void inheritSinks(bool inherit);
     /// Add sink to this Logger
-    void addSink(LogSink::ptr sink) { m_sinks.push_back(sink); }
+    void addSink(LogSink::ptr sink);
     /// Remove sink from this Logger
     void removeSink(LogSink::ptr sink);
     /// Remove all LogSinks from this logger
-    void clearSinks() { m_sinks.clear(); }
+    void clearSinks();
 
     /// Return a LogEvent to use to stream a log message applicable to this
     /// Logger
@@ -247,20 +599,57 @@ public:
     /// @param str The message
     void log(Log::Level level, const std::string &str, const char *file = NULL,
              int line = 0);
+    /// Log a binary message from this Logger
+    /// @param level The level of this message
+    /// @param site The statement that generated the message
+    /// @param args The message's encoded arguments
+    /// @sa BinaryLog
+    void logBinary(Log::Level level, const BinaryLogSite &site,
+                   const char *args, size_t len);
+    /// Log a structured message from this Logger
+    /// @param level The level of this message
+    /// @param str The message
+    /// @param fields The message's fields
+    /// @param count The number of fields
+    void logFields(Log::Level level, const std::string &str,
+                   const LogField *fields, size_t count,
+                   const char *file = NULL, int line = 0);
+    void logFields(Log::Level level, const std::string &str,
+                   std::initializer_list<LogField> fields,
+                   const char *file = NULL, int line = 0) {
+        logFields(level, str, fields.begin(), fields.size(), file, line);
+    }
 
     /// @return The full name of this Logger
-    std::string name() const { return m_name; }
+    const std::string &name() const { return m_name; }
+    /// @return A small integer identifying this Logger for the life of the
+    /// process; ids are handed out in the order Loggers are created
+    uint32_t id() const { return m_id; }
+
+    /// @return A snapshot of the sinks added to this Logger
+    std::vector<LogSink::ptr> sinks() const;
+
+private:
+    typedef std::vector<LogSink::ptr> SinkList;
+
+    void rebuildSinks(std::vector<const SinkList *> &retired);
 
-    /// @return The list of sinks for this Logger
-    const std::list<LogSink::ptr> &sinks() const { return m_sinks; }
+    bool enabledSlow(Log::Level level, LogSiteCache &cache);
+    static void bumpGeneration();
 
 private:
+    static std::atomic<uint32_t> s_generation;
+
     std::string m_name;
+    uint32_t m_id;
     std::weak_ptr<Logger> m_parent;
     std::set<Logger::ptr, LoggerLess> m_children;
-    Log::Level m_level;
-    std::list<LogSink::ptr> m_sinks;
-    bool m_inheritSinks;
+    std::atomic<Log::Level> m_level;
+    SinkList m_sinks;
+    /// m_sinks followed by the parent's effective sinks, if they are
+    /// inherited; NULL if there are none
+    std::atomic<const SinkList *> m_effectiveSinks;
+    std::atomic<bool> m_inheritSinks;
 };
 
 /// @defgroup LogMacros Logging Macros
@@ -272,14 +661,44 @@ private:
 /// @sa Log
 /// @{
 
-/// @brief Log at a particular level
-/// @param level The level to log at
+/// Numeric values of the Log levels, for use with MORDOR_LOG_MIN_LEVEL
+#define MORDOR_LOG_LEVEL_NONE 0
+#define MORDOR_LOG_LEVEL_FATAL 1
+#define MORDOR_LOG_LEVEL_ERROR 2
+#define MORDOR_LOG_LEVEL_WARNING 3
+#define MORDOR_LOG_LEVEL_INFO 4
+#define MORDOR_LOG_LEVEL_VERBOSE 5
+#define MORDOR_LOG_LEVEL_DEBUG 6
+#define MORDOR_LOG_LEVEL_TRACE 7
+
+/// The most verbose level that is compiled in
+///
+/// Statements at more verbose levels compile to nothing, regardless of how the
+/// Loggers are configured at runtime.  i.e. build with
+/// -DMORDOR_LOG_MIN_LEVEL=MORDOR_LOG_LEVEL_DEBUG to strip all TRACE messages.
+#ifndef MORDOR_LOG_MIN_LEVEL
+#define MORDOR_LOG_MIN_LEVEL MORDOR_LOG_LEVEL_TRACE
+#endif
+
 #define __FILENAME__                                                           \
     (__builtin_strrchr(__FILE__, '/') ? __builtin_strrchr(__FILE__, '/') + 1   \
                                       : __FILE__)
+/// @brief If a statement at level is compiled in and lg is enabled for it
+///
+/// The decision is cached per statement, so when it has not changed this is
+/// a couple of relaxed loads and a compare.
+#define MORDOR_LOG_ENABLED(lg, level)                                          \
+    (static_cast<int>(level) <= MORDOR_LOG_MIN_LEVEL &&                        \
+     (lg)->enabled(level, []() -> ::Mordor2::LogSiteCache & {                  \
+         static ::Mordor2::LogSiteCache cache;                                 \
+         return cache;                                                         \
+     }()))
+/// @brief Log at a particular level
+/// @param level The level to log at
 #define MORDOR_LOG_LEVEL(lg, level)                                            \
-    if ((lg)->enabled(level))                                                  \
-    (lg)->log(level, __FILENAME__, __LINE__).os()
+    if (!MORDOR_LOG_ENABLED(lg, level)) {                                      \
+    } else                                                                     \
+        (lg)->log(level, __FILENAME__, __LINE__).os()
 /// Log a fatal error
 #define MORDOR_LOG_FATAL(log) MORDOR_LOG_LEVEL(log, Mordor2::Log::Level::FATAL)
 /// Log an error
@@ -295,10 +714,92 @@ private:
 #define MORDOR_LOG_DEBUG(log) MORDOR_LOG_LEVEL(log, Mordor2::Log::Level::DEBUG)
 /// Log a trace message
 #define MORDOR_LOG_TRACE(log) MORDOR_LOG_LEVEL(log, Mordor2::Log::Level::TRACE)
+
+#define MORDOR_LOG_RATE_LIMIT_SITE()                                           \
+    ([]() -> ::Mordor2::LogRateLimit & {                                       \
+        static ::Mordor2::LogRateLimit site;                                   \
+        return site;                                                           \
+    }())
+/// Log at level only if the site's rate limit allows it, via call
+#define MORDOR_LOG_LIMITED(lg, level, call)                                    \
+    if (!MORDOR_LOG_ENABLED(lg, level) ||                                      \
+        !MORDOR_LOG_RATE_LIMIT_SITE().call) {                                  \
+    } else                                                                     \
+        (lg)->log(level, __FILENAME__, __LINE__).os()
+/// Log the first of every n messages from this statement
+#define MORDOR_LOG_EVERY_N(lg, level, n)                                       \
+    MORDOR_LOG_LIMITED(lg, level,                                              \
+                       everyN(*(lg), level, __FILENAME__, __LINE__, n))
+/// Log only the first n messages from this statement
+#define MORDOR_LOG_FIRST_N(lg, level, n)                                       \
+    MORDOR_LOG_LIMITED(lg, level,                                              \
+                       firstN(*(lg), level, __FILENAME__, __LINE__, n))
+/// Log at most one message from this statement every seconds
+#define MORDOR_LOG_EVERY_T(lg, level, seconds)                                 \
+    MORDOR_LOG_LIMITED(lg, level,                                              \
+                       everyT(*(lg), level, __FILENAME__, __LINE__, seconds))
+/// Log at most perSecond messages a second from this statement on average,
+/// in bursts of up to burst messages
+#define MORDOR_LOG_RATE_LIMITED(lg, level, perSecond, burst)                   \
+    MORDOR_LOG_LIMITED(lg, level,                                              \
+                       rate(*(lg), level, __FILENAME__, __LINE__, perSecond,   \
+                            burst))
+
+#define MORDOR_LOG_CONCAT_(a, b) a##b
+#define MORDOR_LOG_CONCAT(a, b) MORDOR_LOG_CONCAT_(a, b)
+/// @brief Log how long the rest of the enclosing scope takes, if it takes at
+/// least threshold
+///
+/// The threshold is a Duration, or a std::chrono::duration:
+///
+/// MORDOR_LOG_SCOPED_LATENCY(g_log, Log::Level::WARNING,
+///                           std::chrono::milliseconds(10));
+///
+/// Only a scope that is slow enough formats and logs a message; any other
+/// costs two reads of the monotonic clock (see time.clocksource) and a
+/// compare.
+#define MORDOR_LOG_SCOPED_LATENCY(lg, level, threshold)                        \
+    ::Mordor2::LogScopedLatency MORDOR_LOG_CONCAT(mordorScopedLatency,         \
+                                                  __LINE__)(                   \
+        *(lg), level, threshold, __FILENAME__, __LINE__)
+
+/// @brief Log a structured message at a particular level
+///
+/// The fields are made with kv(), and are passed to the LogSinks typed and
+/// unformatted:
+///
+/// MORDOR_LOG_INFO_KV(g_log, "request done", kv("user", id), kv("bytes", n));
+#define MORDOR_LOG_KV(lg, level, msg, ...)                                     \
+    if (!MORDOR_LOG_ENABLED(lg, level)) {                                      \
+    } else                                                                     \
+        (lg)->logFields(level, msg, {__VA_ARGS__}, __FILENAME__, __LINE__)
+/// Log a structured fatal error
+#define MORDOR_LOG_FATAL_KV(log, msg, ...)                                     \
+    MORDOR_LOG_KV(log, ::Mordor2::Log::Level::FATAL, msg, __VA_ARGS__)
+/// Log a structured error
+#define MORDOR_LOG_ERROR_KV(log, msg, ...)                                     \
+    MORDOR_LOG_KV(log, ::Mordor2::Log::Level::ERROR, msg, __VA_ARGS__)
+/// Log a structured warning
+#define MORDOR_LOG_WARNING_KV(log, msg, ...)                                   \
+    MORDOR_LOG_KV(log, ::Mordor2::Log::Level::WARNING, msg, __VA_ARGS__)
+/// Log a structured informational message
+#define MORDOR_LOG_INFO_KV(log, msg, ...)                                      \
+    MORDOR_LOG_KV(log, ::Mordor2::Log::Level::INFO, msg, __VA_ARGS__)
+/// Log a structured verbose message
+#define MORDOR_LOG_VERBOSE_KV(log, msg, ...)                                   \
+    MORDOR_LOG_KV(log, ::Mordor2::Log::Level::VERBOSE, msg, __VA_ARGS__)
+/// Log a structured debug message
+#define MORDOR_LOG_DEBUG_KV(log, msg, ...)                                     \
+    MORDOR_LOG_KV(log, ::Mordor2::Log::Level::DEBUG, msg, __VA_ARGS__)
+/// Log a structured trace message
+#define MORDOR_LOG_TRACE_KV(log, msg, ...)                                     \
+    MORDOR_LOG_KV(log, ::Mordor2::Log::Level::TRACE, msg, __VA_ARGS__)
 /// @}
 
 /// Streams a Log::Level as a string, instead of an integer
 std::ostream &operator<<(std::ostream &os, Log::Level level);
+/// @return The string operator<< streams for level
+const char *levelString(Log::Level level);
 
 tid_t gettid();
 
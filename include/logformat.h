@@ -0,0 +1,224 @@
+#ifndef __MORDOR_LOGFORMAT_H__
+#define __MORDOR_LOGFORMAT_H__
+
+#include "log.h"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+namespace Mordor2 {
+
+/// @defgroup LogFormat Formatted Logging
+///
+/// The MORDOR_LOGF macros take a format string and its arguments, instead of
+/// a std::ostream to stream them to:
+///
+/// MORDOR_LOGF_INFO(g_log, "read {} bytes from {}", n, path);
+///
+/// The format string uses {} for each argument, and {{ and }} for literal
+/// braces, as MORDOR_LOG_BINARY does.  It must be a string literal: it is
+/// checked at compile time, and a malformed string, or one whose placeholders
+/// do not match the number of arguments, does not compile.
+///
+/// Integers, floating point numbers, strings, characters, bools and pointers
+/// are formatted directly into the message's buffer, without going through
+/// std::ostream; floating point numbers are formatted as "%g" would.  Other
+/// types are streamed with their operator<<.
+/// @sa LogMacros
+/// @{
+
+/// Formatting of a MORDOR_LOGF argument; types without a specialization are
+/// streamed
+template <class T, class Enable = void> struct LogFormatTraits {
+    static void append(LogEvent &event, const T &v) { event.os() << v; }
+};
+
+/// Static class implementing the MORDOR_LOGF macros
+class LogFormat {
+private:
+    LogFormat();
+
+public:
+    /// @return The number of {} placeholders in fmt, or -1 if it has a brace
+    /// that is neither part of one, nor escaped
+    static constexpr int placeholders(const char *fmt, int count = 0) {
+        return !*fmt ? count
+               : *fmt == '{'
+                   ? (fmt[1] == '{'   ? placeholders(fmt + 2, count)
+                      : fmt[1] == '}' ? placeholders(fmt + 2, count + 1)
+                                      : -1)
+               : *fmt == '}'
+                   ? (fmt[1] == '}' ? placeholders(fmt + 2, count) : -1)
+                   : placeholders(fmt + 1, count);
+    }
+
+    /// Only used to count arguments at compile time
+    template <class... Args>
+    static std::integral_constant<int, sizeof...(Args)>
+    arity(const Args &...);
+
+    /// Format fmt with args into event's message
+    template <class... Args>
+    static void format(LogEvent &&event, const char *fmt,
+                       const Args &... args) {
+        formatNext(event, event.buf(), fmt, args...);
+    }
+
+    /// Append the decimal representation of v
+    static void appendInt(LogStreamBuf &buf, int64_t v) {
+        if (v < 0) {
+            buf.append('-');
+            // Negate in unsigned, so the most negative value works
+            appendUInt(buf, 0 - static_cast<uint64_t>(v));
+        } else {
+            appendUInt(buf, v);
+        }
+    }
+    static void appendUInt(LogStreamBuf &buf, uint64_t v);
+    /// Append v as "%g" formats it
+    static void appendDouble(LogStreamBuf &buf, double v);
+
+    /// Write the decimal digits of v, ending just before end
+    /// @return The first digit
+    static char *formatDigits(char *end, uint64_t v);
+    /// Write the two decimal digits of v, which must be less than 100
+    static void formatPair(char *p, unsigned v) {
+        memcpy(p, kDigitPairs + v * 2, 2);
+    }
+
+    /// "00" to "99"
+    static const char kDigitPairs[201];
+
+private:
+    /// Append fmt up to its next placeholder, unescaping braces
+    /// @return What follows the placeholder, or the end of fmt
+    static const char *literal(LogStreamBuf &buf, const char *fmt);
+
+    static void formatNext(LogEvent &, LogStreamBuf &buf, const char *fmt) {
+        literal(buf, fmt);
+    }
+    template <class T, class... Rest>
+    static void formatNext(LogEvent &event, LogStreamBuf &buf,
+                           const char *fmt, const T &v,
+                           const Rest &... rest) {
+        fmt = literal(buf, fmt);
+        LogFormatTraits<typename std::decay<T>::type>::append(event, v);
+        formatNext(event, buf, fmt, rest...);
+    }
+};
+
+template <class T>
+struct LogFormatTraits<
+    T, typename std::enable_if<std::is_integral<T>::value &&
+                               std::is_signed<T>::value>::type> {
+    static void append(LogEvent &event, T v) {
+        LogFormat::appendInt(event.buf(), v);
+    }
+};
+
+template <class T>
+struct LogFormatTraits<
+    T, typename std::enable_if<std::is_integral<T>::value &&
+                               std::is_unsigned<T>::value>::type> {
+    static void append(LogEvent &event, T v) {
+        LogFormat::appendUInt(event.buf(), v);
+    }
+};
+
+template <class T>
+struct LogFormatTraits<
+    T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+    static void append(LogEvent &event, T v) {
+        LogFormat::appendDouble(event.buf(), v);
+    }
+};
+
+template <> struct LogFormatTraits<bool> {
+    static void append(LogEvent &event, bool v) {
+        if (v)
+            event.buf().append("true", 4);
+        else
+            event.buf().append("false", 5);
+    }
+};
+
+template <> struct LogFormatTraits<char> {
+    static void append(LogEvent &event, char v) { event.buf().append(v); }
+};
+
+template <> struct LogFormatTraits<const char *> {
+    static void append(LogEvent &event, const char *v) {
+        if (!v)
+            v = "(null)";
+        event.buf().append(v, strlen(v));
+    }
+};
+
+template <> struct LogFormatTraits<char *> : LogFormatTraits<const char *> {};
+
+template <> struct LogFormatTraits<std::string> {
+    static void append(LogEvent &event, const std::string &v) {
+        event.buf().append(v.data(), v.size());
+    }
+};
+
+template <class T> struct LogFormatTraits<T *> {
+    static void append(LogEvent &event, const T *v) {
+        static const char kHex[] = "0123456789abcdef";
+        char digits[2 + 2 * sizeof(uintptr_t)];
+        char *p = digits + sizeof(digits);
+        uintptr_t n = reinterpret_cast<uintptr_t>(v);
+        do {
+            *--p = kHex[n & 0xf];
+            n >>= 4;
+        } while (n);
+        *--p = 'x';
+        *--p = '0';
+        event.buf().append(p, digits + sizeof(digits) - p);
+    }
+};
+
+/// @brief Log a formatted message at a particular level
+/// @param fmt The format string; it must be a string literal
+#define MORDOR_LOGF(lg, level, fmt, ...)                                       \
+    do {                                                                       \
+        static_assert(::Mordor2::LogFormat::placeholders(fmt) >= 0,            \
+                      "malformed MORDOR_LOGF format string");                  \
+        static_assert(::Mordor2::LogFormat::placeholders(fmt) ==               \
+                          decltype(::Mordor2::LogFormat::arity(                \
+                              __VA_ARGS__))::value,                            \
+                      "MORDOR_LOGF format string does not match the number "   \
+                      "of arguments");                                         \
+        if (MORDOR_LOG_ENABLED(lg, level))                                     \
+            ::Mordor2::LogFormat::format(                                      \
+                (lg)->log(level, __FILENAME__, __LINE__), fmt,                 \
+                ##__VA_ARGS__);                                                \
+    } while (0)
+/// Log a formatted fatal error
+#define MORDOR_LOGF_FATAL(log, ...)                                            \
+    MORDOR_LOGF(log, ::Mordor2::Log::Level::FATAL, __VA_ARGS__)
+/// Log a formatted error
+#define MORDOR_LOGF_ERROR(log, ...)                                            \
+    MORDOR_LOGF(log, ::Mordor2::Log::Level::ERROR, __VA_ARGS__)
+/// Log a formatted warning
+#define MORDOR_LOGF_WARNING(log, ...)                                          \
+    MORDOR_LOGF(log, ::Mordor2::Log::Level::WARNING, __VA_ARGS__)
+/// Log a formatted informational message
+#define MORDOR_LOGF_INFO(log, ...)                                             \
+    MORDOR_LOGF(log, ::Mordor2::Log::Level::INFO, __VA_ARGS__)
+/// Log a formatted verbose message
+#define MORDOR_LOGF_VERBOSE(log, ...)                                          \
+    MORDOR_LOGF(log, ::Mordor2::Log::Level::VERBOSE, __VA_ARGS__)
+/// Log a formatted debug message
+#define MORDOR_LOGF_DEBUG(log, ...)                                            \
+    MORDOR_LOGF(log, ::Mordor2::Log::Level::DEBUG, __VA_ARGS__)
+/// Log a formatted trace message
+#define MORDOR_LOGF_TRACE(log, ...)                                            \
+    MORDOR_LOGF(log, ::Mordor2::Log::Level::TRACE, __VA_ARGS__)
+/// @}
+
+} // namespace Mordor2
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef __MORDOR_LOGLAYOUT_H__
+#define __MORDOR_LOGLAYOUT_H__
+
+#include "log.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Mordor2 {
+
+/// The layout of a text log message, compiled from a pattern
+///
+/// The pattern is text with conversions, which are replaced by a part of the
+/// message:
+///
+/// - %d{fmt}: the local time, formatted by strftime(3), which additionally
+///   accepts %us for the microseconds and %ms for the milliseconds.  %d alone
+///   is %d{%F %T.%us}
+/// - %l: the level
+/// - %t: the thread id
+/// - %n: the Logger's name
+/// - %f: the file of the log statement
+/// - %L: the line of the log statement
+/// - %m: the message
+/// - %%: a literal %
+///
+/// Every conversion except %d may have a minimum width between the % and the
+/// conversion character, padded with spaces on the left, or on the right if
+/// it starts with "-": "[%-7l]".
+///
+/// The pattern is parsed once, into a list of operations that append to the
+/// caller's buffer directly, so formatting a message does not go through
+/// std::ostream, and does not allocate once the buffer has grown to fit.
+///
+/// The date only changes once a second, so each thread keeps the dates of
+/// the layouts it has used most recently, formatted for the last second it
+/// formatted with them; within that second, formatting the time only writes
+/// the fraction.  The cache assumes the time zone does not change; call
+/// Timestamp::timezoneChanged() after changing it (TZ, for instance).
+///
+/// log.pattern sets the layout of log.stdout and log.file.
+class LogLayout {
+public:
+    typedef std::shared_ptr<const LogLayout> ptr;
+
+    /// @throws std::invalid_argument If pattern has an unknown conversion, or
+    /// a %d{ without its }
+    LogLayout(const std::string &pattern);
+
+    const std::string &pattern() const { return m_pattern; }
+
+    /// Append record, laid out by the pattern, to buf; nothing follows the
+    /// pattern, not even a newline
+    void format(std::string &buf, const LogRecord &record) const;
+
+private:
+    enum class OpType {
+        LITERAL,
+        DATE,
+        MICROSECONDS,
+        MILLISECONDS,
+        LEVEL,
+        THREAD,
+        LOGGER,
+        FILE,
+        LINE,
+        MESSAGE
+    };
+
+    struct Op {
+        OpType type;
+        /// The literal text, or the strftime format of a date
+        std::string text;
+        size_t width;
+        bool left;
+    };
+
+    struct DateCache;
+
+    void compileDate(const std::string &format);
+    void add(OpType type, const std::string &text = std::string(),
+             size_t width = 0, bool left = false);
+    /// @return This thread's cached dates, formatted for second
+    const DateCache &dates(int64_t second) const;
+
+private:
+    std::string m_pattern;
+    std::vector<Op> m_ops;
+    /// Identifies the layout in the date caches; unlike its address, it is
+    /// never reused
+    uint64_t m_id;
+    /// Bytes of literals, padding and numbers a message takes at most
+    size_t m_fixedBytes;
+    /// How many times the pattern has each of the fields of variable length
+    size_t m_dates, m_levels, m_loggers, m_files, m_messages;
+};
+
+} // namespace Mordor2
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef __MORDOR_MAPPEDFILELOGSINK_H__
+#define __MORDOR_MAPPEDFILELOGSINK_H__
+
+#include "log.h"
+#include "noncopyable.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace Mordor2 {
+
+/// A LogSink that appends messages to a memory-mapped file
+///
+/// Messages are formatted as by FileLogSink.  Each one claims its space in
+/// the file with a single atomic add and is copied straight into the
+/// mapping, so logging costs about a memcpy, and takes no lock and makes no
+/// system call.  Since the mapping is shared, messages are in the page cache
+/// as soon as they are logged, and survive the process crashing.
+///
+/// A background thread keeps the file mapped ahead of the writers, in
+/// chunkSize pieces that it allocates on disk first, and unmaps chunks once
+/// every message in them has been copied.  While the disk is full, writers
+/// drop messages rather than fault, and the thread tries again, backing off
+/// up to a second; chunks whose messages were all dropped are left as holes.
+/// It msyncs the messages that have been copied in every syncInterval, and
+/// flush() does so immediately.
+///
+/// While the sink is open, the file extends up to the end of the mapped
+/// chunks, so after a crash it may end in NUL bytes; the file is truncated to
+/// its messages when the sink is destroyed.  Only one process can log to the
+/// file.
+///
+/// The log.mmap.* ConfigVars provide the defaults for newly constructed
+/// MappedFileLogSinks; setting log.file.mode=mmap makes log.file use this
+/// sink.
+class MappedFileLogSink : public LogSink, public Noncopyable {
+public:
+    /// @param file The file to open and log to.  If it does not exist, it is
+    /// created.
+    /// @param chunkSize Bytes mapped at a time; 0 uses log.mmap.chunksize
+    /// @param syncInterval How often written messages are msynced; negative
+    /// uses log.mmap.syncusec, and 0 leaves it to the kernel
+    /// @throws std::system_error If the file cannot be opened or mapped
+    MappedFileLogSink(const std::string &file, size_t chunkSize = 0,
+                      std::chrono::microseconds syncInterval =
+                          std::chrono::microseconds(-1));
+    /// Unmaps the file, and truncates it to the messages written
+    ~MappedFileLogSink();
+
+    void log(const std::string &logger, int64_t now, tid_t thread,
+             Log::Level level, const std::string &str, const char *file,
+             int line);
+    /// Claims space for all of the messages at once
+    void logBatch(const LogRecord *records, size_t count);
+
+    /// msyncs every message logged before the call
+    void flush();
+
+    std::string file() const { return m_file; }
+    /// @return The number of messages dropped because the file could not be
+    /// extended, usually because the disk was full
+    uint64_t dropped() const {
+        return m_dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    void append(const char *data, uint64_t len);
+    void mapAhead();
+    /// The end of the messages that have all been copied in; called with
+    /// m_syncMutex held
+    uint64_t committedEnd() const;
+    void unmapCommitted();
+    void sync(uint64_t end);
+    void run();
+
+private:
+    std::string m_file;
+    int m_fd;
+    size_t m_chunkSize;
+    std::chrono::microseconds m_syncInterval;
+
+    // The address space reserved for the file; m_base maps the file from
+    // m_fileBase
+    char *m_base;
+    uint64_t m_reserved;
+    uint64_t m_fileBase;
+    // Bytes copied into each chunk
+    std::unique_ptr<std::atomic<uint64_t>[]> m_committed;
+
+    // Writers claim space on one cache line, and wait for mappings on
+    // another.  Padded rather than aligned: a C++11 new does not honor
+    // alignment beyond the fundamental one
+    char m_tailPad[64];
+    std::atomic<uint64_t> m_tail;
+    char m_mappedPad[64];
+    std::atomic<uint64_t> m_mapped;
+    // The reserved address space is all mapped
+    std::atomic<bool> m_full;
+    // The last attempt to map more failed
+    std::atomic<bool> m_mapFailing;
+    std::atomic<uint64_t> m_dropped;
+    // Only used by the background thread
+    std::chrono::milliseconds m_retryDelay;
+    std::chrono::steady_clock::time_point m_retryAt;
+
+    // Only used by the background thread, and flush()
+    std::mutex m_syncMutex;
+    uint64_t m_unmapped;
+    uint64_t m_synced;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::condition_variable m_mappedCond;
+    bool m_stopping;
+    std::thread m_thread;
+};
+
+} // namespace Mordor2
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef __MORDOR_RCU_H__
+#define __MORDOR_RCU_H__
+
+#include <atomic>
+
+namespace Mordor2 {
+
+/// Lets threads read snapshots published through an atomic pointer without
+/// taking a lock, and writers free the snapshots they replace
+///
+/// A reader counts itself in one of two sets of per-thread-sharded counters
+/// while it uses a snapshot.  A writer that replaces a snapshot flips new
+/// readers over to the other set, and waits for the set they left to drain,
+/// twice (so that a reader that picked a set just before a flip is waited for
+/// by the second one).  After that, no thread can still be using the old
+/// snapshot, and it can be freed.
+///
+/// Readers load the pointer with std::memory_order_seq_cst inside a
+/// ReadLock, and may use the snapshot for as long as it is held, without
+/// taking a reference to it; a writer waits for them.  A writer hands the
+/// snapshot it replaced to retire(), and then calls reclaim().  Called from
+/// inside a read section, which waiting would deadlock, reclaim() leaves the
+/// snapshots to the next call from outside of one.
+class Rcu {
+private:
+    Rcu();
+
+    struct ThreadState {
+        unsigned shard;
+        /// The number of read sections the thread is in
+        unsigned depth;
+    };
+
+public:
+    /// Counts the calling thread as a reader while it is in scope; read
+    /// sections may nest
+    class ReadLock {
+    public:
+        ReadLock() : m_thread(thread()) {
+            unsigned phase = s_phase.load(std::memory_order_relaxed) & 1;
+            m_counter = &s_shards[m_thread.shard].readers[phase];
+            m_counter->fetch_add(1, std::memory_order_seq_cst);
+            ++m_thread.depth;
+        }
+        ~ReadLock() {
+            --m_thread.depth;
+            m_counter->fetch_sub(1, std::memory_order_release);
+        }
+
+    private:
+        ReadLock(const ReadLock &) = delete;
+        void operator=(const ReadLock &) = delete;
+
+    private:
+        ThreadState &m_thread;
+        std::atomic<long> *m_counter;
+    };
+
+    /// @return If the calling thread is inside a read section
+    static bool reading() { return thread().depth != 0; }
+
+    /// Free p, once no reader can still be using it, at the next reclaim()
+    template <class T> static void retire(const T *p) {
+        retire(p, [](const void *p) { delete static_cast<const T *>(p); });
+    }
+    /// Wait for the readers that may be using what has been retired, and
+    /// free it; does nothing inside a read section
+    static void reclaim();
+
+    /// Wait until every reader that may have loaded a snapshot replaced
+    /// before the call has left its read section; must not be called from
+    /// inside one
+    static void synchronize();
+
+private:
+    struct Shard {
+        alignas(64) std::atomic<long> readers[2];
+    };
+
+    static const unsigned kShards = 16;
+
+    static ThreadState &thread() {
+        static thread_local ThreadState state = {
+            s_nextShard.fetch_add(1, std::memory_order_relaxed) % kShards, 0};
+        return state;
+    }
+
+    static void retire(const void *p, void (*free)(const void *));
+
+private:
+    static Shard s_shards[kShards];
+    static std::atomic<unsigned> s_phase;
+    static std::atomic<unsigned> s_nextShard;
+};
+
+} // namespace Mordor2
+
+#endif
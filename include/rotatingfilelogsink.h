@@ -0,0 +1,99 @@
+#ifndef __MORDOR_ROTATINGFILELOGSINK_H__
+#define __MORDOR_ROTATINGFILELOGSINK_H__
+
+#include "log.h"
+#include "noncopyable.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace Mordor2 {
+
+/// A LogSink that appends messages to a file, and rotates it
+///
+/// Messages are formatted as by FileLogSink.  Once the file would grow past
+/// maxSize bytes, or a rotation interval boundary (in local time, i.e.
+/// midnight for an interval of a day) is crossed, it is renamed to
+/// file.YYYYmmdd-HHMMSS, after the time it was started at, and a new file is
+/// started.  The sink owns the file, so unlike external rotation with
+/// copytruncate, no message is lost; only one process can log to it, though.
+///
+/// Everything except the rename itself happens on a background thread, so
+/// logging never waits for it: new files are preallocated with fallocate,
+/// rotated files are trimmed back to their size and gzip compressed (when
+/// built with zlib), and the oldest are deleted to keep maxFiles.
+///
+/// The log.file.* ConfigVars provide the defaults for newly constructed
+/// RotatingFileLogSinks; setting log.file.mode=rotate makes log.file use this
+/// sink.
+class RotatingFileLogSink : public LogSink, public Noncopyable {
+public:
+    /// @param file The file to open and log to.  If it does not exist, it is
+    /// created.
+    /// @throws std::system_error If the file cannot be opened
+    RotatingFileLogSink(const std::string &file);
+    /// @param maxSize Size to rotate at; 0 never rotates by size
+    /// @param interval Seconds to rotate after; 0 never rotates by time
+    /// @param maxFiles Number of rotated files to keep; 0 keeps all of them
+    /// @param compress gzip rotated files
+    /// @param preallocate Reserve maxSize bytes on disk for each new file
+    /// @throws std::system_error If the file cannot be opened
+    RotatingFileLogSink(const std::string &file, uint64_t maxSize,
+                        uint64_t interval, size_t maxFiles, bool compress,
+                        bool preallocate);
+    /// Finishes compressing rotated files, and closes the file
+    ~RotatingFileLogSink();
+
+    void log(const std::string &logger, int64_t now, tid_t thread,
+             Log::Level level, const std::string &str, const char *file,
+             int line);
+    /// Writes all of the messages that go to the same file at once
+    void logBatch(const LogRecord *records, size_t count);
+
+    std::string file() const { return m_file; }
+
+private:
+    // Work for the background thread
+    struct Task {
+        // Descriptor of a file to preallocate or trim; owned by the task
+        int fd;
+        // The name of a rotated file; empty for a new file
+        std::string path;
+    };
+
+    void openFile(int64_t now);
+    void rotate(int64_t now);
+    void writeAll(const char *buf, size_t len);
+    void post(int fd, const std::string &path);
+    void run();
+    void finish(const Task &task);
+    void compress(const std::string &path);
+    void prune();
+
+private:
+    std::string m_file;
+    uint64_t m_maxSize;
+    uint64_t m_interval;
+    size_t m_maxFiles;
+    bool m_compress;
+    bool m_preallocate;
+
+    std::mutex m_mutex;
+    int m_fd;
+    uint64_t m_size;
+    int64_t m_started;
+    int64_t m_nextRotation;
+
+    std::mutex m_tasksMutex;
+    std::condition_variable m_tasksCond;
+    std::deque<Task> m_tasks;
+    bool m_stopping;
+    std::thread m_thread;
+};
+
+} // namespace Mordor2
+
+#endif
@@ -0,0 +1,231 @@
+#ifndef __MORDOR_TIMER_H__
+#define __MORDOR_TIMER_H__
+
+#include "config.h"
+#include "noncopyable.h"
+#include "timestamp.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Mordor2 {
+
+class TimerManager;
+
+/// A callback scheduled on a TimerManager
+///
+/// A one-shot timer fires once; a recurring one fires every interval until
+/// it is cancelled.  The TimerManager keeps a timer alive while it is
+/// scheduled, so dropping the last Timer::ptr does not cancel it.
+class Timer : public Noncopyable {
+    friend class TimerManager;
+
+public:
+    typedef std::shared_ptr<Timer> ptr;
+
+public:
+    /// Stop it from firing again, in constant time, even if it has come due
+    /// and is waiting for its callback to run.  A callback that has already
+    /// started is not interrupted.
+    /// @return If it was still scheduled
+    bool cancel();
+    /// Start the current period again, from now
+    /// @return false if it is not scheduled any more
+    bool refresh();
+    /// Change the interval
+    /// @param fromNow Whether the new period starts now, or when the current
+    /// one started
+    /// @return false if it is not scheduled any more
+    bool reset(Duration interval, bool fromNow = true);
+
+    /// For a timer bound to a ConfigVar, its current value
+    Duration interval() const;
+    bool recurring() const { return m_recurring; }
+
+private:
+    Timer(TimerManager *manager, std::function<void()> dg, Duration interval,
+          bool recurring);
+
+private:
+    TimerManager *m_manager;
+    std::function<void()> m_dg;
+    Duration m_interval;
+    /// Set for a timer whose interval is bound to a ConfigVar, counted in
+    /// m_interval
+    ConfigVar<uint64_t>::ptr m_intervalVar;
+    bool m_recurring;
+    /// Waiting for the ConfigVar to be set to something other than 0
+    bool m_paused;
+    /// Set by cancel(), so that a fire collected before it does not run
+    std::atomic<bool> m_cancelled;
+
+    // Guarded by the TimerManager's mutex
+    /// The tick it fires on, and the one its period started on
+    uint64_t m_expiry, m_start;
+    /// Where it is in the wheel; m_level is -1 while it is not scheduled
+    int m_level;
+    size_t m_slot;
+    Timer *m_prev, *m_next;
+    /// The other scheduled timers bound to the same ConfigVar
+    Timer *m_boundPrev, *m_boundNext;
+    /// Keeps it alive while it is scheduled
+    ptr m_self;
+};
+
+/// Schedules Timers in a hierarchical timing wheel
+///
+/// Time is counted in ticks of a fixed resolution on the MonotonicTimestamp
+/// clock, so setting the system time does not move timers.  The wheel has
+/// four levels of 256 slots; the first holds the timers due within 256
+/// ticks, one slot per tick, and each level above covers 256 times the span
+/// of the one below, with one slot per span of the level below.  A timer is
+/// linked into the slot for its expiry on the lowest level that reaches
+/// it, and moves down a level each time the time comes to its slot, so
+/// scheduling and cancelling it take constant time, whatever the number of
+/// timers, and firing one takes at most four moves.  Timers more than 2^32
+/// ticks away (49 days, with 1ms ticks) wait on the top level until they
+/// are in reach.  Empty slots are skipped over with a bitmap of each level,
+/// so an idle wheel costs nothing between timers.
+///
+/// Timers fire at or after their time, never before: late by up to a tick,
+/// plus however late processTimers() is called.  Intervals are rounded up to
+/// whole ticks.  A recurring timer keeps to its schedule, rather than
+/// drifting by the time its callback takes, but skips the periods it has
+/// missed altogether.
+///
+/// Either start() the driver thread, which runs the callbacks, or call
+/// processTimers() as nextTimer() says, from a loop of one's own.  Callbacks
+/// run without any lock held, so they can schedule and cancel timers; they
+/// must not throw.  Timers must not be used while their TimerManager is
+/// being destroyed.
+class TimerManager : public Noncopyable {
+public:
+    /// @param resolution The length of a tick
+    /// @throws std::invalid_argument If resolution is not positive
+    TimerManager(Duration resolution = Duration::fromMilliseconds(1));
+    /// Stops the driver thread, and cancels every timer
+    ~TimerManager();
+
+    /// Run dg after a delay, and every delay after that if recurring
+    Timer::ptr registerTimer(Duration delay, std::function<void()> dg,
+                             bool recurring = false);
+    /// Run dg once, at a time of day; a time that has passed is due at once
+    Timer::ptr registerTimer(Timestamp when, std::function<void()> dg);
+    /// Run dg every interval units, read from the ConfigVar each time it
+    /// fires.  The TimerManager also looks for changes to ConfigVars at
+    /// least every second, and moves the timer's expiry to the new interval
+    /// from the start of its current period; if that has already passed, it
+    /// fires at once.  While it is 0, the timer does not fire.
+    Timer::ptr registerTimer(ConfigVar<uint64_t>::ptr interval,
+                             std::function<void()> dg,
+                             Duration unit = Duration::fromMicroseconds(1));
+
+    /// Start a thread that runs the timers as they come due
+    void start();
+    /// Stop the driver thread, after any callback it is running
+    void stop();
+
+    /// How long until processTimers() next has something to do; it may
+    /// only be to move timers down the wheel, or to look for changes to the
+    /// ConfigVars that timers are bound to
+    /// @return false if no timer is scheduled
+    bool nextTimer(Duration &wait);
+    /// Run the callbacks of every timer that has come due
+    /// @return How many ran
+    size_t processTimers();
+
+    /// The number of scheduled timers
+    size_t size();
+    Duration resolution() const { return m_resolution; }
+
+private:
+    static const int kLevels = 4;
+    static const int kSlotBits = 8;
+    static const size_t kSlots = 1 << kSlotBits;
+    static const size_t kWords = kSlots / 64;
+    /// The list of timers whose tick has come, before they run; it has a
+    /// single slot
+    static const int kDue = kLevels;
+
+private:
+    friend class Timer;
+
+    /// Time since m_start
+    Duration elapsed() const;
+    /// The number of ticks in duration, rounded up; 0 if it is negative
+    uint64_t ticks(Duration duration) const;
+    /// The ticks until timer next fires after its period starts, at least 1;
+    /// updates m_paused from its ConfigVar
+    uint64_t period(Timer *timer);
+    Timer::ptr add(Timer::ptr timer, uint64_t expiry);
+    void schedule(Timer *timer, uint64_t expiry);
+    void link(Timer *timer);
+    void unlink(Timer *timer);
+    /// The distance from index to the next occupied slot of level, going
+    /// round to index itself; 0 if the level is empty
+    size_t nextSlot(int level, size_t index) const;
+    /// The first tick after m_current that may have something to do
+    /// @return UINT64_MAX if there is none
+    uint64_t nextEvent() const;
+    /// Move through the ticks up to target, collecting the timers that come
+    /// due
+    void advance(uint64_t target, std::vector<Timer::ptr> &fired);
+    void tick(std::vector<Timer::ptr> &fired);
+    void cascade(int level, size_t slot);
+    void expire(int level, size_t slot, std::vector<Timer::ptr> &fired);
+    /// Schedule a timer that has fired again, if it recurs
+    void rearm(Timer *timer);
+    /// Move the timers bound to ConfigVars that have changed to the expiries
+    /// of their new values
+    void rebind();
+    void bind(Timer *timer);
+    /// Stop rescheduling timer when its ConfigVar changes
+    void unbind(Timer *timer);
+    /// The longest to wait before processing timers again
+    Duration longestWait() const;
+    void run();
+
+private:
+    const MonotonicTimestamp m_start;
+    const Duration m_resolution;
+
+    std::mutex m_mutex;
+    /// The last tick processed
+    uint64_t m_current;
+    /// The tick advance() is moving to, which a rearmed timer must not come
+    /// due again by
+    uint64_t m_target;
+    size_t m_count;
+    /// The heads of the slots' lists
+    Timer *m_wheel[kLevels + 1][kSlots];
+    /// Which slots of each level have timers
+    uint64_t m_occupied[kLevels][kWords];
+    struct BoundVar {
+        /// The value the timers were last scheduled for
+        uint64_t value;
+        /// The head of the list of its scheduled timers
+        Timer *timers;
+    };
+    /// The ConfigVars that scheduled timers are bound to
+    std::map<const ConfigVar<uint64_t> *, BoundVar> m_bound;
+    /// Config::generation() when they were last moved
+    uint64_t m_configGeneration;
+
+    std::condition_variable m_cond;
+    bool m_running;
+    std::thread m_thread;
+    /// The tick the driver thread sleeps until; 0 while it is running
+    /// callbacks
+    uint64_t m_wakeTick;
+    uint64_t m_wakeups;
+};
+
+} // namespace Mordor2
+
+#endif
@@ -3,6 +3,10 @@
 
 #include <sys/types.h>
 
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
 #include <string>
 
 namespace Mordor2 {
@@ -33,8 +37,67 @@ public:
 
     // default copy/assignment/dtor are Okay
 
+    ///
+    /// Layouts formatTo() writes, and parse() reads.
+    ///
+    enum class Format {
+        /// "20231114 22:13:20.123456"
+        UTC,
+        /// "20231114 22:13:20.123"
+        UTC_MILLISECONDS,
+        /// "20231115 07:13:20.123456", in local time
+        LOCAL,
+        /// "2023-11-15T07:13:20.123456+09:00", in local time
+        ISO8601,
+        /// "2023-11-14T22:13:20.123456Z"
+        ISO8601_UTC
+    };
+
+    /// Big enough for any Format, and its terminating NUL
+    static const size_t kMaxFormattedSize = 40;
+
     std::string FormattedString(bool showMicroseconds = true) const;
 
+    ///
+    /// Formats without allocating, or going through gmtime_r or localtime_r
+    /// for every call; local time only looks up the offset from UTC once per
+    /// quarter hour (per thread).
+    ///
+    /// @param buf Where to write, followed by a NUL
+    /// @param size The size of buf; kMaxFormattedSize is always enough
+    /// @return The length written, without the NUL, or 0 if buf is too small
+    size_t formatTo(char *buf, size_t size, Format format = Format::UTC) const;
+    /// Appends to buf
+    void formatTo(std::string &buf, Format format = Format::UTC) const;
+
+    ///
+    /// Parses a timestamp in any of these layouts:
+    ///
+    /// - "20231114 22:13:20", as Format::UTC writes it
+    /// - "2023-11-14 22:13:20" or "2023-11-14T22:13:20", as ISO 8601
+    ///
+    /// The seconds may be followed by a fraction, after a "." or ",", of which
+    /// digits past the microseconds are ignored; then by an offset from UTC,
+    /// "Z", "+09:00", "+0900" or "+09".
+    ///
+    /// @param local Whether a time without an offset is in local time, rather
+    /// than UTC
+    /// @return false if str is not a timestamp, or has anything after it
+    static bool parse(const char *str, size_t len, Timestamp &result,
+                      bool local = false);
+    static bool parse(const std::string &str, Timestamp &result,
+                      bool local = false) {
+        return parse(str.data(), str.size(), result, local);
+    }
+
+    ///
+    /// Re-read the time zone (TZ, for instance), and discard the offsets from
+    /// UTC, and dates, cached for local time.
+    ///
+    static void timezoneChanged();
+    /// Changed by every call to timezoneChanged()
+    static uint64_t timezoneGeneration();
+
     bool Valid() const { return microseconds_since_epoch_ > 0; }
 
     // for internal usage.
@@ -50,6 +113,16 @@ public:
     ///
     /// Get time of now.
     ///
+    /// The clock is chosen by the time.clocksource ConfigVar:
+    ///
+    /// - system: CLOCK_REALTIME (the default)
+    /// - coarse: CLOCK_REALTIME_COARSE, which is only as precise as the
+    ///   kernel's tick (a few milliseconds), but costs a fraction as much
+    /// - tsc: the CPU's time stamp counter, scaled to microseconds; a
+    ///   background thread resyncs it with CLOCK_REALTIME every second.  It
+    ///   needs an invariant TSC, and falls back to system without one
+    /// - cached: a time a background thread stores every millisecond
+    ///
     static Timestamp Now();
 
     static int64_t MicrosecondsNow();
@@ -103,6 +176,182 @@ inline Timestamp AddTime(Timestamp timestamp, double seconds) {
     return Timestamp(timestamp.microseconds_since_epoch() + delta);
 }
 
+///
+/// A span of time, in nanoseconds.
+///
+/// The arithmetic is all in integers, so adding up durations does not lose
+/// precision, however many there are.
+///
+class Duration {
+public:
+    Duration() : nanoseconds_(0) {}
+
+    template <class Rep, class Period>
+    Duration(std::chrono::duration<Rep, Period> duration)
+        : nanoseconds_(
+              std::chrono::duration_cast<std::chrono::nanoseconds>(duration)
+                  .count()) {}
+
+    static Duration fromNanoseconds(int64_t nanoseconds) {
+        Duration result;
+        result.nanoseconds_ = nanoseconds;
+        return result;
+    }
+    static Duration fromMicroseconds(int64_t microseconds) {
+        return fromNanoseconds(microseconds * 1000);
+    }
+    static Duration fromMilliseconds(int64_t milliseconds) {
+        return fromNanoseconds(milliseconds * 1000000);
+    }
+    static Duration fromSeconds(int64_t seconds) {
+        return fromNanoseconds(seconds * 1000000000);
+    }
+
+    int64_t nanoseconds() const { return nanoseconds_; }
+    /// Truncated toward zero, as are the coarser units
+    int64_t microseconds() const { return nanoseconds_ / 1000; }
+    int64_t milliseconds() const { return nanoseconds_ / 1000000; }
+    int64_t seconds() const { return nanoseconds_ / 1000000000; }
+
+    Duration &operator+=(Duration rhs) {
+        nanoseconds_ += rhs.nanoseconds_;
+        return *this;
+    }
+    Duration &operator-=(Duration rhs) {
+        nanoseconds_ -= rhs.nanoseconds_;
+        return *this;
+    }
+    Duration &operator*=(int64_t n) {
+        nanoseconds_ *= n;
+        return *this;
+    }
+    Duration &operator/=(int64_t n) {
+        nanoseconds_ /= n;
+        return *this;
+    }
+
+private:
+    int64_t nanoseconds_;
+};
+
+inline Duration operator+(Duration lhs, Duration rhs) { return lhs += rhs; }
+inline Duration operator-(Duration lhs, Duration rhs) { return lhs -= rhs; }
+inline Duration operator-(Duration duration) {
+    return Duration::fromNanoseconds(-duration.nanoseconds());
+}
+inline Duration operator*(Duration lhs, int64_t n) { return lhs *= n; }
+inline Duration operator*(int64_t n, Duration rhs) { return rhs *= n; }
+inline Duration operator/(Duration lhs, int64_t n) { return lhs /= n; }
+/// How many times rhs fits in lhs
+inline int64_t operator/(Duration lhs, Duration rhs) {
+    return lhs.nanoseconds() / rhs.nanoseconds();
+}
+
+inline bool operator==(Duration lhs, Duration rhs) {
+    return lhs.nanoseconds() == rhs.nanoseconds();
+}
+inline bool operator!=(Duration lhs, Duration rhs) { return !(lhs == rhs); }
+inline bool operator<(Duration lhs, Duration rhs) {
+    return lhs.nanoseconds() < rhs.nanoseconds();
+}
+inline bool operator>(Duration lhs, Duration rhs) { return rhs < lhs; }
+inline bool operator<=(Duration lhs, Duration rhs) { return !(rhs < lhs); }
+inline bool operator>=(Duration lhs, Duration rhs) { return !(lhs < rhs); }
+
+///
+/// Streams duration in the largest unit it has at least one of, with up to
+/// three decimals: "1.5ms", "250us", "12s".
+///
+std::ostream &operator<<(std::ostream &os, Duration duration);
+
+///
+/// A point on a monotonic clock, in nanoseconds since an unspecified start.
+///
+/// Unlike Timestamp, it never goes backwards when the system time is set, so
+/// the difference of two is a reliable Duration; but it does not correspond
+/// to a date.  Now() uses the clock time.clocksource selects for
+/// Timestamp::Now(): CLOCK_MONOTONIC, CLOCK_MONOTONIC_COARSE, the TSC, or a
+/// cached time.  They all count from about the same start, but a Duration
+/// between points read before and after changing it may be off by a few
+/// milliseconds.
+///
+class MonotonicTimestamp {
+public:
+    MonotonicTimestamp() : nanoseconds_(0) {}
+    explicit MonotonicTimestamp(int64_t nanoseconds)
+        : nanoseconds_(nanoseconds) {}
+
+    static MonotonicTimestamp Now();
+
+    int64_t nanoseconds() const { return nanoseconds_; }
+
+    MonotonicTimestamp &operator+=(Duration duration) {
+        nanoseconds_ += duration.nanoseconds();
+        return *this;
+    }
+    MonotonicTimestamp &operator-=(Duration duration) {
+        nanoseconds_ -= duration.nanoseconds();
+        return *this;
+    }
+
+private:
+    int64_t nanoseconds_;
+};
+
+inline MonotonicTimestamp operator+(MonotonicTimestamp lhs, Duration rhs) {
+    return lhs += rhs;
+}
+inline MonotonicTimestamp operator-(MonotonicTimestamp lhs, Duration rhs) {
+    return lhs -= rhs;
+}
+inline Duration operator-(MonotonicTimestamp lhs, MonotonicTimestamp rhs) {
+    return Duration::fromNanoseconds(lhs.nanoseconds() - rhs.nanoseconds());
+}
+
+inline bool operator==(MonotonicTimestamp lhs, MonotonicTimestamp rhs) {
+    return lhs.nanoseconds() == rhs.nanoseconds();
+}
+inline bool operator!=(MonotonicTimestamp lhs, MonotonicTimestamp rhs) {
+    return !(lhs == rhs);
+}
+inline bool operator<(MonotonicTimestamp lhs, MonotonicTimestamp rhs) {
+    return lhs.nanoseconds() < rhs.nanoseconds();
+}
+inline bool operator>(MonotonicTimestamp lhs, MonotonicTimestamp rhs) {
+    return rhs < lhs;
+}
+inline bool operator<=(MonotonicTimestamp lhs, MonotonicTimestamp rhs) {
+    return !(rhs < lhs);
+}
+inline bool operator>=(MonotonicTimestamp lhs, MonotonicTimestamp rhs) {
+    return !(lhs < rhs);
+}
+
+///
+/// Measures the time since it was started.
+///
+class Stopwatch {
+public:
+    /// Starts it
+    Stopwatch() : start_(MonotonicTimestamp::Now()) {}
+
+    Duration elapsed() const { return MonotonicTimestamp::Now() - start_; }
+
+    /// Starts it again
+    /// @return The time elapsed until now
+    Duration restart() {
+        MonotonicTimestamp now = MonotonicTimestamp::Now();
+        Duration elapsed = now - start_;
+        start_ = now;
+        return elapsed;
+    }
+
+    MonotonicTimestamp started() const { return start_; }
+
+private:
+    MonotonicTimestamp start_;
+};
+
 } // namespace Mordor2
 
 #endif /* __TIMESTAMP_H_ */
@@ -0,0 +1,166 @@
+#include "appendfilelogsink.h"
+#include "config.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <stdio.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace Mordor2 {
+
+static ConfigVar<size_t>::ptr g_fileBatchBytes = Config::lookup(
+    "log.file.batchbytes", size_t(65536),
+    "Bytes of messages an append-mode log file writes at once.");
+static ConfigVar<uint64_t>::ptr g_fileBatchInterval = Config::lookup(
+    "log.file.batchusec", uint64_t(1000),
+    "Maximum microseconds an append-mode log file holds a message before "
+    "writing it; 0 writes every message immediately.");
+
+AppendFileLogSink::AppendFileLogSink(const std::string &file,
+                                     size_t batchBytes,
+                                     std::chrono::microseconds batchInterval)
+    : m_file(file),
+      m_batchBytes(batchBytes ? batchBytes : g_fileBatchBytes->val()),
+      m_batchInterval(batchInterval.count() >= 0
+                          ? batchInterval
+                          : std::chrono::microseconds(
+                                g_fileBatchInterval->val())),
+      m_busy(false),
+      m_stopping(false),
+      m_dropped(0) {
+    if (!m_batchBytes)
+        m_batchBytes = 1;
+    m_fd = open(file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (m_fd < 0)
+        throw std::system_error(errno, std::system_category(), file);
+    if (m_batchInterval.count() > 0) {
+        m_batch.reserve(m_batchBytes * 2);
+        m_writing.reserve(m_batchBytes * 2);
+        m_thread = std::thread(&AppendFileLogSink::run, this);
+    }
+}
+
+AppendFileLogSink::~AppendFileLogSink() {
+    if (m_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+            m_cond.notify_one();
+        }
+        m_thread.join();
+    }
+    flush();
+    close(m_fd);
+}
+
+void AppendFileLogSink::log(const std::string &logger, int64_t now,
+                            tid_t thread, Log::Level level,
+                            const std::string &str, const char *file,
+                            int line) {
+    static thread_local std::string record;
+    record.clear();
+    FileLogSink::format(record, logger, now, thread, level, str, file, line);
+
+    if (m_batchInterval.count() == 0) {
+        writeBatch(record.data(), record.size());
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    bool first = reserve(lock);
+    m_batch.append(record);
+    appended(lock, first);
+}
+
+void AppendFileLogSink::logBatch(const LogRecord *records, size_t count) {
+    static thread_local std::string buf;
+    buf.clear();
+    for (size_t i = 0; i < count; ++i)
+        FileLogSink::format(buf, records[i]);
+    if (m_batchInterval.count() == 0) {
+        writeBatch(buf.data(), buf.size());
+        return;
+    }
+    std::unique_lock<std::mutex> lock(m_mutex);
+    bool first = reserve(lock);
+    m_batch.append(buf);
+    appended(lock, first);
+}
+
+void AppendFileLogSink::flush() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_busy)
+        m_written.wait(lock);
+    commit(lock, 1);
+}
+
+bool AppendFileLogSink::reserve(std::unique_lock<std::mutex> &lock) {
+    // Don't let the batch grow without bound behind a slow write
+    while (m_busy && m_batch.size() >= m_batchBytes * 4)
+        m_written.wait(lock);
+    return m_batch.empty();
+}
+
+void AppendFileLogSink::appended(std::unique_lock<std::mutex> &lock,
+                                 bool first) {
+    if (m_batch.size() >= m_batchBytes) {
+        // If a write is already in progress, its writer picks this batch up
+        if (!m_busy)
+            commit(lock, m_batchBytes);
+    } else if (first) {
+        m_cond.notify_one();
+    }
+}
+
+void AppendFileLogSink::commit(std::unique_lock<std::mutex> &lock,
+                               size_t threshold) {
+    while (!m_batch.empty() && m_batch.size() >= threshold) {
+        m_busy = true;
+        m_writing.swap(m_batch);
+        lock.unlock();
+        writeBatch(m_writing.data(), m_writing.size());
+        m_writing.clear();
+        lock.lock();
+        m_busy = false;
+        m_written.notify_all();
+        // Messages logged since were not waited for; leave a small batch to
+        // the timer
+        threshold = m_batchBytes;
+    }
+}
+
+void AppendFileLogSink::writeBatch(const char *buf, size_t len) {
+    if (!len)
+        return;
+    ssize_t written;
+    do {
+        written = write(m_fd, buf, len);
+    } while (written < 0 && errno == EINTR);
+    // Nowhere to report an error, and writing the rest of a short write
+    // could leave a message split around another process's; drop it instead
+    if (written < 0)
+        written = 0;
+    if (size_t(written) < len)
+        m_dropped.fetch_add(len - written, std::memory_order_relaxed);
+}
+
+void AppendFileLogSink::run() {
+    typedef std::chrono::steady_clock Clock;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stopping) {
+        if (m_batch.empty()) {
+            m_cond.wait(lock);
+            continue;
+        }
+        // Give the batch its window to fill, then write whatever it holds
+        Clock::time_point deadline = Clock::now() + m_batchInterval;
+        while (!m_stopping && !m_batch.empty() && Clock::now() < deadline)
+            m_cond.wait_until(lock, deadline);
+        while (m_busy)
+            m_written.wait(lock);
+        commit(lock, 1);
+    }
+}
+
+} // namespace Mordor2
@@ -0,0 +1,302 @@
+#include "asynclogsink.h"
+#include "binarylog.h"
+#include "config.h"
+#include "timestamp.h"
+
+#include <chrono>
+
+namespace Mordor2 {
+
+static ConfigVar<size_t>::ptr g_asyncCapacity = Config::lookup(
+    "log.async.capacity", size_t(8192),
+    "Number of messages an asynchronous log sink can queue.");
+static ConfigVar<uint64_t>::ptr g_asyncFlushInterval = Config::lookup(
+    "log.async.flushinterval", uint64_t(100000),
+    "Maximum microseconds an asynchronous log sink waits before flushing.");
+static ConfigVar<bool>::ptr g_asyncBlocking =
+    Config::lookup("log.async.blocking", true,
+                   "Wait for room instead of dropping messages when an "
+                   "asynchronous log sink is full.");
+
+// Most records handed to the wrapped sink's logBatch() at once
+static const size_t kMaxBatch = 256;
+
+static size_t roundUpToPowerOfTwo(size_t n) {
+    size_t result = 2;
+    while (result < n)
+        result <<= 1;
+    return result;
+}
+
+AsyncLogSink::AsyncLogSink(LogSink::ptr sink, size_t capacity)
+    : m_sink(sink),
+      m_mask(roundUpToPowerOfTwo(capacity ? capacity
+                                          : g_asyncCapacity->val()) -
+             1),
+      m_blocking(g_asyncBlocking->val()),
+      m_flushInterval(g_asyncFlushInterval->val()),
+      m_tail(0),
+      m_head(0),
+      m_batchLoggerId(0),
+      m_reportedDropped(0),
+      m_dropped(0),
+      m_sleeping(false),
+      m_flushRequested(0),
+      m_flushCompleted(0),
+      m_stopping(false) {
+    if (m_flushInterval.count() <= 0)
+        m_flushInterval = std::chrono::microseconds(1);
+    m_batch.reserve(kMaxBatch);
+    m_slots.reset(new Slot[m_mask + 1]);
+    for (size_t i = 0; i <= m_mask; ++i)
+        m_slots[i].seq.store(i, std::memory_order_relaxed);
+    m_thread = std::thread(&AsyncLogSink::run, this);
+}
+
+AsyncLogSink::~AsyncLogSink() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping.store(true, std::memory_order_release);
+        m_cond.notify_one();
+    }
+    m_thread.join();
+}
+
+void AsyncLogSink::log(const std::string &logger, int64_t now, tid_t thread,
+                       Log::Level level, const std::string &str,
+                       const char *file, int line) {
+    push(logger, now, thread, level, NULL, str.data(), str.size(), NULL, 0,
+         file, line);
+}
+
+void AsyncLogSink::logBinary(const std::string &logger, int64_t now,
+                             tid_t thread, Log::Level level,
+                             const BinaryLogSite &site, const char *args,
+                             size_t len) {
+    push(logger, now, thread, level, &site, args, len, NULL, 0, site.file,
+         site.line);
+}
+
+void AsyncLogSink::logFields(const std::string &logger, int64_t now,
+                             tid_t thread, Log::Level level,
+                             const std::string &str, const LogField *fields,
+                             size_t count, const char *file, int line) {
+    // A non-NULL fields marks the message as structured, even with no fields
+    static const LogField kNoFields[1] = {};
+    push(logger, now, thread, level, NULL, str.data(), str.size(),
+         count ? fields : kNoFields, count, file, line);
+}
+
+void AsyncLogSink::push(const std::string &logger, int64_t now, tid_t thread,
+                        Log::Level level, const BinaryLogSite *site,
+                        const char *str, size_t len, const LogField *fields,
+                        size_t count, const char *file, int line) {
+    while (!tryPush(logger, now, thread, level, site, str, len, fields, count,
+                    file, line)) {
+        if (!m_blocking) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        wake();
+        std::this_thread::yield();
+    }
+    // Pairs with the fence in run(): either we see the writer going to sleep,
+    // or the writer sees the record we just published
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_sleeping.load(std::memory_order_relaxed))
+        wake();
+}
+
+void AsyncLogSink::flush() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    uint64_t ticket =
+        m_flushRequested.fetch_add(1, std::memory_order_acq_rel) + 1;
+    m_cond.notify_one();
+    while (m_flushCompleted < ticket)
+        m_flushed.wait(lock);
+}
+
+bool AsyncLogSink::tryPush(const std::string &logger, int64_t now,
+                           tid_t thread, Log::Level level,
+                           const BinaryLogSite *site, const char *str,
+                           size_t len, const LogField *fields, size_t count,
+                           const char *file, int line) {
+    Slot *slot;
+    size_t pos = m_tail.load(std::memory_order_relaxed);
+    for (;;) {
+        slot = &m_slots[pos & m_mask];
+        size_t seq = slot->seq.load(std::memory_order_acquire);
+        intptr_t diff =
+            static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+            if (m_tail.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = m_tail.load(std::memory_order_relaxed);
+        }
+    }
+    // assign() reuses the capacity left over from earlier messages, so a
+    // warmed-up ring does not allocate
+    Record &record = slot->record;
+    record.logger.assign(logger);
+    record.str.assign(str, len);
+    record.site = site;
+    record.structured = fields != NULL;
+    if (fields) {
+        record.fields.assign(fields, fields + count);
+        record.fieldData.clear();
+        for (size_t i = 0; i < count; ++i) {
+            if (fields[i].type == LogField::Type::STRING)
+                record.fieldData.append(fields[i].str.data, fields[i].str.len);
+        }
+        // Only point into fieldData once it has stopped growing
+        const char *data = record.fieldData.data();
+        for (size_t i = 0; i < count; ++i) {
+            if (record.fields[i].type == LogField::Type::STRING) {
+                record.fields[i].str.data = data;
+                data += record.fields[i].str.len;
+            }
+        }
+    }
+    record.now = now;
+    record.thread = thread;
+    record.level = level;
+    record.file = file;
+    record.line = line;
+    slot->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+size_t AsyncLogSink::drain() {
+    size_t count = 0;
+    for (;;) {
+        Slot &slot = m_slots[m_head & m_mask];
+        if (slot.seq.load(std::memory_order_acquire) != m_head + 1)
+            break;
+        const Record &record = slot.record;
+        if (!record.site && !record.structured) {
+            if (record.logger != m_batchLogger || m_batchLogger.empty()) {
+                m_batchLogger = record.logger;
+                // Only look the name up; draining must not create Loggers
+                m_batchLoggerId = Log::findId(record.logger);
+            }
+            LogRecord batched;
+            batched.loggerId = m_batchLoggerId;
+            batched.logger.data = record.logger.data();
+            batched.logger.len = record.logger.size();
+            batched.now = record.now;
+            batched.thread = record.thread;
+            batched.level = record.level;
+            batched.str.data = record.str.data();
+            batched.str.len = record.str.size();
+            batched.file = record.file;
+            batched.line = record.line;
+            m_batch.push_back(batched);
+            ++m_head;
+            ++count;
+            if (m_batch.size() == kMaxBatch)
+                deliverBatch();
+            continue;
+        }
+        // Keep the order
+        deliverBatch();
+        if (record.site)
+            m_sink->logBinary(record.logger, record.now, record.thread,
+                              record.level, *record.site, record.str.data(),
+                              record.str.size());
+        else
+            m_sink->logFields(record.logger, record.now, record.thread,
+                              record.level, record.str, record.fields.data(),
+                              record.fields.size(), record.file, record.line);
+        slot.seq.store(m_head + m_mask + 1, std::memory_order_release);
+        ++m_head;
+        ++count;
+    }
+    deliverBatch();
+    if (count)
+        reportDropped();
+    return count;
+}
+
+void AsyncLogSink::deliverBatch() {
+    if (m_batch.empty())
+        return;
+    m_sink->logBatch(m_batch.data(), m_batch.size());
+    // Only now can producers reuse the slots the records point into
+    for (size_t pos = m_head - m_batch.size(); pos != m_head; ++pos)
+        m_slots[pos & m_mask].seq.store(pos + m_mask + 1,
+                                        std::memory_order_release);
+    m_batch.clear();
+}
+
+bool AsyncLogSink::empty() const {
+    return m_slots[m_head & m_mask].seq.load(std::memory_order_acquire) !=
+           m_head + 1;
+}
+
+void AsyncLogSink::wake() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_cond.notify_one();
+}
+
+void AsyncLogSink::reportDropped() {
+    uint64_t dropped = m_dropped.load(std::memory_order_relaxed);
+    if (dropped == m_reportedDropped)
+        return;
+    std::ostringstream os;
+    os << "dropped " << dropped - m_reportedDropped
+       << " messages because the asynchronous log queue was full";
+    m_reportedDropped = dropped;
+    m_sink->log("mordor:log:async",
+                Timestamp::MicrosecondsNow(),
+                gettid(), Log::Level::WARNING, os.str(), __FILENAME__,
+                __LINE__);
+}
+
+void AsyncLogSink::run() {
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point lastFlush = Clock::now();
+    bool unflushed = false;
+    for (;;) {
+        // Read before draining, so that an empty queue afterwards means
+        // everything queued before these requests has been delivered
+        uint64_t requested = m_flushRequested.load(std::memory_order_acquire);
+        bool stopping = m_stopping.load(std::memory_order_acquire);
+
+        if (drain()) {
+            unflushed = true;
+            Clock::time_point now = Clock::now();
+            if (now - lastFlush >= m_flushInterval) {
+                m_sink->flush();
+                unflushed = false;
+                lastFlush = now;
+            }
+            continue;
+        }
+
+        if (unflushed || requested != m_flushCompleted) {
+            m_sink->flush();
+            unflushed = false;
+            lastFlush = Clock::now();
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (requested != m_flushCompleted) {
+            m_flushCompleted = requested;
+            m_flushed.notify_all();
+        }
+        if (stopping)
+            break;
+        m_sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (empty() && !m_stopping.load(std::memory_order_relaxed) &&
+            m_flushRequested.load(std::memory_order_relaxed) == requested)
+            m_cond.wait_for(lock, m_flushInterval);
+        m_sleeping.store(false, std::memory_order_relaxed);
+    }
+}
+
+} // namespace Mordor2
@@ -0,0 +1,460 @@
+#include "binarylog.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <deque>
+#include <fcntl.h>
+#include <stdexcept>
+#include <stdio.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace Mordor2 {
+
+// Record tags of the wire format.  Integers are varints, strings are a varint
+// length followed by the bytes, and doubles and pointers are 8 bytes in host
+// order.
+enum Tag : uint8_t {
+    // "MORDOR2B", version; resets the site and logger dictionaries
+    kSession = 0x01,
+    // id, level, line, file, format, argument count, argument types
+    kSite = 0x02,
+    // id, name
+    kLogger = 0x03,
+    // site, logger, level, now, thread, arguments
+    kEvent = 0x04,
+    // logger, level, now, thread, file, line, message
+    kText = 0x05,
+};
+
+static const char kMagic[] = "MORDOR2B";
+static const uint8_t kVersion = 1;
+static const size_t kBufferSize = 64 * 1024;
+// What the reader accepts, so a corrupt length or id fails as a bad log
+// rather than as an attempt to allocate it; far beyond what a real program
+// logs or registers
+static const uint64_t kMaxStringSize = 64 * 1024 * 1024;
+static const uint64_t kMaxIds = 1 << 20;
+
+static std::mutex g_sitesMutex;
+static std::deque<BinaryLogSite> &sites() {
+    static std::deque<BinaryLogSite> sites;
+    return sites;
+}
+
+const BinaryLogSite *
+BinaryLog::registerSite(Log::Level level, const char *file, int line,
+                        const char *format,
+                        const std::vector<BinaryLogArg> &args) {
+    std::lock_guard<std::mutex> lock(g_sitesMutex);
+    BinaryLogSite site;
+    site.id = static_cast<uint32_t>(sites().size());
+    site.level = level;
+    site.file = file;
+    site.line = line;
+    site.format = format;
+    site.args = args;
+    sites().push_back(site);
+    return &sites().back();
+}
+
+const BinaryLogSite *BinaryLog::site(uint32_t id) {
+    std::lock_guard<std::mutex> lock(g_sitesMutex);
+    if (id >= sites().size())
+        return NULL;
+    return &sites()[id];
+}
+
+static thread_local std::string t_encodeBuf;
+static thread_local bool t_encoding = false;
+
+std::atomic<BinaryLogRecorder> BinaryLog::s_recorder(NULL);
+
+BinaryLog::EncodeBuffer::EncodeBuffer() {
+    if (t_encoding) {
+        m_buf = &m_own;
+    } else {
+        t_encoding = true;
+        m_buf = &t_encodeBuf;
+        m_buf->clear();
+    }
+}
+
+BinaryLog::EncodeBuffer::~EncodeBuffer() {
+    if (m_buf == &t_encodeBuf)
+        t_encoding = false;
+}
+
+void BinaryLog::writeVarint(std::string &buf, uint64_t v) {
+    while (v >= 0x80) {
+        buf.push_back(static_cast<char>(v | 0x80));
+        v >>= 7;
+    }
+    buf.push_back(static_cast<char>(v));
+}
+
+size_t BinaryLog::readVarint(const char *buf, size_t len, uint64_t &v) {
+    v = 0;
+    for (size_t i = 0; i < len && i < 10; ++i) {
+        uint8_t byte = static_cast<uint8_t>(buf[i]);
+        v |= static_cast<uint64_t>(byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80))
+            return i + 1;
+    }
+    return 0;
+}
+
+void BinaryLog::writeString(std::string &buf, const char *str, size_t len) {
+    writeVarint(buf, len);
+    buf.append(str, len);
+}
+
+static void formatArg(BinaryLogArg type, const char *&args, const char *end,
+                      std::string &result) {
+    char tmp[32];
+    uint64_t v;
+    size_t used;
+    switch (type) {
+    case BinaryLogArg::BOOL:
+    case BinaryLogArg::CHAR:
+        if (end - args < 1)
+            break;
+        if (type == BinaryLogArg::BOOL)
+            result += *args ? "true" : "false";
+        else
+            result += *args;
+        ++args;
+        return;
+    case BinaryLogArg::INT:
+    case BinaryLogArg::UINT:
+        used = BinaryLog::readVarint(args, end - args, v);
+        if (!used)
+            break;
+        args += used;
+        if (type == BinaryLogArg::INT) {
+            int64_t n = static_cast<int64_t>(v >> 1) ^
+                        -static_cast<int64_t>(v & 1);
+            snprintf(tmp, sizeof(tmp), "%lld", static_cast<long long>(n));
+        } else {
+            snprintf(tmp, sizeof(tmp), "%llu",
+                     static_cast<unsigned long long>(v));
+        }
+        result += tmp;
+        return;
+    case BinaryLogArg::DOUBLE:
+    case BinaryLogArg::POINTER:
+        if (end - args < 8)
+            break;
+        if (type == BinaryLogArg::DOUBLE) {
+            double d;
+            memcpy(&d, args, sizeof(d));
+            snprintf(tmp, sizeof(tmp), "%g", d);
+        } else {
+            memcpy(&v, args, sizeof(v));
+            snprintf(tmp, sizeof(tmp), "0x%llx",
+                     static_cast<unsigned long long>(v));
+        }
+        args += 8;
+        result += tmp;
+        return;
+    case BinaryLogArg::STRING:
+        used = BinaryLog::readVarint(args, end - args, v);
+        if (!used || static_cast<uint64_t>(end - args) - used < v)
+            break;
+        result.append(args + used, v);
+        args += used + v;
+        return;
+    }
+    throw std::runtime_error("truncated binary log arguments");
+}
+
+void BinaryLog::format(const BinaryLogSite &site, const char *args, size_t len,
+                       std::string &result) {
+    const char *end = args + len;
+    size_t arg = 0;
+    for (const char *p = site.format; *p; ++p) {
+        if (p[0] == '{' && p[1] == '{') {
+            result += '{';
+            ++p;
+        } else if (p[0] == '}' && p[1] == '}') {
+            result += '}';
+            ++p;
+        } else if (p[0] == '{' && p[1] == '}' && arg < site.args.size()) {
+            formatArg(site.args[arg++], args, end, result);
+            ++p;
+        } else {
+            result += *p;
+        }
+    }
+}
+
+BinaryLogSink::BinaryLogSink(const std::string &file) : m_file(file) {
+    m_fd = open(file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (m_fd < 0)
+        throw std::system_error(errno, std::system_category(), file);
+    m_buf.reserve(kBufferSize);
+    m_buf.push_back(kSession);
+    m_buf.append(kMagic, sizeof(kMagic) - 1);
+    m_buf.push_back(kVersion);
+}
+
+BinaryLogSink::~BinaryLogSink() {
+    writeBuffer();
+    close(m_fd);
+}
+
+uint32_t BinaryLogSink::loggerId(const std::string &logger) {
+    std::unordered_map<std::string, uint32_t>::iterator it =
+        m_loggers.find(logger);
+    if (it != m_loggers.end())
+        return it->second;
+    uint32_t id = static_cast<uint32_t>(m_loggers.size());
+    m_loggers.insert(std::make_pair(logger, id));
+    m_buf.push_back(kLogger);
+    BinaryLog::writeVarint(m_buf, id);
+    BinaryLog::writeString(m_buf, logger.data(), logger.size());
+    return id;
+}
+
+void BinaryLogSink::log(const std::string &logger, int64_t now, tid_t thread,
+                        Log::Level level, const std::string &str,
+                        const char *file, int line) {
+    if (!file)
+        file = "";
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint32_t id = loggerId(logger);
+    m_buf.push_back(kText);
+    BinaryLog::writeVarint(m_buf, id);
+    m_buf.push_back(static_cast<char>(level));
+    BinaryLog::writeVarint(m_buf, now);
+    BinaryLog::writeVarint(m_buf, thread);
+    BinaryLog::writeString(m_buf, file, strlen(file));
+    BinaryLog::writeVarint(m_buf, line < 0 ? 0 : line);
+    BinaryLog::writeString(m_buf, str.data(), str.size());
+    if (m_buf.size() >= kBufferSize)
+        writeBuffer();
+}
+
+void BinaryLogSink::logBinary(const std::string &logger, int64_t now,
+                              tid_t thread, Log::Level level,
+                              const BinaryLogSite &site, const char *args,
+                              size_t len) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (site.id >= m_sites.size())
+        m_sites.resize(site.id + 1);
+    if (!m_sites[site.id]) {
+        m_sites[site.id] = true;
+        m_buf.push_back(kSite);
+        BinaryLog::writeVarint(m_buf, site.id);
+        m_buf.push_back(static_cast<char>(site.level));
+        BinaryLog::writeVarint(m_buf, site.line);
+        BinaryLog::writeString(m_buf, site.file, strlen(site.file));
+        BinaryLog::writeString(m_buf, site.format, strlen(site.format));
+        BinaryLog::writeVarint(m_buf, site.args.size());
+        for (size_t i = 0; i < site.args.size(); ++i)
+            m_buf.push_back(static_cast<char>(site.args[i]));
+    }
+    uint32_t id = loggerId(logger);
+    m_buf.push_back(kEvent);
+    BinaryLog::writeVarint(m_buf, site.id);
+    BinaryLog::writeVarint(m_buf, id);
+    m_buf.push_back(static_cast<char>(level));
+    BinaryLog::writeVarint(m_buf, now);
+    BinaryLog::writeVarint(m_buf, thread);
+    m_buf.append(args, len);
+    if (m_buf.size() >= kBufferSize)
+        writeBuffer();
+}
+
+void BinaryLogSink::flush() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    writeBuffer();
+}
+
+void BinaryLogSink::writeBuffer() {
+    const char *p = m_buf.data();
+    size_t remaining = m_buf.size();
+    while (remaining) {
+        ssize_t written = write(m_fd, p, remaining);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            // Nowhere to report it; drop the buffer rather than grow forever
+            break;
+        }
+        p += written;
+        remaining -= written;
+    }
+    m_buf.clear();
+}
+
+BinaryLogReader::BinaryLogReader(std::istream &is)
+    : m_is(is), m_session(false) {}
+
+uint8_t BinaryLogReader::readByte() {
+    int c = m_is.get();
+    if (c == std::istream::traits_type::eof())
+        throw std::runtime_error("truncated binary log");
+    return static_cast<uint8_t>(c);
+}
+
+uint64_t BinaryLogReader::readVarint() {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t byte = readByte();
+        v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return v;
+    }
+    throw std::runtime_error("invalid varint in binary log");
+}
+
+std::string BinaryLogReader::readString() {
+    uint64_t len = readVarint();
+    if (len > kMaxStringSize)
+        throw std::runtime_error("invalid string length in binary log");
+    // Grow with what is actually read, so a truncated file does not allocate
+    // the whole length up front
+    std::string result;
+    while (result.size() < len) {
+        size_t offset = result.size();
+        size_t chunk = std::min<uint64_t>(len - offset, kBufferSize);
+        result.resize(offset + chunk);
+        if (!m_is.read(&result[offset], chunk))
+            throw std::runtime_error("truncated binary log");
+    }
+    return result;
+}
+
+uint64_t BinaryLogReader::readId() {
+    uint64_t id = readVarint();
+    if (id >= kMaxIds)
+        throw std::runtime_error("invalid id in binary log");
+    return id;
+}
+
+Log::Level BinaryLogReader::readLevel() {
+    uint8_t level = readByte();
+    // Log::Level indexes the level names, so must not be out of range
+    if (level < static_cast<uint8_t>(Log::Level::FATAL) ||
+        level > static_cast<uint8_t>(Log::Level::TRACE))
+        throw std::runtime_error("invalid level in binary log");
+    return static_cast<Log::Level>(level);
+}
+
+void BinaryLogReader::readArgs(const BinaryLogSite &site, std::string &args) {
+    args.clear();
+    for (size_t i = 0; i < site.args.size(); ++i) {
+        switch (site.args[i]) {
+        case BinaryLogArg::BOOL:
+        case BinaryLogArg::CHAR:
+            args.push_back(static_cast<char>(readByte()));
+            break;
+        case BinaryLogArg::INT:
+        case BinaryLogArg::UINT:
+            BinaryLog::writeVarint(args, readVarint());
+            break;
+        case BinaryLogArg::DOUBLE:
+        case BinaryLogArg::POINTER:
+            for (int j = 0; j < 8; ++j)
+                args.push_back(static_cast<char>(readByte()));
+            break;
+        case BinaryLogArg::STRING: {
+            std::string str = readString();
+            BinaryLog::writeString(args, str.data(), str.size());
+            break;
+        }
+        default:
+            throw std::runtime_error("invalid argument type in binary log");
+        }
+    }
+}
+
+void BinaryLogReader::checkSession() {
+    if (!m_session)
+        throw std::runtime_error("binary log does not start with a session");
+}
+
+bool BinaryLogReader::next(Message &message) {
+    std::string args;
+    for (;;) {
+        int c = m_is.get();
+        if (c == std::istream::traits_type::eof())
+            return false;
+        switch (c) {
+        case kSession: {
+            char magic[sizeof(kMagic) - 1];
+            if (!m_is.read(magic, sizeof(magic)) ||
+                memcmp(magic, kMagic, sizeof(magic)) != 0)
+                throw std::runtime_error("not a mordor2 binary log");
+            if (readByte() != kVersion)
+                throw std::runtime_error("unsupported binary log version");
+            m_session = true;
+            m_sites.clear();
+            m_strings.clear();
+            m_loggers.clear();
+            break;
+        }
+        case kSite: {
+            checkSession();
+            std::unique_ptr<BinaryLogSite> site(new BinaryLogSite());
+            site->id = static_cast<uint32_t>(readId());
+            site->level = readLevel();
+            site->line = static_cast<int>(readVarint());
+            m_strings.emplace_back(new std::string(readString()));
+            site->file = m_strings.back()->c_str();
+            m_strings.emplace_back(new std::string(readString()));
+            site->format = m_strings.back()->c_str();
+            uint64_t count = readVarint();
+            for (uint64_t i = 0; i < count; ++i)
+                site->args.push_back(static_cast<BinaryLogArg>(readByte()));
+            if (site->id >= m_sites.size())
+                m_sites.resize(site->id + 1);
+            m_sites[site->id] = std::move(site);
+            break;
+        }
+        case kLogger: {
+            checkSession();
+            uint64_t id = readId();
+            if (id >= m_loggers.size())
+                m_loggers.resize(id + 1);
+            m_loggers[id] = readString();
+            break;
+        }
+        case kEvent:
+        case kText: {
+            checkSession();
+            const BinaryLogSite *site = NULL;
+            if (c == kEvent) {
+                uint64_t id = readVarint();
+                if (id >= m_sites.size() || !m_sites[id])
+                    throw std::runtime_error("undefined site in binary log");
+                site = m_sites[id].get();
+            }
+            uint64_t logger = readVarint();
+            if (logger >= m_loggers.size())
+                throw std::runtime_error("undefined logger in binary log");
+            message.logger = m_loggers[logger];
+            message.level = readLevel();
+            message.now = static_cast<int64_t>(readVarint());
+            message.thread = static_cast<tid_t>(readVarint());
+            if (site) {
+                readArgs(*site, args);
+                message.file = site->file;
+                message.line = site->line;
+                message.str.clear();
+                BinaryLog::format(*site, args.data(), args.size(), message.str);
+            } else {
+                message.file = readString();
+                message.line = static_cast<int>(readVarint());
+                message.str = readString();
+            }
+            return true;
+        }
+        default:
+            throw std::runtime_error("invalid record in binary log");
+        }
+    }
+}
+
+} // namespace Mordor2
@@ -21,6 +21,7 @@ isValidConfigVarName(const std::string &name, bool allowDot)
 }
 
 bool Config::s_locked = false;
+std::atomic<uint64_t> ConfigVarBase::s_generation(0);
 
 ConfigVarBase::ptr
 Config::lookup(const std::string &name)
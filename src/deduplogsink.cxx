@@ -0,0 +1,194 @@
+#include "deduplogsink.h"
+#include "binarylog.h"
+#include "config.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdio.h>
+#include <vector>
+
+namespace Mordor2 {
+
+static ConfigVar<uint64_t>::ptr g_dedupWindow = Config::lookup(
+    "log.dedup.windowusec", uint64_t(1000000),
+    "Microseconds for which repeats of a log message are collapsed.");
+static ConfigVar<size_t>::ptr g_dedupEntries = Config::lookup(
+    "log.dedup.entries", size_t(4096),
+    "Number of distinct recent log messages remembered to collapse repeats "
+    "of.");
+
+static const size_t kStripes = 64;
+// Entries a message can be placed in within its stripe
+static const size_t kWays = 4;
+
+// FNV-1a
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+DedupLogSink::DedupLogSink(LogSink::ptr sink,
+                           std::chrono::microseconds window, size_t entries)
+    : m_sink(sink),
+      m_window(window.count() >= 0 ? window.count()
+                                   : g_dedupWindow->val()),
+      m_nextSweep(0),
+      m_suppressed(0) {
+    if (!entries)
+        entries = g_dedupEntries->val();
+    m_sets = std::max<size_t>(
+        1, (entries + kStripes * kWays - 1) / (kStripes * kWays));
+    m_stripes.reset(new Stripe[kStripes]);
+    for (size_t i = 0; i < kStripes; ++i) {
+        m_stripes[i].entries.reset(new Entry[m_sets * kWays]);
+        for (size_t j = 0; j < m_sets * kWays; ++j)
+            m_stripes[i].entries[j].used = false;
+    }
+}
+
+DedupLogSink::~DedupLogSink() { sweep(0, true); }
+
+void DedupLogSink::log(const std::string &logger, int64_t now, tid_t thread,
+                       Log::Level level, const std::string &str,
+                       const char *file, int line) {
+    if (admit(logger, now, thread, level, NULL, str.data(), str.size(), file,
+              line))
+        m_sink->log(logger, now, thread, level, str, file, line);
+}
+
+void DedupLogSink::logBinary(const std::string &logger, int64_t now,
+                             tid_t thread, Log::Level level,
+                             const BinaryLogSite &site, const char *args,
+                             size_t len) {
+    if (admit(logger, now, thread, level, &site, args, len, site.file,
+              site.line))
+        m_sink->logBinary(logger, now, thread, level, site, args, len);
+}
+
+void DedupLogSink::logFields(const std::string &logger, int64_t now,
+                             tid_t thread, Log::Level level,
+                             const std::string &str, const LogField *fields,
+                             size_t count, const char *file, int line) {
+    static thread_local std::string key;
+    key.assign(str);
+    LogField::format(key, fields, count);
+    if (admit(logger, now, thread, level, NULL, key.data(), key.size(), file,
+              line))
+        m_sink->logFields(logger, now, thread, level, str, fields, count,
+                          file, line);
+}
+
+void DedupLogSink::flush() {
+    sweep(0, true);
+    m_sink->flush();
+}
+
+bool DedupLogSink::admit(const std::string &logger, int64_t now,
+                         tid_t thread, Log::Level level,
+                         const BinaryLogSite *site, const char *str,
+                         size_t len, const char *file, int line) {
+    // file is left out of the hash; the same file can have several copies of
+    // its name
+    uint64_t hash = hashBytes(14695981039346656037ULL, logger.data(),
+                              logger.size());
+    hash = hashBytes(hash, str, len);
+    hash = hashBytes(hash, &level, sizeof(level));
+    hash = hashBytes(hash, &line, sizeof(line));
+    hash = hashBytes(hash, &site, sizeof(site));
+
+    Stripe &stripe = m_stripes[hash % kStripes];
+    Entry *set = &stripe.entries[(hash / kStripes) % m_sets * kWays];
+    Entry pending;
+    pending.repeats = 0;
+    {
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        Entry *entry = NULL;
+        Entry *victim = NULL;
+        for (size_t i = 0; i < kWays; ++i) {
+            Entry &e = set[i];
+            if (!e.used) {
+                if (!victim || victim->used)
+                    victim = &e;
+            } else if (e.hash == hash && e.level == level &&
+                       e.line == line && e.site == site &&
+                       e.str.size() == len &&
+                       memcmp(e.str.data(), str, len) == 0 &&
+                       e.logger == logger &&
+                       (e.file == file ||
+                        (e.file && file && strcmp(e.file, file) == 0))) {
+                entry = &e;
+                break;
+            } else if (!victim || (victim->used && e.last < victim->last)) {
+                victim = &e;
+            }
+        }
+        if (entry) {
+            if (now - entry->first < m_window) {
+                ++entry->repeats;
+                entry->last = now;
+                entry->thread = thread;
+                m_suppressed.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            if (entry->repeats)
+                pending = *entry;
+        } else {
+            entry = victim;
+            if (entry->used && entry->repeats)
+                pending = std::move(*entry);
+            entry->used = true;
+            entry->hash = hash;
+            entry->logger = logger;
+            entry->level = level;
+            entry->file = file;
+            entry->line = line;
+            entry->site = site;
+            entry->str.assign(str, len);
+        }
+        entry->first = entry->last = now;
+        entry->thread = thread;
+        entry->repeats = 0;
+    }
+    if (pending.repeats)
+        report(pending);
+
+    int64_t next = m_nextSweep.load(std::memory_order_relaxed);
+    if (now >= next &&
+        m_nextSweep.compare_exchange_strong(next, now + m_window,
+                                            std::memory_order_relaxed))
+        sweep(now, false);
+    return true;
+}
+
+void DedupLogSink::sweep(int64_t now, bool all) {
+    std::vector<Entry> pending;
+    for (size_t i = 0; i < kStripes; ++i) {
+        Stripe &stripe = m_stripes[i];
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        for (size_t j = 0; j < m_sets * kWays; ++j) {
+            Entry &entry = stripe.entries[j];
+            if (entry.used && entry.repeats &&
+                (all || now - entry.first >= m_window)) {
+                pending.push_back(entry);
+                entry.repeats = 0;
+            }
+        }
+    }
+    for (size_t i = 0; i < pending.size(); ++i)
+        report(pending[i]);
+}
+
+void DedupLogSink::report(const Entry &entry) {
+    char str[64];
+    snprintf(str, sizeof(str), "last message repeated %llu time%s",
+             static_cast<unsigned long long>(entry.repeats),
+             entry.repeats == 1 ? "" : "s");
+    m_sink->log(entry.logger, entry.last, entry.thread, entry.level, str,
+                entry.file, entry.line);
+}
+
+} // namespace Mordor2
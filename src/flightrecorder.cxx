@@ -0,0 +1,663 @@
+#include "flightrecorder.h"
+#include "binarylog.h"
+#include "config.h"
+#include "timestamp.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+namespace Mordor2 {
+
+static void updateDumpFile();
+static void updateDumpCount();
+
+static ConfigVar<size_t>::ptr g_slots = Config::lookup(
+    "log.flightrecorder.slots", size_t(4096),
+    "Messages the flight recorder keeps for each thread.");
+static ConfigVar<size_t>::ptr g_dumpCount =
+    Config::lookup("log.flightrecorder.dumpcount", size_t(1000),
+                   "Messages the flight recorder dumps when the process "
+                   "crashes.");
+static ConfigVar<std::string>::ptr g_dumpFile =
+    Config::lookup("log.flightrecorder.dumpfile", std::string(),
+                   "File the flight recorder dumps to when the process "
+                   "crashes; empty for stderr.");
+
+namespace {
+
+static const size_t kSlotSize = 256;
+static const size_t kPayloadSize = 216;
+// Longest logger name and file name kept in a text message's slot
+static const size_t kMaxName = 63;
+
+struct Record {
+    int64_t now;
+    // NULL for a text message
+    const BinaryLogSite *site;
+    int32_t line;
+    int32_t thread;
+    uint8_t level;
+    uint8_t loggerLen;
+    uint8_t fileLen;
+    uint8_t truncated;
+    uint16_t dataLen;
+    // The logger name, the file name of a text message, then the message or
+    // the encoded arguments
+    char payload[kPayloadSize];
+};
+
+// Written only by the thread that owns the ring.  seq is odd while the
+// record is being written, and 2 * (n + 1) once record n is complete, so a
+// reader can tell if the record changed while it was copying it
+struct Slot {
+    std::atomic<uint64_t> seq;
+    Record record;
+};
+
+static_assert(sizeof(Slot) == kSlotSize, "Slot is kSlotSize bytes");
+
+struct Ring {
+    // Rings are never freed, so the list is only ever pushed to
+    Ring *nextRing;
+    std::atomic<bool> owned;
+    std::atomic<uint64_t> next;
+    uint64_t mask;
+    Slot *slots;
+};
+
+// Gives the calling thread's ring back for a new thread to reuse, when the
+// thread exits; its messages are kept until they are overwritten
+struct RingOwner {
+    Ring *ring;
+
+    ~RingOwner() {
+        if (ring)
+            ring->owned.store(false, std::memory_order_release);
+    }
+};
+
+} // namespace
+
+static std::atomic<Ring *> g_rings(NULL);
+static thread_local RingOwner t_owner;
+
+static Ring *acquireRing() {
+    size_t slots = 16;
+    while (slots < g_slots->val())
+        slots <<= 1;
+    for (Ring *ring = g_rings.load(std::memory_order_acquire); ring;
+         ring = ring->nextRing) {
+        bool owned = false;
+        if (ring->mask + 1 == slots &&
+            !ring->owned.load(std::memory_order_relaxed) &&
+            ring->owned.compare_exchange_strong(owned, true,
+                                                std::memory_order_acquire))
+            return ring;
+    }
+    Ring *ring = new Ring();
+    ring->owned.store(true, std::memory_order_relaxed);
+    ring->next.store(0, std::memory_order_relaxed);
+    ring->mask = slots - 1;
+    ring->slots = new Slot[slots];
+    for (size_t i = 0; i < slots; ++i)
+        ring->slots[i].seq.store(0, std::memory_order_relaxed);
+    ring->nextRing = g_rings.load(std::memory_order_relaxed);
+    while (!g_rings.compare_exchange_weak(ring->nextRing, ring,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed)) {
+    }
+    return ring;
+}
+
+static Record &beginRecord(Ring *&ring, uint64_t &n) {
+    ring = t_owner.ring;
+    if (!ring)
+        ring = t_owner.ring = acquireRing();
+    n = ring->next.load(std::memory_order_relaxed);
+    Slot &slot = ring->slots[n & ring->mask];
+    slot.seq.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    return slot.record;
+}
+
+static void endRecord(Ring *ring, uint64_t n) {
+    ring->slots[n & ring->mask].seq.store(2 * n + 2,
+                                          std::memory_order_release);
+    ring->next.store(n + 1, std::memory_order_release);
+}
+
+// Copies up to max bytes of str to the end of the record's payload
+static size_t append(Record &record, size_t &used, const char *str,
+                     size_t len, size_t max) {
+    len = std::min(std::min(len, max), kPayloadSize - used);
+    memcpy(record.payload + used, str, len);
+    used += len;
+    return len;
+}
+
+void FlightRecorder::record(const std::string &logger, int64_t now,
+                            tid_t thread, Log::Level level,
+                            const std::string &str, const char *file,
+                            int line) {
+    Ring *ring;
+    uint64_t n;
+    Record &record = beginRecord(ring, n);
+    if (!file)
+        file = "";
+    size_t used = 0;
+    record.now = now;
+    record.site = NULL;
+    record.line = line;
+    record.thread = thread;
+    record.level = static_cast<uint8_t>(level);
+    record.loggerLen = append(record, used, logger.data(), logger.size(),
+                              kMaxName);
+    record.fileLen = append(record, used, file, strlen(file), kMaxName);
+    record.dataLen = append(record, used, str.data(), str.size(),
+                            kPayloadSize);
+    record.truncated = record.dataLen < str.size();
+    endRecord(ring, n);
+}
+
+void FlightRecorder::recordBinary(const std::string &logger, int64_t now,
+                                  tid_t thread, Log::Level level,
+                                  const BinaryLogSite &site, const char *args,
+                                  size_t len) {
+    Ring *ring;
+    uint64_t n;
+    Record &record = beginRecord(ring, n);
+    size_t used = 0;
+    record.now = now;
+    record.site = &site;
+    record.line = site.line;
+    record.thread = thread;
+    record.level = static_cast<uint8_t>(level);
+    record.loggerLen = append(record, used, logger.data(), logger.size(),
+                              kMaxName);
+    record.fileLen = 0;
+    record.dataLen = append(record, used, args, len, kPayloadSize);
+    // Formatting stops at the first argument that was cut off
+    record.truncated = record.dataLen < len;
+    endRecord(ring, n);
+}
+
+static void recordBelowLevel(const std::string &logger, Log::Level level,
+                             const BinaryLogSite &site, const char *args,
+                             size_t len) {
+    FlightRecorder::recordBinary(
+        logger,
+        Timestamp::MicrosecondsNow(),
+        gettid(), level, site, args, len);
+}
+
+// Everything below runs in signal handlers, so may only use
+// async-signal-safe calls: no allocation, locks or stdio
+namespace {
+
+class SafeWriter {
+public:
+    SafeWriter(int fd, char *buf, size_t size)
+        : m_fd(fd), m_buf(buf), m_size(size), m_len(0) {}
+    ~SafeWriter() { flush(); }
+
+    void append(const char *str, size_t len) {
+        while (len) {
+            if (m_len == m_size)
+                flush();
+            size_t n = std::min(len, m_size - m_len);
+            memcpy(m_buf + m_len, str, n);
+            m_len += n;
+            str += n;
+            len -= n;
+        }
+    }
+    void append(const char *str) { append(str, strlen(str)); }
+    void append(char c) { append(&c, 1); }
+
+    void appendUInt(uint64_t v, int width = 0, int base = 10) {
+        char tmp[24];
+        int i = sizeof(tmp);
+        do {
+            tmp[--i] = "0123456789abcdef"[v % base];
+            v /= base;
+        } while (v);
+        while (static_cast<int>(sizeof(tmp)) - i < width)
+            tmp[--i] = '0';
+        append(tmp + i, sizeof(tmp) - i);
+    }
+    void appendInt(int64_t v) {
+        if (v < 0) {
+            append('-');
+            appendUInt(-static_cast<uint64_t>(v));
+        } else {
+            appendUInt(v);
+        }
+    }
+    // Like %g, to six decimal places
+    void appendDouble(double d) {
+        if (d != d) {
+            append("nan");
+            return;
+        }
+        if (d < 0) {
+            append('-');
+            d = -d;
+        }
+        if (d > 1.7976931348623157e308) {
+            append("inf");
+            return;
+        }
+        int exponent = 0;
+        while (d >= 1e15) {
+            d /= 10;
+            ++exponent;
+        }
+        uint64_t integer = static_cast<uint64_t>(d);
+        uint64_t fraction =
+            static_cast<uint64_t>((d - integer) * 1000000 + 0.5);
+        if (fraction >= 1000000) {
+            ++integer;
+            fraction -= 1000000;
+        }
+        appendUInt(integer);
+        if (fraction) {
+            int width = 6;
+            while (fraction % 10 == 0) {
+                fraction /= 10;
+                --width;
+            }
+            append('.');
+            appendUInt(fraction, width);
+        }
+        if (exponent) {
+            append("e+");
+            appendUInt(exponent);
+        }
+    }
+
+    void flush() {
+        const char *p = m_buf;
+        while (m_len) {
+            ssize_t written = write(m_fd, p, m_len);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                break;
+            p += written;
+            m_len -= written;
+        }
+        m_len = 0;
+    }
+
+private:
+    int m_fd;
+    char *m_buf;
+    size_t m_size;
+    size_t m_len;
+};
+
+} // namespace
+
+static void writeTime(SafeWriter &out, int64_t now) {
+    int64_t seconds = now / 1000000;
+    int64_t days = seconds / 86400;
+    int64_t secondOfDay = seconds % 86400;
+    // Civil date from days since 1970-01-01
+    int64_t z = days + 719468;
+    int64_t era = z / 146097;
+    int64_t doe = z - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+    int64_t day = doy - (153 * mp + 2) / 5 + 1;
+    int64_t month = mp < 10 ? mp + 3 : mp - 9;
+    int64_t year = yoe + era * 400 + (month <= 2);
+    out.append('[');
+    out.appendUInt(year, 4);
+    out.append('-');
+    out.appendUInt(month, 2);
+    out.append('-');
+    out.appendUInt(day, 2);
+    out.append(' ');
+    out.appendUInt(secondOfDay / 3600, 2);
+    out.append(':');
+    out.appendUInt(secondOfDay / 60 % 60, 2);
+    out.append(':');
+    out.appendUInt(secondOfDay % 60, 2);
+    out.append('.');
+    out.appendUInt(now % 1000000, 6);
+    out.append("Z] ");
+}
+
+// As BinaryLog::format
+static void writeBinary(SafeWriter &out, const BinaryLogSite &site,
+                        const char *args, size_t len) {
+    const char *end = args + len;
+    size_t arg = 0;
+    bool truncated = false;
+    for (const char *p = site.format; *p; ++p) {
+        if ((p[0] == '{' && p[1] == '{') || (p[0] == '}' && p[1] == '}')) {
+            out.append(*p++);
+            continue;
+        }
+        if (p[0] != '{' || p[1] != '}' || arg >= site.args.size()) {
+            out.append(*p);
+            continue;
+        }
+        ++p;
+        BinaryLogArg type = site.args[arg++];
+        uint64_t v;
+        size_t used = 0;
+        if (truncated) {
+            out.append("...");
+            continue;
+        }
+        switch (type) {
+        case BinaryLogArg::BOOL:
+        case BinaryLogArg::CHAR:
+            if (end - args < 1)
+                break;
+            if (type == BinaryLogArg::BOOL)
+                out.append(*args ? "true" : "false");
+            else
+                out.append(*args);
+            used = 1;
+            break;
+        case BinaryLogArg::INT:
+        case BinaryLogArg::UINT:
+            used = BinaryLog::readVarint(args, end - args, v);
+            if (!used)
+                break;
+            if (type == BinaryLogArg::INT)
+                out.appendInt(static_cast<int64_t>(v >> 1) ^
+                              -static_cast<int64_t>(v & 1));
+            else
+                out.appendUInt(v);
+            break;
+        case BinaryLogArg::DOUBLE:
+        case BinaryLogArg::POINTER:
+            if (end - args < 8)
+                break;
+            memcpy(&v, args, sizeof(v));
+            if (type == BinaryLogArg::DOUBLE) {
+                double d;
+                memcpy(&d, &v, sizeof(d));
+                out.appendDouble(d);
+            } else {
+                out.append("0x");
+                out.appendUInt(v, 0, 16);
+            }
+            used = 8;
+            break;
+        case BinaryLogArg::STRING: {
+            size_t n = BinaryLog::readVarint(args, end - args, v);
+            if (!n)
+                break;
+            // A string cut off by the end of the slot is still worth showing
+            size_t available = end - args - n;
+            out.append(args + n, std::min<uint64_t>(v, available));
+            if (v > available) {
+                out.append("...");
+                truncated = true;
+                continue;
+            }
+            used = n + v;
+            break;
+        }
+        }
+        if (!used) {
+            out.append("...");
+            truncated = true;
+            continue;
+        }
+        args += used;
+    }
+}
+
+static void writeRecord(SafeWriter &out, const Record &record) {
+    const char *logger = record.payload;
+    const char *file = logger + record.loggerLen;
+    const char *data = file + record.fileLen;
+    writeTime(out, record.now);
+    Log::Level level = static_cast<Log::Level>(record.level);
+    // levelString() only indexes a table, so it is safe in a signal handler
+    out.append(level >= Log::Level::FATAL && level <= Log::Level::TRACE
+                   ? levelString(level)
+                   : "?");
+    out.append(' ');
+    out.appendInt(record.thread);
+    out.append("  ");
+    out.append(logger, record.loggerLen);
+    out.append(' ');
+    if (record.site)
+        out.append(record.site->file);
+    else
+        out.append(file, record.fileLen);
+    out.append(':');
+    out.appendInt(record.line);
+    out.append(' ');
+    if (record.site) {
+        writeBinary(out, *record.site, data, record.dataLen);
+    } else {
+        out.append(data, record.dataLen);
+        if (record.truncated)
+            out.append("...");
+    }
+    out.append('\n');
+}
+
+// Reads the time of record n of ring, if it has not been overwritten
+static bool peekTime(const Ring &ring, uint64_t n, int64_t &now) {
+    const Slot &slot = ring.slots[n & ring.mask];
+    uint64_t seq = slot.seq.load(std::memory_order_acquire);
+    now = slot.record.now;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return seq == 2 * n + 2 &&
+           slot.seq.load(std::memory_order_relaxed) == seq;
+}
+
+static bool readRecord(const Ring &ring, uint64_t n, Record &record) {
+    const Slot &slot = ring.slots[n & ring.mask];
+    uint64_t seq = slot.seq.load(std::memory_order_acquire);
+    memcpy(&record, &slot.record, sizeof(record));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return seq == 2 * n + 2 &&
+           slot.seq.load(std::memory_order_relaxed) == seq;
+}
+
+// State for dump(), which is too big for a signal handler's stack
+static const size_t kMaxRings = 4096;
+static std::atomic_flag g_dumping = ATOMIC_FLAG_INIT;
+static const Ring *g_dumpRings[kMaxRings];
+static uint64_t g_dumpBegin[kMaxRings];
+static uint64_t g_dumpEnd[kMaxRings];
+static uint64_t g_dumpStop[kMaxRings];
+static Record g_dumpRecord;
+static char g_dumpBuffer[4096];
+
+void FlightRecorder::dump(int fd, size_t count) {
+    // Only one at a time; i.e. if dumping crashes
+    if (g_dumping.test_and_set(std::memory_order_acquire))
+        return;
+    size_t rings = 0;
+    for (const Ring *ring = g_rings.load(std::memory_order_acquire);
+         ring && rings < kMaxRings; ring = ring->nextRing) {
+        uint64_t end = ring->next.load(std::memory_order_acquire);
+        g_dumpRings[rings] = ring;
+        g_dumpEnd[rings] = g_dumpStop[rings] = end;
+        g_dumpBegin[rings] = end > ring->mask + 1 ? end - ring->mask - 1 : 0;
+        ++rings;
+    }
+
+    // Walk back from the newest message of every ring to find where the
+    // newest count messages start
+    size_t found = 0;
+    for (; found < count; ++found) {
+        size_t newest = rings;
+        int64_t newestTime = 0;
+        for (size_t i = 0; i < rings; ++i) {
+            int64_t now;
+            if (g_dumpEnd[i] == g_dumpBegin[i])
+                continue;
+            if (!peekTime(*g_dumpRings[i], g_dumpEnd[i] - 1, now)) {
+                // Overwritten since we started; so is everything before it
+                g_dumpBegin[i] = g_dumpEnd[i];
+                continue;
+            }
+            if (newest == rings || now > newestTime) {
+                newest = i;
+                newestTime = now;
+            }
+        }
+        if (newest == rings)
+            break;
+        --g_dumpEnd[newest];
+    }
+    // Dump each ring from where the walk stopped
+    for (size_t i = 0; i < rings; ++i) {
+        g_dumpBegin[i] = g_dumpEnd[i];
+        g_dumpEnd[i] = g_dumpStop[i];
+    }
+
+    SafeWriter out(fd, g_dumpBuffer, sizeof(g_dumpBuffer));
+    out.append("---- flight recorder: last ");
+    out.appendUInt(found);
+    out.append(" messages ----\n");
+    for (;;) {
+        size_t oldestRing = rings;
+        int64_t oldestTime = 0;
+        for (size_t i = 0; i < rings; ++i) {
+            int64_t now = 0;
+            while (g_dumpBegin[i] < g_dumpEnd[i] &&
+                   !peekTime(*g_dumpRings[i], g_dumpBegin[i], now))
+                ++g_dumpBegin[i];
+            if (g_dumpBegin[i] == g_dumpEnd[i])
+                continue;
+            if (oldestRing == rings || now < oldestTime) {
+                oldestRing = i;
+                oldestTime = now;
+            }
+        }
+        if (oldestRing == rings || !found)
+            break;
+        if (readRecord(*g_dumpRings[oldestRing], g_dumpBegin[oldestRing],
+                       g_dumpRecord)) {
+            writeRecord(out, g_dumpRecord);
+            --found;
+        }
+        ++g_dumpBegin[oldestRing];
+    }
+    out.append("---- end of flight recorder ----\n");
+    out.flush();
+    g_dumping.clear(std::memory_order_release);
+}
+
+// Copies of the dump ConfigVars, that a signal handler can read
+static char g_dumpPath[4096];
+static std::atomic<size_t> g_dumpMessages(1000);
+
+void FlightRecorder::dump() {
+    int fd = 2;
+    if (g_dumpPath[0])
+        fd = open(g_dumpPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                  0644);
+    if (fd < 0)
+        fd = 2;
+    dump(fd, g_dumpMessages.load(std::memory_order_relaxed));
+    if (fd != 2)
+        close(fd);
+}
+
+static const int kCrashSignals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+static const size_t kCrashSignalCount =
+    sizeof(kCrashSignals) / sizeof(kCrashSignals[0]);
+static struct sigaction g_previousActions[kCrashSignalCount];
+
+static void crashHandler(int sig, siginfo_t *info, void *) {
+    FlightRecorder::dump();
+    // Put back whatever handled the signal before, and let it; a faulting
+    // instruction raises it again once we return, but a signal sent by
+    // kill() or raise() (including abort()'s) has to be sent again
+    for (size_t i = 0; i < kCrashSignalCount; ++i) {
+        if (kCrashSignals[i] == sig)
+            sigaction(sig, &g_previousActions[i], NULL);
+    }
+    if ((sig != SIGSEGV && sig != SIGBUS && sig != SIGFPE && sig != SIGILL) ||
+        !info || info->si_code <= 0)
+        raise(sig);
+}
+
+static void installCrashHandlers() {
+    static std::atomic<bool> installed(false);
+    if (installed.exchange(true))
+        return;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = &crashHandler;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    for (size_t i = 0; i < kCrashSignalCount; ++i)
+        sigaction(kCrashSignals[i], &action, &g_previousActions[i]);
+}
+
+static void updateDumpFile() {
+    std::string path = g_dumpFile->val();
+    size_t len = std::min(path.size(), sizeof(g_dumpPath) - 1);
+    // Empty it while it changes, so a crash meanwhile dumps to stderr
+    g_dumpPath[0] = '\0';
+    if (!len)
+        return;
+    memcpy(g_dumpPath + 1, path.data() + 1, len - 1);
+    g_dumpPath[len] = '\0';
+    g_dumpPath[0] = path[0];
+}
+
+static void updateDumpCount() {
+    g_dumpMessages.store(g_dumpCount->val(), std::memory_order_relaxed);
+}
+
+namespace {
+
+static struct FlightRecorderInitializer {
+    FlightRecorderInitializer() {
+        g_dumpFile->monitor(&updateDumpFile);
+        g_dumpCount->monitor(&updateDumpCount);
+        updateDumpFile();
+        updateDumpCount();
+    }
+} g_init;
+
+} // namespace
+
+void FlightRecorder::enable() {
+    installCrashHandlers();
+    BinaryLog::recorder(&recordBelowLevel);
+}
+
+void FlightRecorder::disable() { BinaryLog::recorder(NULL); }
+
+LogSink::ptr FlightRecorder::sink() {
+    static LogSink::ptr sink(new FlightRecorderLogSink());
+    return sink;
+}
+
+void FlightRecorderLogSink::log(const std::string &logger, int64_t now,
+                                tid_t thread, Log::Level level,
+                                const std::string &str, const char *file,
+                                int line) {
+    FlightRecorder::record(logger, now, thread, level, str, file, line);
+}
+
+void FlightRecorderLogSink::logBinary(const std::string &logger, int64_t now,
+                                      tid_t thread, Log::Level level,
+                                      const BinaryLogSite &site,
+                                      const char *args, size_t len) {
+    FlightRecorder::recordBinary(logger, now, thread, level, site, args, len);
+}
+
+} // namespace Mordor2
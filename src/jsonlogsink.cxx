@@ -0,0 +1,259 @@
+#include "jsonlogsink.h"
+
+#include <cerrno>
+#include <cmath>
+#include <ctime>
+#include <fcntl.h>
+#include <stdio.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace Mordor2 {
+
+static const int64_t kMicroSecondsPerSecond = 1000000;
+
+namespace {
+
+// Appends an object to a caller's buffer, which only allocates while it
+// grows
+class JsonWriter {
+public:
+    JsonWriter(std::string &buf) : m_buf(buf), m_first(true) {
+        m_buf.push_back('{');
+    }
+
+    void end() { m_buf.append("}\n", 2); }
+
+    void key(const char *key) {
+        if (!m_first)
+            m_buf.push_back(',');
+        m_first = false;
+        string(key, strlen(key));
+        m_buf.push_back(':');
+    }
+
+    void string(const char *str, size_t len) {
+        static const char kHex[] = "0123456789abcdef";
+        m_buf.push_back('"');
+        const char *run = str;
+        const char *end = str + len;
+        for (const char *p = str; p < end; ++p) {
+            unsigned char c = *p;
+            if (c >= 0x20 && c != '"' && c != '\\')
+                continue;
+            m_buf.append(run, p - run);
+            run = p + 1;
+            char escape[6] = {'\\', 0, 0, 0, 0, 0};
+            size_t n = 2;
+            switch (c) {
+            case '"':
+            case '\\':
+                escape[1] = c;
+                break;
+            case '\b':
+                escape[1] = 'b';
+                break;
+            case '\f':
+                escape[1] = 'f';
+                break;
+            case '\n':
+                escape[1] = 'n';
+                break;
+            case '\r':
+                escape[1] = 'r';
+                break;
+            case '\t':
+                escape[1] = 't';
+                break;
+            default:
+                escape[1] = 'u';
+                escape[2] = '0';
+                escape[3] = '0';
+                escape[4] = kHex[c >> 4];
+                escape[5] = kHex[c & 0xf];
+                n = 6;
+            }
+            m_buf.append(escape, n);
+        }
+        m_buf.append(run, end - run);
+        m_buf.push_back('"');
+    }
+
+    void integer(int64_t value) {
+        if (value < 0) {
+            m_buf.push_back('-');
+            // Negate in unsigned, so the most negative value works
+            unsignedInteger(0 - static_cast<uint64_t>(value));
+        } else {
+            unsignedInteger(value);
+        }
+    }
+
+    void unsignedInteger(uint64_t value) {
+        char digits[20];
+        char *p = digits + sizeof(digits);
+        do {
+            *--p = '0' + value % 10;
+            value /= 10;
+        } while (value);
+        m_buf.append(p, digits + sizeof(digits) - p);
+    }
+
+    void number(double value) {
+        // JSON has no NaN or infinity
+        if (!std::isfinite(value)) {
+            m_buf.append("null", 4);
+            return;
+        }
+        char str[32];
+        int n = snprintf(str, sizeof(str), "%.17g", value);
+        m_buf.append(str, n);
+    }
+
+    void boolean(bool value) {
+        if (value)
+            m_buf.append("true", 4);
+        else
+            m_buf.append("false", 5);
+    }
+
+    // UTC, since local time is ambiguous once per year
+    void time(int64_t now) {
+        // Only format the date and time once a second, per thread
+        static thread_local int64_t cachedSecond = -1;
+        static thread_local char cached[20];
+        int64_t second = now / kMicroSecondsPerSecond;
+        int64_t micros = now % kMicroSecondsPerSecond;
+        if (micros < 0) {
+            --second;
+            micros += kMicroSecondsPerSecond;
+        }
+        if (second != cachedSecond) {
+            std::time_t t = second;
+            std::tm utc_tm;
+            gmtime_r(&t, &utc_tm);
+            strftime(cached, sizeof(cached), "%Y-%m-%dT%H:%M:%S", &utc_tm);
+            cachedSecond = second;
+        }
+        char fraction[8] = {'.'};
+        for (int i = 6; i > 0; --i) {
+            fraction[i] = '0' + micros % 10;
+            micros /= 10;
+        }
+        fraction[7] = 'Z';
+        m_buf.push_back('"');
+        m_buf.append(cached, 19);
+        m_buf.append(fraction, sizeof(fraction));
+        m_buf.push_back('"');
+    }
+
+private:
+    std::string &m_buf;
+    bool m_first;
+};
+
+} // namespace
+
+JsonLogSink::JsonLogSink(const std::string &file) : m_file(file) {
+    m_fd = open(file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (m_fd < 0)
+        throw std::system_error(errno, std::system_category(), file);
+}
+
+JsonLogSink::~JsonLogSink() { close(m_fd); }
+
+void JsonLogSink::log(const std::string &logger, int64_t now, tid_t thread,
+                      Log::Level level, const std::string &str,
+                      const char *file, int line) {
+    logFields(logger, now, thread, level, str, NULL, 0, file, line);
+}
+
+void JsonLogSink::logFields(const std::string &logger, int64_t now,
+                            tid_t thread, Log::Level level,
+                            const std::string &str, const LogField *fields,
+                            size_t count, const char *file, int line) {
+    static thread_local std::string buf;
+    buf.clear();
+    LogRecord record;
+    record.logger.data = logger.data();
+    record.logger.len = logger.size();
+    record.now = now;
+    record.thread = thread;
+    record.level = level;
+    record.str.data = str.data();
+    record.str.len = str.size();
+    record.file = file;
+    record.line = line;
+    format(buf, record, fields, count);
+    write(buf);
+}
+
+void JsonLogSink::logBatch(const LogRecord *records, size_t count) {
+    static thread_local std::string buf;
+    buf.clear();
+    for (size_t i = 0; i < count; ++i)
+        format(buf, records[i], NULL, 0);
+    write(buf);
+}
+
+void JsonLogSink::format(std::string &buf, const LogRecord &record,
+                         const LogField *fields, size_t count) {
+    JsonWriter writer(buf);
+    writer.key("time");
+    writer.time(record.now);
+    writer.key("level");
+    const char *levelStr = levelString(record.level);
+    writer.string(levelStr, strlen(levelStr));
+    writer.key("logger");
+    writer.string(record.logger.data, record.logger.len);
+    writer.key("thread");
+    writer.integer(record.thread);
+    if (record.file) {
+        writer.key("file");
+        writer.string(record.file, strlen(record.file));
+        writer.key("line");
+        writer.integer(record.line);
+    }
+    writer.key("msg");
+    writer.string(record.str.data, record.str.len);
+    for (size_t i = 0; i < count; ++i) {
+        const LogField &field = fields[i];
+        writer.key(field.key);
+        switch (field.type) {
+        case LogField::Type::BOOL:
+            writer.boolean(field.b);
+            break;
+        case LogField::Type::INT:
+            writer.integer(field.i);
+            break;
+        case LogField::Type::UINT:
+            writer.unsignedInteger(field.u);
+            break;
+        case LogField::Type::DOUBLE:
+            writer.number(field.d);
+            break;
+        case LogField::Type::STRING:
+            writer.string(field.str.data, field.str.len);
+            break;
+        }
+    }
+    writer.end();
+}
+
+void JsonLogSink::write(const std::string &buf) {
+    const char *data = buf.data();
+    size_t len = buf.size();
+    while (len) {
+        ssize_t written = ::write(m_fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            // Nowhere to report it; drop the message rather than spin
+            return;
+        }
+        data += written;
+        len -= written;
+    }
+}
+
+} // namespace Mordor2
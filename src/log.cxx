@@ -1,26 +1,49 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
 #include "log.h"
+#include "appendfilelogsink.h"
+#include "asynclogsink.h"
+#include "binarylog.h"
 #include "config.h"
+#include "deduplogsink.h"
+#include "flightrecorder.h"
+#include "jsonlogsink.h"
+#include "loglayout.h"
+#include "mappedfilelogsink.h"
+#include "rcu.h"
+#include "rotatingfilelogsink.h"
+#include "timestamp.h"
 
-#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <deque>
 #include <fstream>
-#include <iomanip>
 #include <iostream>
+#include <mutex>
 #include <regex>
+#include <stdexcept>
+#include <stdio.h>
 #include <sys/types.h>
 #include <syscall.h>
+#include <time.h>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 
 //#include "assert.h"
 
 namespace Mordor2 {
 
-static constexpr auto kMicroSecondsPerSecond = 1000000;
-
 static void enableLoggers();
 static void enableStdoutLogging();
 static void enableFileLogging();
+static void enableFileLoggingMode();
+static void rewrapSinks();
+static void enableBinaryFileLogging();
+static void enableJsonLogging();
+static void enableFlightRecorder();
+static void updateRateLimitSummary();
+static void updateLogPattern();
 
 static ConfigVar<std::string>::ptr g_logError =
     Config::lookup("log.errormask", std::string(".*"),
@@ -43,6 +66,44 @@ static ConfigVar<bool>::ptr g_logStdout =
     Config::lookup("log.stdout", false, "Log to stdout");
 static ConfigVar<std::string>::ptr g_logFile =
     Config::lookup("log.file", std::string(), "Log to file");
+static ConfigVar<std::string>::ptr g_logFileMode = Config::lookup(
+    "log.file.mode", std::string("stream"),
+    "How log.file is written: stream (std::ofstream, flushed per message), "
+    "append (batched O_APPEND writes), rotate (see log.file.maxsize) or mmap "
+    "(memory-mapped)");
+static ConfigVar<std::string>::ptr g_logBinaryFile =
+    Config::lookup("log.binaryfile", std::string(),
+                   "Log to file in binary; read it with mordor2-logdecode");
+static ConfigVar<std::string>::ptr g_logJson = Config::lookup(
+    "log.json", std::string(),
+    "Log to file as JSON, one object per line, including structured fields");
+static ConfigVar<bool>::ptr g_logAsync =
+    Config::lookup("log.async", false,
+                   "Write log.stdout and log.file from a background thread");
+static ConfigVar<bool>::ptr g_logDedup =
+    Config::lookup("log.dedup", false,
+                   "Collapse repeated messages to log.stdout and log.file");
+
+static ConfigVar<std::string>::ptr g_logPattern = Config::lookup(
+    "log.pattern", std::string(),
+    "Layout of log.stdout and log.file messages, such as "
+    "\"%d{%F %T.%us} [%l] %t %n %f:%L - %m\" (see LogLayout); empty for "
+    "each one's default");
+
+static ConfigVar<uint64_t>::ptr g_logRateLimitSummary =
+    Config::lookup("log.ratelimit.summaryinterval", uint64_t(10),
+                   "Seconds between reports of messages suppressed by rate "
+                   "limited log statements");
+
+static ConfigVar<bool>::ptr g_logFlightRecorder = Config::lookup(
+    "log.flightrecorder", false,
+    "Keep recent messages of all levels in memory, and dump them on a crash");
+
+static LogSink::ptr g_stdoutSink;
+static LogSink::ptr g_fileSink;
+static std::string g_fileSinkPath;
+static LogSink::ptr g_binaryFileSink;
+static LogSink::ptr g_jsonSink;
 
 namespace {
 
@@ -56,107 +117,509 @@ static struct LogInitializer {
         g_logTrace->monitor(&enableLoggers);
 
         g_logFile->monitor(&enableFileLogging);
+        g_logFileMode->monitor(&enableFileLoggingMode);
         g_logStdout->monitor(&enableStdoutLogging);
+        g_logBinaryFile->monitor(&enableBinaryFileLogging);
+        g_logJson->monitor(&enableJsonLogging);
+        g_logAsync->monitor(&rewrapSinks);
+        g_logDedup->monitor(&rewrapSinks);
+        g_logFlightRecorder->monitor(&enableFlightRecorder);
+        g_logPattern->monitor(&updateLogPattern);
+        g_logRateLimitSummary->monitor(&updateRateLimitSummary);
+        updateRateLimitSummary();
     }
 } g_init;
 
 } // namespace
 
-static void enableLogger(Logger::ptr logger, const std::regex &errorRegex,
-                         const std::regex &warnRegex,
-                         const std::regex &infoRegex,
-                         const std::regex &verboseRegex,
-                         const std::regex &debugRegex,
-                         const std::regex &traceRegex) {
-    Log::Level level = Log::Level::FATAL;
-    if (std::regex_match(logger->name(), errorRegex))
-        level = Log::Level::ERROR;
-    if (std::regex_match(logger->name(), warnRegex))
-        level = Log::Level::WARNING;
-    if (std::regex_match(logger->name(), infoRegex))
-        level = Log::Level::INFO;
-    if (std::regex_match(logger->name(), verboseRegex))
-        level = Log::Level::VERBOSE;
-    if (std::regex_match(logger->name(), debugRegex))
-        level = Log::Level::DEBUG;
-    if (std::regex_match(logger->name(), traceRegex))
-        level = Log::Level::TRACE;
-
-    if (logger->level() != level)
-        logger->level(level, false);
-}
-
-static std::regex buildLogRegex(const std::string &exp,
-                                const std::string &default_exp) {
-    try {
-        return std::regex(exp);
-    } catch (std::regex_error &) {
-        return std::regex(default_exp);
+namespace {
+
+// A compiled log.*mask pattern.
+//
+// The masks are regexes, but in practice they are lists of names, prefixes
+// ("mordor:http:.*") and simple wildcards ("mordor:.*:client").  Alternatives
+// made up only of literal characters, "." and ".*" are matched natively, as
+// globs; anything else falls back to std::regex.
+class LogMask {
+public:
+    LogMask(const std::string &pattern, const std::string &defaultPattern) {
+        if (!compile(pattern) && !compile(defaultPattern))
+            m_globs.clear();
     }
-}
+
+    bool match(const std::string &name) const {
+        if (m_regex)
+            return std::regex_match(name, *m_regex);
+        for (size_t i = 0; i < m_globs.size(); ++i) {
+            if (m_globs[i].match(name))
+                return true;
+        }
+        return false;
+    }
+
+private:
+    // '*' matches any run of characters, '?' any single character, and
+    // everything else itself
+    struct Glob {
+        enum Kind { EXACT, PREFIX, GENERAL };
+
+        Kind kind;
+        std::string pattern;
+
+        bool match(const std::string &name) const {
+            switch (kind) {
+            case EXACT:
+                return name == pattern;
+            case PREFIX:
+                return name.compare(0, pattern.size(), pattern) == 0;
+            default:
+                return matchGeneral(name);
+            }
+        }
+
+        bool matchGeneral(const std::string &name) const {
+            size_t p = 0, n = 0, star = std::string::npos, resume = 0;
+            while (n < name.size()) {
+                if (p < pattern.size() &&
+                    (pattern[p] == '?' ||
+                     (pattern[p] != '*' && pattern[p] == name[n]))) {
+                    ++p;
+                    ++n;
+                } else if (p < pattern.size() && pattern[p] == '*') {
+                    star = p++;
+                    resume = n;
+                } else if (star != std::string::npos) {
+                    p = star + 1;
+                    n = ++resume;
+                } else {
+                    return false;
+                }
+            }
+            while (p < pattern.size() && pattern[p] == '*')
+                ++p;
+            return p == pattern.size();
+        }
+    };
+
+    bool compile(const std::string &pattern) {
+        m_globs.clear();
+        m_regex.reset();
+        if (compileGlobs(pattern))
+            return true;
+        try {
+            m_regex.reset(new std::regex(pattern));
+            return true;
+        } catch (std::regex_error &) {
+            return false;
+        }
+    }
+
+    bool compileGlobs(const std::string &pattern) {
+        Glob glob;
+        bool wild = false;
+        for (size_t i = 0; i <= pattern.size(); ++i) {
+            char c = i < pattern.size() ? pattern[i] : '|';
+            switch (c) {
+            case '|':
+                if (!wild)
+                    glob.kind = Glob::EXACT;
+                else if (glob.pattern.find_first_of("*?") ==
+                         glob.pattern.size() - 1 &&
+                         glob.pattern.back() == '*')
+                    glob.kind = Glob::PREFIX;
+                else
+                    glob.kind = Glob::GENERAL;
+                if (glob.kind == Glob::PREFIX)
+                    glob.pattern.resize(glob.pattern.size() - 1);
+                m_globs.push_back(glob);
+                glob.pattern.clear();
+                wild = false;
+                break;
+            case '.':
+                wild = true;
+                if (i + 1 < pattern.size() && pattern[i + 1] == '*') {
+                    glob.pattern += '*';
+                    ++i;
+                } else {
+                    glob.pattern += '?';
+                }
+                break;
+            case '\\':
+                // Only escaped punctuation is a literal
+                if (i + 1 == pattern.size() || isalnum(pattern[i + 1]))
+                    return false;
+                c = pattern[++i];
+                if (c == '*' || c == '?')
+                    return false;
+                glob.pattern += c;
+                break;
+            case '^':
+            case '$':
+            case '*':
+            case '+':
+            case '?':
+            case '(':
+            case ')':
+            case '[':
+            case ']':
+            case '{':
+            case '}':
+                return false;
+            default:
+                glob.pattern += c;
+                break;
+            }
+        }
+        return true;
+    }
+
+private:
+    std::vector<Glob> m_globs;
+    std::shared_ptr<std::regex> m_regex;
+};
+
+// The compiled log.*mask ConfigVars
+class LogLevelMasks {
+public:
+    LogLevelMasks()
+        : m_error(g_logError->val(), ".*"),
+          m_warn(g_logWarn->val(), ".*"),
+          m_info(g_logInfo->val(), ".*"),
+          m_verbose(g_logVerbose->val(), ""),
+          m_debug(g_logDebug->val(), ""),
+          m_trace(g_logTrace->val(), "") {}
+
+    /// @return The highest level whose mask matches name
+    Log::Level level(const std::string &name) const {
+        if (m_trace.match(name))
+            return Log::Level::TRACE;
+        if (m_debug.match(name))
+            return Log::Level::DEBUG;
+        if (m_verbose.match(name))
+            return Log::Level::VERBOSE;
+        if (m_info.match(name))
+            return Log::Level::INFO;
+        if (m_warn.match(name))
+            return Log::Level::WARNING;
+        if (m_error.match(name))
+            return Log::Level::ERROR;
+        return Log::Level::FATAL;
+    }
+
+private:
+    LogMask m_error, m_warn, m_info, m_verbose, m_debug, m_trace;
+};
+
+} // namespace
+
+static std::mutex &registryMutex();
+static void allLoggers(std::vector<Logger::ptr> &loggers);
+
+// Applied to new Loggers by Log::lookup; guarded by registryMutex().  NULL
+// until a mask is first changed, since they all start at the default level
+static std::shared_ptr<const LogLevelMasks> g_levelMasks;
 
 static void enableLoggers() {
-    std::regex errorRegex = buildLogRegex(g_logError->val(), ".*");
-    std::regex warnRegex = buildLogRegex(g_logWarn->val(), ".*");
-    std::regex infoRegex = buildLogRegex(g_logInfo->val(), ".*");
-    std::regex verboseRegex = buildLogRegex(g_logVerbose->val(), "");
-    std::regex debugRegex = buildLogRegex(g_logDebug->val(), "");
-    std::regex traceRegex = buildLogRegex(g_logTrace->val(), "");
-    Log::visit(std::bind(&enableLogger, std::placeholders::_1,
-                         std::cref(errorRegex), std::cref(warnRegex),
-                         std::cref(infoRegex), std::cref(verboseRegex),
-                         std::cref(debugRegex), std::cref(traceRegex)));
+    std::shared_ptr<const LogLevelMasks> masks(new LogLevelMasks());
+    std::vector<Logger::ptr> loggers;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        g_levelMasks = masks;
+        allLoggers(loggers);
+    }
+    for (size_t i = 0; i < loggers.size(); ++i) {
+        Log::Level level = masks->level(loggers[i]->name());
+        if (loggers[i]->level() != level)
+            loggers[i]->level(level, false);
+    }
+}
+
+static LogSink::ptr wrapSink(LogSink::ptr sink) {
+    if (g_logAsync->val())
+        sink.reset(new AsyncLogSink(sink));
+    // Collapse repeats before they are queued
+    if (g_logDedup->val())
+        sink.reset(new DedupLogSink(sink));
+    return sink;
 }
 
 static void enableStdoutLogging() {
     std::cout << "enableStdoutLogging" << std::endl;
-    static LogSink::ptr stdoutSink;
     bool log = g_logStdout->val();
-    if (stdoutSink.get() && !log) {
-        Log::root()->removeSink(stdoutSink);
-        stdoutSink.reset();
-    } else if (!stdoutSink.get() && log) {
-        stdoutSink.reset(new StdoutLogSink());
-        Log::root()->addSink(stdoutSink);
+    if (g_stdoutSink.get() && !log) {
+        Log::root()->removeSink(g_stdoutSink);
+        g_stdoutSink.reset();
+    } else if (!g_stdoutSink.get() && log) {
+        g_stdoutSink = wrapSink(LogSink::ptr(new StdoutLogSink()));
+        Log::root()->addSink(g_stdoutSink);
     }
 }
 
 static void enableFileLogging() {
-    static LogSink::ptr fileSink;
     std::string file = g_logFile->val();
-    if (fileSink.get() && file.empty()) {
-        Log::root()->removeSink(fileSink);
-        fileSink.reset();
+    if (g_fileSink.get() && file.empty()) {
+        Log::root()->removeSink(g_fileSink);
+        g_fileSink.reset();
+        g_fileSinkPath.clear();
     } else if (!file.empty()) {
-        if (fileSink.get()) {
-            if (static_cast<FileLogSink *>(fileSink.get())->file() == file)
+        if (g_fileSink.get()) {
+            if (g_fileSinkPath == file)
                 return;
-            Log::root()->removeSink(fileSink);
-            fileSink.reset();
+            Log::root()->removeSink(g_fileSink);
+            g_fileSink.reset();
         }
-        fileSink.reset(new FileLogSink(file));
-        Log::root()->addSink(fileSink);
+        LogSink::ptr sink;
+        if (g_logFileMode->val() == "append")
+            sink.reset(new AppendFileLogSink(file));
+        else if (g_logFileMode->val() == "rotate")
+            sink.reset(new RotatingFileLogSink(file));
+        else if (g_logFileMode->val() == "mmap")
+            sink.reset(new MappedFileLogSink(file));
+        else
+            sink.reset(new FileLogSink(file));
+        g_fileSink = wrapSink(sink);
+        g_fileSinkPath = file;
+        Log::root()->addSink(g_fileSink);
     }
 }
 
-void StdoutLogSink::log(const std::string &logger, int64_t now, tid_t thread,
+static void enableFileLoggingMode() {
+    if (g_fileSink.get()) {
+        Log::root()->removeSink(g_fileSink);
+        g_fileSink.reset();
+        g_fileSinkPath.clear();
+    }
+    enableFileLogging();
+}
+
+static void enableBinaryFileLogging() {
+    std::string file = g_logBinaryFile->val();
+    if (g_binaryFileSink.get()) {
+        if (static_cast<BinaryLogSink *>(g_binaryFileSink.get())->file() ==
+            file)
+            return;
+        Log::root()->removeSink(g_binaryFileSink);
+        g_binaryFileSink.reset();
+    }
+    if (!file.empty()) {
+        g_binaryFileSink.reset(new BinaryLogSink(file));
+        Log::root()->addSink(g_binaryFileSink);
+    }
+}
+
+static void enableJsonLogging() {
+    std::string file = g_logJson->val();
+    if (g_jsonSink.get()) {
+        if (static_cast<JsonLogSink *>(g_jsonSink.get())->file() == file)
+            return;
+        Log::root()->removeSink(g_jsonSink);
+        g_jsonSink.reset();
+    }
+    if (!file.empty()) {
+        g_jsonSink.reset(new JsonLogSink(file));
+        Log::root()->addSink(g_jsonSink);
+    }
+}
+
+static void enableFlightRecorder() {
+    if (g_logFlightRecorder->val()) {
+        FlightRecorder::enable();
+        Log::root()->addSink(FlightRecorder::sink());
+    } else {
+        FlightRecorder::disable();
+        Log::root()->removeSink(FlightRecorder::sink());
+    }
+}
+
+static void rewrapSinks() {
+    // Rebuild the configured sinks so they pick up (or drop) the wrappers
+    if (g_stdoutSink.get()) {
+        Log::root()->removeSink(g_stdoutSink);
+        g_stdoutSink.reset();
+    }
+    if (g_fileSink.get()) {
+        Log::root()->removeSink(g_fileSink);
+        g_fileSink.reset();
+        g_fileSinkPath.clear();
+    }
+    enableStdoutLogging();
+    enableFileLogging();
+}
+
+void LogField::format(std::string &buf, const LogField *fields,
+                      size_t count) {
+    char str[32];
+    for (size_t i = 0; i < count; ++i) {
+        const LogField &field = fields[i];
+        buf.push_back(' ');
+        buf.append(field.key);
+        buf.push_back('=');
+        switch (field.type) {
+        case Type::BOOL:
+            buf.append(field.b ? "true" : "false");
+            break;
+        case Type::INT:
+            snprintf(str, sizeof(str), "%lld",
+                     static_cast<long long>(field.i));
+            buf.append(str);
+            break;
+        case Type::UINT:
+            snprintf(str, sizeof(str), "%llu",
+                     static_cast<unsigned long long>(field.u));
+            buf.append(str);
+            break;
+        case Type::DOUBLE:
+            snprintf(str, sizeof(str), "%g", field.d);
+            buf.append(str);
+            break;
+        case Type::STRING: {
+            const char *data = field.str.data;
+            size_t len = field.str.len;
+            bool quote = len == 0;
+            for (size_t j = 0; j < len && !quote; ++j)
+                quote = data[j] == ' ' || data[j] == '"' || data[j] == '=';
+            if (!quote) {
+                buf.append(data, len);
+                break;
+            }
+            buf.push_back('"');
+            for (size_t j = 0; j < len; ++j) {
+                if (data[j] == '"' || data[j] == '\\')
+                    buf.push_back('\\');
+                buf.push_back(data[j]);
+            }
+            buf.push_back('"');
+            break;
+        }
+        }
+    }
+}
+
+void LogSink::logBatch(const LogRecord *records, size_t count) {
+    static thread_local std::string logger;
+    static thread_local std::string str;
+    for (size_t i = 0; i < count; ++i) {
+        const LogRecord &record = records[i];
+        logger.assign(record.logger.data, record.logger.len);
+        str.assign(record.str.data, record.str.len);
+        log(logger, record.now, record.thread, record.level, str, record.file,
+            record.line);
+    }
+}
+
+void LogSink::logFields(const std::string &logger, int64_t now, tid_t thread,
                         Log::Level level, const std::string &str,
+                        const LogField *fields, size_t count,
                         const char *file, int line) {
-    std::ostringstream os;
+    static thread_local std::string buf;
+    buf.assign(str);
+    LogField::format(buf, fields, count);
+    log(logger, now, thread, level, buf, file, line);
+}
 
-    std::time_t seconds = now / kMicroSecondsPerSecond;
-    std::tm local_tm;
-    if (localtime_r(&seconds, &local_tm)) {
-        os << std::put_time(&local_tm, "%F %T%") << "." << std::setfill('0')
-           << std::setw(6) << now % kMicroSecondsPerSecond << " ";
+void LogSink::logBinary(const std::string &logger, int64_t now, tid_t thread,
+                        Log::Level level, const BinaryLogSite &site,
+                        const char *args, size_t len) {
+    static thread_local std::string str;
+    str.clear();
+    BinaryLog::format(site, args, len, str);
+    log(logger, now, thread, level, str, site.file, site.line);
+}
+
+namespace {
+
+const char *const kStdoutPattern = "%d{%F %T.%us} [%l] %t %n %f:%L - %m";
+const char *const kFilePattern = "[%d{%F %T.%us}] %l %t  %n %f:%L %m";
+
+// The layouts of StdoutLogSink and FileLogSink.
+//
+// Each thread formats with its own copy of the current layouts, and only
+// takes the lock to refresh it after log.pattern changes, so formatting a
+// message does not contend on the lock, or on a shared reference count.
+struct Layouts {
+    uint64_t generation;
+    LogLayout::ptr stdoutLayout;
+    LogLayout::ptr fileLayout;
+};
+
+std::mutex g_layoutMutex;
+// Guarded by g_layoutMutex; empty until first used
+Layouts g_layouts;
+std::atomic<uint64_t> g_layoutGeneration(1);
+
+const Layouts &currentLayouts() {
+    static thread_local Layouts layouts = {0, LogLayout::ptr(),
+                                           LogLayout::ptr()};
+    uint64_t generation = g_layoutGeneration.load(std::memory_order_acquire);
+    if (layouts.generation != generation) {
+        std::lock_guard<std::mutex> lock(g_layoutMutex);
+        if (!g_layouts.stdoutLayout) {
+            g_layouts.stdoutLayout.reset(new LogLayout(kStdoutPattern));
+            g_layouts.fileLayout.reset(new LogLayout(kFilePattern));
+        }
+        layouts = g_layouts;
+        layouts.generation = generation;
+    }
+    return layouts;
+}
+
+} // namespace
+
+static void updateLogPattern() {
+    std::string pattern = g_logPattern->val();
+    LogLayout::ptr layout;
+    if (!pattern.empty()) {
+        try {
+            layout.reset(new LogLayout(pattern));
+        } catch (std::invalid_argument &) {
+            // Fall back to the defaults, as the masks do
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_layoutMutex);
+        if (layout) {
+            g_layouts.stdoutLayout = layout;
+            g_layouts.fileLayout = layout;
+        } else {
+            g_layouts.stdoutLayout.reset(new LogLayout(kStdoutPattern));
+            g_layouts.fileLayout.reset(new LogLayout(kFilePattern));
+        }
     }
+    g_layoutGeneration.fetch_add(1, std::memory_order_release);
+}
+
+static LogRecord makeRecord(const std::string &logger, int64_t now,
+                            tid_t thread, Log::Level level,
+                            const std::string &str, const char *file,
+                            int line) {
+    LogRecord record;
+    record.loggerId = LogRecord::kNoLoggerId;
+    record.logger.data = logger.data();
+    record.logger.len = logger.size();
+    record.now = now;
+    record.thread = thread;
+    record.level = level;
+    record.str.data = str.data();
+    record.str.len = str.size();
+    record.file = file;
+    record.line = line;
+    return record;
+}
 
-    os << "[" << level << "] " << thread << " " << logger << " " << file << ":"
-       << line << " - " << str << std::endl;
-    std::cout << os.str();
+void StdoutLogSink::log(const std::string &logger, int64_t now, tid_t thread,
+                        Log::Level level, const std::string &str,
+                        const char *file, int line) {
+    static thread_local std::string buf;
+    buf.clear();
+    currentLayouts().stdoutLayout->format(
+        buf, makeRecord(logger, now, thread, level, str, file, line));
+    buf.push_back('\n');
+    std::cout.write(buf.data(), buf.size());
     std::cout.flush();
 }
 
+void StdoutLogSink::flush() { std::cout.flush(); }
+
 FileLogSink::FileLogSink(const std::string &file) {
     m_stream.reset(new std::ofstream(file, std::ofstream::app));
     m_file = file;
@@ -165,20 +628,154 @@ FileLogSink::FileLogSink(const std::string &file) {
 void FileLogSink::log(const std::string &logger, int64_t now, tid_t thread,
                       Log::Level level, const std::string &str,
                       const char *file, int line) {
-    std::time_t seconds = now / kMicroSecondsPerSecond;
-    std::tm local_tm;
-    if (localtime_r(&seconds, &local_tm)) {
-        *m_stream << "[" << std::put_time(&local_tm, "%F %T%") << "."
-                  << std::setfill('0') << std::setw(6)
-                  << now % kMicroSecondsPerSecond << "]"
-                  << " ";
+    static thread_local std::string buf;
+    buf.clear();
+    format(buf, logger, now, thread, level, str, file, line);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stream->write(buf.data(), buf.size());
+    m_stream->flush();
+}
+
+void FileLogSink::logBatch(const LogRecord *records, size_t count) {
+    static thread_local std::string buf;
+    buf.clear();
+    for (size_t i = 0; i < count; ++i)
+        format(buf, records[i]);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stream->write(buf.data(), buf.size());
+    m_stream->flush();
+}
+
+void FileLogSink::format(std::string &buf, const LogRecord &record) {
+    currentLayouts().fileLayout->format(buf, record);
+    buf.push_back('\n');
+}
+
+void FileLogSink::format(std::string &buf, const std::string &logger,
+                         int64_t now, tid_t thread, Log::Level level,
+                         const std::string &str, const char *file, int line) {
+    format(buf, makeRecord(logger, now, thread, level, str, file, line));
+}
+
+void FileLogSink::flush() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stream->flush();
+}
+
+// Guards the Logger hierarchy (m_children); and serializes changes to sinks
+static std::mutex &registryMutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+namespace {
+
+// Maps full Logger names to Loggers.
+//
+// Readers don't lock: entries are only ever added, each one is published with
+// a single atomic store of its bucket's head, and a table that is outgrown is
+// kept (rather than freed) after its replacement is published.  Names are not
+// copied; an entry refers to its Logger's own name, or to an alias interned
+// here for non-canonical spellings such as "a::b".  Writers hold
+// registryMutex().
+class LoggerRegistry {
+public:
+    LoggerRegistry() : m_table(new Table(kInitialSize)) {
+        m_tables.emplace_back(m_table.load(std::memory_order_relaxed));
+    }
+
+    Logger *find(const std::string &name) const {
+        size_t hash = std::hash<std::string>()(name);
+        const Table *table = m_table.load(std::memory_order_acquire);
+        const Node *node =
+            table->buckets[hash & table->mask].load(std::memory_order_acquire);
+        for (; node; node = node->next) {
+            if (node->hash == hash && *node->name == name)
+                return node->logger;
+        }
+        return NULL;
+    }
+
+    /// Append every Logger (but not aliases) to loggers
+    void loggers(std::vector<Logger::ptr> &loggers) const {
+        for (size_t i = 0; i < m_entries.size(); ++i) {
+            if (m_entries[i].name == &m_entries[i].logger->name())
+                loggers.push_back(m_entries[i].logger->shared_from_this());
+        }
+    }
+
+    void insert(const std::string &name, Logger *logger) {
+        Entry entry = {std::hash<std::string>()(name), &name, logger};
+        if (&name != &logger->name()) {
+            m_aliases.push_back(name);
+            entry.name = &m_aliases.back();
+        }
+        m_entries.push_back(entry);
+        Table *table = m_table.load(std::memory_order_relaxed);
+        if (m_entries.size() > table->mask + 1) {
+            table = new Table((table->mask + 1) * 2);
+            for (size_t i = 0; i < m_entries.size(); ++i)
+                table->insert(m_entries[i]);
+            m_tables.emplace_back(table);
+            m_table.store(table, std::memory_order_release);
+        } else {
+            table->insert(entry);
+        }
     }
-    *m_stream << level << " " << thread << " "
-              << " " << logger << " " << file << ":" << line << " " << str
-              << std::endl;
+
+private:
+    static const size_t kInitialSize = 256;
+
+    struct Entry {
+        size_t hash;
+        const std::string *name;
+        Logger *logger;
+    };
+
+    struct Node : Entry {
+        Node(const Entry &entry, const Node *next) : Entry(entry), next(next) {}
+        const Node *next;
+    };
+
+    struct Table {
+        Table(size_t size)
+            : mask(size - 1), buckets(new std::atomic<const Node *>[size]) {
+            for (size_t i = 0; i < size; ++i)
+                buckets[i].store(NULL, std::memory_order_relaxed);
+        }
+
+        void insert(const Entry &entry) {
+            std::atomic<const Node *> &bucket = buckets[entry.hash & mask];
+            nodes.emplace_back(entry, bucket.load(std::memory_order_relaxed));
+            bucket.store(&nodes.back(), std::memory_order_release);
+        }
+
+        size_t mask;
+        std::unique_ptr<std::atomic<const Node *>[]> buckets;
+        std::deque<Node> nodes;
+    };
+
+private:
+    std::atomic<Table *> m_table;
+    std::vector<std::unique_ptr<Table>> m_tables;
+    std::vector<Entry> m_entries;
+    std::deque<std::string> m_aliases;
+};
+
+} // namespace
+
+static LoggerRegistry &registry() {
+    // Never destroyed, so lookups keep working during static destruction
+    static LoggerRegistry *registry = new LoggerRegistry();
+    return *registry;
+}
+
+static void allLoggers(std::vector<Logger::ptr> &loggers) {
+    loggers.push_back(Log::root());
+    registry().loggers(loggers);
 }
 
-static void deleteNothing(Logger *l) {}
+static void deleteNothing(Logger *) {}
 
 Logger::ptr Log::root() {
     static Logger::ptr _root(new Logger());
@@ -186,10 +783,18 @@ Logger::ptr Log::root() {
 }
 
 Logger::ptr Log::lookup(const std::string &name) {
-    Logger::ptr log = root();
     if (name.empty() || name == ":") {
-        return log;
+        return root();
     }
+    Logger *existing = registry().find(name);
+    if (existing)
+        return existing->shared_from_this();
+
+    Logger::ptr log = root();
+    std::lock_guard<std::mutex> lock(registryMutex());
+    existing = registry().find(name);
+    if (existing)
+        return existing->shared_from_this();
     std::set<Logger::ptr, LoggerLess>::iterator it;
     Logger dummy(name, log);
     Logger::ptr dummyPtr(&dummy, &deleteNothing);
@@ -216,15 +821,36 @@ Logger::ptr Log::lookup(const std::string &name) {
         it = log->m_children.lower_bound(dummyPtr);
         if (it == log->m_children.end() || (*it)->m_name != node_name) {
             Logger::ptr child(new Logger(node_name, log));
+            if (g_levelMasks)
+                child->m_level.store(g_levelMasks->level(node_name),
+                                     std::memory_order_relaxed);
+            const Logger::SinkList *inherited =
+                log->m_effectiveSinks.load(std::memory_order_relaxed);
+            if (inherited)
+                child->m_effectiveSinks.store(
+                    new Logger::SinkList(*inherited),
+                    std::memory_order_relaxed);
             log->m_children.insert(child);
+            registry().insert(child->m_name, child.get());
             log = child;
         } else {
             log = *it;
         }
     }
+    if (name != log->m_name)
+        registry().insert(name, log.get());
     return log;
 }
 
+uint32_t Log::intern(const std::string &name) { return lookup(name)->id(); }
+
+uint32_t Log::findId(const std::string &name) {
+    if (name.empty() || name == ":")
+        return root()->id();
+    Logger *existing = registry().find(name);
+    return existing ? existing->id() : LogRecord::kNoLoggerId;
+}
+
 void Log::visit(std::function<void(std::shared_ptr<Logger>)> dg) {
     std::list<Logger::ptr> toVisit;
     toVisit.push_back(root());
@@ -232,6 +858,7 @@ void Log::visit(std::function<void(std::shared_ptr<Logger>)> dg) {
         Logger::ptr cur = toVisit.front();
         toVisit.pop_front();
         dg(cur);
+        std::lock_guard<std::mutex> lock(registryMutex());
         for (std::set<Logger::ptr, LoggerLess>::iterator it =
                  cur->m_children.begin();
              it != cur->m_children.end(); ++it) {
@@ -293,39 +920,169 @@ bool LoggerLess::operator()(const Logger::ptr &lhs,
     return lhs->m_name < rhs->m_name;
 }
 
+// The root Logger is created first, and gets 0
+static std::atomic<uint32_t> g_nextLoggerId(0);
+
 Logger::Logger()
-    : m_name(":"), m_level(Log::Level::INFO), m_inheritSinks(false) {}
+    : m_name(":"),
+      m_id(g_nextLoggerId.fetch_add(1, std::memory_order_relaxed)),
+      m_level(Log::Level::INFO),
+      m_effectiveSinks(NULL),
+      m_inheritSinks(false) {}
 
 Logger::Logger(const std::string &name, Logger::ptr parent)
     : m_name(name),
+      m_id(g_nextLoggerId.fetch_add(1, std::memory_order_relaxed)),
       m_parent(parent),
       m_level(Log::Level::INFO),
+      m_effectiveSinks(NULL),
       m_inheritSinks(true) {}
 
 Logger::~Logger() {
     m_level = Log::Level::NONE;
-    clearSinks();
+    // Nobody else can reach us any more, so there is no one to wait for
+    delete m_effectiveSinks.load(std::memory_order_relaxed);
 }
 
+// Starts at 1, so a zeroed LogSiteCache is never current
+std::atomic<uint32_t> Logger::s_generation(1);
+
 bool Logger::enabled(Log::Level level) {
     return level == Log::Level::FATAL || m_level >= level;
 }
 
+bool Logger::enabledSlow(Log::Level level, LogSiteCache &cache) {
+    // Read the generation before the level; if the level changes after this,
+    // the generation will too, and the decision we cache will be discarded
+    uint32_t generation = s_generation.load(std::memory_order_acquire);
+    bool result = enabled(level);
+
+    const Logger *cached = cache.logger.load(std::memory_order_relaxed);
+    if (!cached && cache.logger.compare_exchange_strong(
+                       cached, this, std::memory_order_relaxed))
+        cached = this;
+    if (cached == this)
+        cache.state.store((generation << 4) |
+                              (static_cast<uint32_t>(level) << 1) | result,
+                          std::memory_order_relaxed);
+    return result;
+}
+
+void Logger::bumpGeneration() {
+    // Every caller must publish a generation of its own, or a decision
+    // cached between two concurrent level changes could outlive them
+    uint32_t generation =
+        s_generation.fetch_add(1, std::memory_order_acq_rel) + 1;
+    // Only 28 bits are kept in a LogSiteCache; skip the zeroed generation
+    if (!(generation & 0x0fffffff))
+        s_generation.fetch_add(1, std::memory_order_acq_rel);
+}
+
 void Logger::level(Log::Level level, bool propagate) {
-    m_level = level;
+    m_level.store(level, std::memory_order_relaxed);
     if (propagate) {
-        for (std::set<Logger::ptr, LoggerLess>::iterator it(m_children.begin());
-             it != m_children.end(); ++it) {
-            (*it)->level(level);
+        std::vector<Logger::ptr> descendants;
+        {
+            std::lock_guard<std::mutex> lock(registryMutex());
+            descendants.assign(m_children.begin(), m_children.end());
+            for (size_t i = 0; i < descendants.size(); ++i)
+                descendants.insert(descendants.end(),
+                                   descendants[i]->m_children.begin(),
+                                   descendants[i]->m_children.end());
         }
+        for (size_t i = 0; i < descendants.size(); ++i)
+            descendants[i]->m_level.store(level, std::memory_order_relaxed);
     }
+    bumpGeneration();
+}
+
+// Frees snapshots that have been replaced, once no thread can be using them;
+// a change made from inside a read section (by a sink, say) leaves them to
+// the next one made outside of one
+static void
+retireSinks(const std::vector<const std::vector<LogSink::ptr> *> &old) {
+    if (old.empty())
+        return;
+    for (size_t i = 0; i < old.size(); ++i)
+        Rcu::retire(old[i]);
+    Rcu::reclaim();
+}
+
+/// Recompute the effective sinks of this Logger and its descendants; called
+/// with registryMutex() held
+void Logger::rebuildSinks(std::vector<const SinkList *> &retired) {
+    SinkList *effective = NULL;
+    Logger::ptr parent = m_parent.lock();
+    const SinkList *inherited =
+        parent && inheritSinks()
+            ? parent->m_effectiveSinks.load(std::memory_order_relaxed)
+            : NULL;
+    if (!m_sinks.empty() || inherited) {
+        effective = new SinkList(m_sinks);
+        if (inherited)
+            effective->insert(effective->end(), inherited->begin(),
+                              inherited->end());
+    }
+    const SinkList *old =
+        m_effectiveSinks.exchange(effective, std::memory_order_seq_cst);
+    if (old)
+        retired.push_back(old);
+    for (std::set<Logger::ptr, LoggerLess>::iterator it(m_children.begin());
+         it != m_children.end(); ++it) {
+        (*it)->rebuildSinks(retired);
+    }
+}
+
+void Logger::inheritSinks(bool inherit) {
+    std::vector<const SinkList *> retired;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        if (m_inheritSinks.exchange(inherit, std::memory_order_relaxed) ==
+            inherit)
+            return;
+        rebuildSinks(retired);
+    }
+    retireSinks(retired);
+}
+
+void Logger::addSink(LogSink::ptr sink) {
+    std::vector<const SinkList *> retired;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        m_sinks.push_back(sink);
+        rebuildSinks(retired);
+    }
+    retireSinks(retired);
 }
 
 void Logger::removeSink(LogSink::ptr sink) {
-    std::list<LogSink::ptr>::iterator it =
-        std::find(m_sinks.begin(), m_sinks.end(), sink);
-    if (it != m_sinks.end())
+    std::vector<const SinkList *> retired;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        SinkList::iterator it = std::find(m_sinks.begin(), m_sinks.end(), sink);
+        if (it == m_sinks.end())
+            return;
         m_sinks.erase(it);
+        rebuildSinks(retired);
+    }
+    retireSinks(retired);
+}
+
+void Logger::clearSinks() {
+    std::vector<const SinkList *> retired;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        if (m_sinks.empty())
+            return;
+        m_sinks.clear();
+        rebuildSinks(retired);
+    }
+    retireSinks(retired);
+}
+
+std::vector<LogSink::ptr> Logger::sinks() const {
+    std::lock_guard<std::mutex> lock(registryMutex());
+    return m_sinks;
 }
 
 void Logger::log(Log::Level level, const std::string &str, const char *file,
@@ -333,23 +1090,236 @@ void Logger::log(Log::Level level, const std::string &str, const char *file,
     if (str.empty() || !enabled(level))
         return;
 
-    auto now = std::chrono::duration_cast<std::chrono::microseconds>(
-                   std::chrono::system_clock::now().time_since_epoch())
-                   .count();
-    Logger::ptr _this = shared_from_this();
+    int64_t now = Timestamp::MicrosecondsNow();
     tid_t thread = gettid();
-    while (_this) {
-        for (std::list<LogSink::ptr>::iterator it(_this->m_sinks.begin());
-             it != _this->m_sinks.end(); ++it) {
-            (*it)->log(m_name, now, thread, level, str, file, line);
-        }
-        if (!_this->m_inheritSinks)
+    // The sinks are used inside the read section, rather than copied out
+    // of it, which would cost each of their reference counts a round trip
+    Rcu::ReadLock lock;
+    const SinkList *sinks = m_effectiveSinks.load(std::memory_order_seq_cst);
+    if (!sinks)
+        return;
+    for (const LogSink::ptr &sink : *sinks)
+        sink->log(m_name, now, thread, level, str, file, line);
+}
+
+void Logger::logFields(Log::Level level, const std::string &str,
+                       const LogField *fields, size_t count,
+                       const char *file, int line) {
+    if (!enabled(level))
+        return;
+
+    int64_t now = Timestamp::MicrosecondsNow();
+    tid_t thread = gettid();
+    Rcu::ReadLock lock;
+    const SinkList *sinks = m_effectiveSinks.load(std::memory_order_seq_cst);
+    if (!sinks)
+        return;
+    for (const LogSink::ptr &sink : *sinks)
+        sink->logFields(m_name, now, thread, level, str, fields, count, file,
+                        line);
+}
+
+// log.ratelimit.summaryinterval, in nanoseconds, for the logging threads
+static std::atomic<int64_t> g_rateLimitSummary(10000000000LL);
+
+static void updateRateLimitSummary() {
+    g_rateLimitSummary.store(g_logRateLimitSummary->val() * 1000000000LL,
+                             std::memory_order_relaxed);
+}
+
+int64_t LogRateLimit::monotonicNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+bool LogRateLimit::rate(Logger &logger, Log::Level level, const char *file,
+                        int line, double perSecond, double burst) {
+    if (perSecond <= 0)
+        return allow(logger, level, file, line);
+    int64_t interval = static_cast<int64_t>(1e9 / perSecond);
+    int64_t tolerance =
+        static_cast<int64_t>(interval * (std::max(burst, 1.0) - 1));
+    int64_t now = monotonicNow();
+    int64_t expected = full.load(std::memory_order_relaxed);
+    for (;;) {
+        int64_t start = std::max(expected, now);
+        if (start - now > tolerance)
+            return suppress(logger, level, file, line);
+        if (full.compare_exchange_weak(expected, start + interval,
+                                       std::memory_order_relaxed))
+            return allow(logger, level, file, line);
+    }
+}
+
+bool LogRateLimit::suppress(Logger &logger, Log::Level level,
+                            const char *file, int line) {
+    suppressed.fetch_add(1, std::memory_order_relaxed);
+    summarizeIfDue(logger, level, file, line, monotonicNow());
+    return false;
+}
+
+void LogRateLimit::summarizeIfDue(Logger &logger, Log::Level level,
+                                  const char *file, int line, int64_t now) {
+    int64_t last = lastSummary.load(std::memory_order_relaxed);
+    if (!last) {
+        // The first suppressed message starts the interval
+        lastSummary.compare_exchange_strong(last, now,
+                                            std::memory_order_relaxed);
+    } else if (now - last >= g_rateLimitSummary.load(
+                                 std::memory_order_relaxed) &&
+               lastSummary.compare_exchange_strong(
+                   last, now, std::memory_order_relaxed)) {
+        summarize(logger, level, file, line);
+    }
+}
+
+void LogRateLimit::summarize(Logger &logger, Log::Level level,
+                             const char *file, int line) {
+    uint64_t count = suppressed.exchange(0, std::memory_order_relaxed);
+    if (!count)
+        return;
+    char str[64];
+    snprintf(str, sizeof(str), "suppressed %llu message%s",
+             static_cast<unsigned long long>(count), count == 1 ? "" : "s");
+    logger.log(level, str, file, line);
+}
+
+void LogScopedLatency::report(Duration elapsed) {
+    if (!m_logger.enabled(m_level))
+        return;
+    m_logger.log(m_level, m_file, m_line).os()
+        << "took " << elapsed << ", over the threshold of " << m_threshold;
+}
+
+void Logger::logBinary(Log::Level level, const BinaryLogSite &site,
+                       const char *args, size_t len) {
+    if (!enabled(level))
+        return;
+
+    int64_t now = Timestamp::MicrosecondsNow();
+    tid_t thread = gettid();
+    Rcu::ReadLock lock;
+    const SinkList *sinks = m_effectiveSinks.load(std::memory_order_seq_cst);
+    if (!sinks)
+        return;
+    for (const LogSink::ptr &sink : *sinks)
+        sink->logBinary(m_name, now, thread, level, site, args, len);
+}
+
+static constexpr size_t kLogStreamInitialSize = 256;
+
+LogStreamBuf::LogStreamBuf() {
+    m_buf.resize(kLogStreamInitialSize);
+    reset();
+}
+
+void LogStreamBuf::reset() {
+    // str() trims the size to the message; the capacity is still there
+    m_buf.resize(m_buf.capacity());
+    setp(&m_buf[0], &m_buf[0] + m_buf.size());
+}
+
+const std::string &LogStreamBuf::str() {
+    m_buf.resize(pptr() - pbase());
+    setp(&m_buf[0], &m_buf[0] + m_buf.size());
+    pbump(static_cast<int>(m_buf.size()));
+    return m_buf;
+}
+
+LogStreamBuf::int_type LogStreamBuf::overflow(int_type ch) {
+    if (traits_type::eq_int_type(ch, traits_type::eof()))
+        return traits_type::not_eof(ch);
+    grow(1);
+    *pptr() = traits_type::to_char_type(ch);
+    pbump(1);
+    return ch;
+}
+
+std::streamsize LogStreamBuf::xsputn(const char *s, std::streamsize n) {
+    if (epptr() - pptr() < n)
+        grow(static_cast<size_t>(n));
+    memcpy(pptr(), s, static_cast<size_t>(n));
+    pbump(static_cast<int>(n));
+    return n;
+}
+
+void LogStreamBuf::grow(size_t needed) {
+    size_t used = pptr() - pbase();
+    m_buf.resize(std::max(m_buf.size() * 2, used + needed));
+    setp(&m_buf[0], &m_buf[0] + m_buf.size());
+    pbump(static_cast<int>(used));
+}
+
+class LogStream {
+public:
+    LogStream() : m_os(&m_buf), m_inUse(false) {}
+
+    void acquire() {
+        m_inUse = true;
+        m_buf.reset();
+        m_os.clear();
+        m_os.flags(std::ios_base::skipws | std::ios_base::dec);
+        m_os.precision(6);
+        m_os.width(0);
+        m_os.fill(' ');
+    }
+    void release() { m_inUse = false; }
+    bool inUse() const { return m_inUse; }
+
+    std::ostream &os() { return m_os; }
+    LogStreamBuf &buf() { return m_buf; }
+    const std::string &str() { return m_buf.str(); }
+
+private:
+    LogStreamBuf m_buf;
+    std::ostream m_os;
+    bool m_inUse;
+};
+
+// Usually only the first stream is needed; more are created when building one
+// message logs another (i.e. from an operator<<)
+static thread_local std::vector<std::unique_ptr<LogStream>> t_logStreams;
+
+static LogStream *acquireLogStream() {
+    LogStream *stream = NULL;
+    for (size_t i = 0; i < t_logStreams.size(); ++i) {
+        if (!t_logStreams[i]->inUse()) {
+            stream = t_logStreams[i].get();
             break;
-        _this = _this->m_parent.lock();
+        }
+    }
+    if (!stream) {
+        t_logStreams.emplace_back(new LogStream());
+        stream = t_logStreams.back().get();
     }
+    stream->acquire();
+    return stream;
+}
+
+LogEvent::LogEvent(Logger::ptr logger, Log::Level level, const char *file,
+                   int line)
+    : m_logger(logger),
+      m_level(level),
+      m_file(file),
+      m_line(line),
+      m_stream(acquireLogStream()) {}
+
+LogEvent::LogEvent(const LogEvent &copy)
+    : m_logger(copy.m_logger),
+      m_level(copy.m_level),
+      m_file(copy.m_file),
+      m_line(copy.m_line),
+      m_stream(acquireLogStream()) {}
+
+LogEvent::~LogEvent() {
+    m_logger->log(m_level, m_stream->str(), m_file, m_line);
+    m_stream->release();
 }
 
-LogEvent::~LogEvent() { m_logger->log(m_level, m_os.str(), m_file, m_line); }
+std::ostream &LogEvent::os() { return m_stream->os(); }
+
+LogStreamBuf &LogEvent::buf() { return m_stream->buf(); }
 
 static const char *levelStrs[] = {
     "NONE", "FATAL", "ERROR", "WARNG", "INFOR", "VERBO", "DEBUG", "TRACE",
@@ -360,6 +1330,11 @@ std::ostream &operator<<(std::ostream &os, Log::Level level) {
     return os << levelStrs[static_cast<int>(level)];
 }
 
+const char *levelString(Log::Level level) {
+    assert(level >= Log::Level::FATAL && level <= Log::Level::TRACE);
+    return levelStrs[static_cast<int>(level)];
+}
+
 tid_t gettid() {
     static thread_local tid_t tid = syscall(__NR_gettid);
     return tid;
@@ -0,0 +1,130 @@
+#include "logformat.h"
+
+#include <cmath>
+#include <stdio.h>
+
+namespace Mordor2 {
+
+const char LogFormat::kDigitPairs[] = "00010203040506070809"
+                                     "10111213141516171819"
+                                     "20212223242526272829"
+                                     "30313233343536373839"
+                                     "40414243444546474849"
+                                     "50515253545556575859"
+                                     "60616263646566676869"
+                                     "70717273747576777879"
+                                     "80818283848586878889"
+                                     "90919293949596979899";
+
+char *LogFormat::formatDigits(char *end, uint64_t v) {
+    char *p = end;
+    while (v >= 100) {
+        p -= 2;
+        formatPair(p, v % 100);
+        v /= 100;
+    }
+    if (v >= 10) {
+        p -= 2;
+        formatPair(p, v);
+    } else {
+        *--p = static_cast<char>('0' + v);
+    }
+    return p;
+}
+
+void LogFormat::appendUInt(LogStreamBuf &buf, uint64_t v) {
+    char digits[20];
+    char *end = digits + sizeof(digits);
+    char *p = formatDigits(end, v);
+    buf.append(p, end - p);
+}
+
+// Significant digits "%g" prints
+static const int kPrecision = 6;
+static const double kPowersOfTen[] = {1e0, 1e1, 1e2, 1e3, 1e4,
+                                      1e5, 1e6, 1e7, 1e8, 1e9};
+// Smallest value with each decimal exponent from -4
+static const double kExponents[] = {1e-4, 1e-3, 1e-2, 1e-1, 1e0,
+                                    1e1,  1e2,  1e3,  1e4,  1e5};
+
+void LogFormat::appendDouble(LogStreamBuf &buf, double v) {
+    double a = std::fabs(v);
+    // "%g" switches to an exponent outside [1e-4, 1e6); leave those, and
+    // infinities and NaNs, to snprintf
+    if (!(a >= 1e-4 && a < 999999.5)) {
+        if (a == 0) {
+            if (std::signbit(v))
+                buf.append('-');
+            buf.append('0');
+            return;
+        }
+        char str[32];
+        int n = snprintf(str, sizeof(str), "%g", v);
+        buf.append(str, n);
+        return;
+    }
+
+    // Scale to an integer of kPrecision digits.  The powers of ten are
+    // exact and the product is rounded once, so this only differs from
+    // snprintf for values within an ulp of halfway between two results
+    int exponent = 5;
+    while (exponent > -4 && a < kExponents[exponent + 4])
+        --exponent;
+    double scaled = a * kPowersOfTen[kPrecision - 1 - exponent];
+    uint64_t digits = static_cast<uint64_t>(std::nearbyint(scaled));
+    if (digits >= 1000000) {
+        // Rounded up to the next power of ten
+        digits /= 10;
+        if (++exponent >= kPrecision) {
+            char str[32];
+            int n = snprintf(str, sizeof(str), "%g", v);
+            buf.append(str, n);
+            return;
+        }
+    }
+
+    char str[16];
+    char *end = str + sizeof(str);
+    char *p = formatDigits(end, digits);
+    // Trailing zeros of the fraction are dropped, as "%g" does
+    int fraction = kPrecision - 1 - exponent;
+    while (fraction > 0 && end[-1] == '0') {
+        --end;
+        --fraction;
+    }
+    if (v < 0)
+        buf.append('-');
+    if (exponent < 0) {
+        buf.append("0.", 2);
+        for (int i = -1; i > exponent; --i)
+            buf.append('0');
+        buf.append(p, end - p);
+    } else {
+        buf.append(p, exponent + 1);
+        if (fraction) {
+            buf.append('.');
+            buf.append(p + exponent + 1, fraction);
+        }
+    }
+}
+
+const char *LogFormat::literal(LogStreamBuf &buf, const char *fmt) {
+    const char *run = fmt;
+    for (;; ++fmt) {
+        if (!*fmt) {
+            buf.append(run, fmt - run);
+            return fmt;
+        }
+        if (*fmt == '{' && fmt[1] == '}') {
+            buf.append(run, fmt - run);
+            return fmt + 2;
+        }
+        if ((*fmt == '{' && fmt[1] == '{') || (*fmt == '}' && fmt[1] == '}')) {
+            // Keep the first brace of the pair
+            buf.append(run, fmt + 1 - run);
+            run = ++fmt + 1;
+        }
+    }
+}
+
+} // namespace Mordor2
@@ -0,0 +1,329 @@
+#include "loglayout.h"
+#include "logformat.h"
+#include "timestamp.h"
+
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+
+namespace Mordor2 {
+
+static const int64_t kMicroSecondsPerSecond = 1000000;
+// Enough for any 64-bit integer, with its sign
+static const size_t kMaxNumberBytes = 20;
+// The room to give strftime first, per byte of its format; the 2 bytes of
+// "%c" make 24 in the C locale
+static const size_t kDateBytesPerFormatByte = 32;
+// How many layouts each thread keeps the dates of; stdout and a file, with a
+// different pattern each, use two
+static const size_t kDateCaches = 4;
+
+static std::atomic<uint64_t> g_nextLayoutId(1);
+
+struct LogLayout::DateCache {
+    uint64_t layout;
+    int64_t second;
+    uint64_t timezone;
+    /// The dates of the layout, one after the other, and where each one ends
+    std::string text;
+    std::vector<size_t> ends;
+};
+
+static char *writeNumber(char *p, int64_t v) {
+    char digits[kMaxNumberBytes];
+    char *end = digits + sizeof(digits);
+    // Negate in unsigned, so the most negative value works
+    char *first = LogFormat::formatDigits(
+        end, v < 0 ? 0 - static_cast<uint64_t>(v) : v);
+    if (v < 0)
+        *p++ = '-';
+    memcpy(p, first, end - first);
+    return p + (end - first);
+}
+
+LogLayout::LogLayout(const std::string &pattern)
+    : m_pattern(pattern),
+      m_id(g_nextLayoutId.fetch_add(1, std::memory_order_relaxed)),
+      m_fixedBytes(0),
+      m_dates(0),
+      m_levels(0),
+      m_loggers(0),
+      m_files(0),
+      m_messages(0) {
+    std::string literal;
+    size_t i = 0;
+    while (i < pattern.size()) {
+        char c = pattern[i++];
+        if (c != '%') {
+            literal.push_back(c);
+            continue;
+        }
+        if (i < pattern.size() && pattern[i] == '%') {
+            literal.push_back('%');
+            ++i;
+            continue;
+        }
+        bool left = false;
+        size_t width = 0;
+        if (i < pattern.size() && pattern[i] == '-') {
+            left = true;
+            ++i;
+        }
+        while (i < pattern.size() && pattern[i] >= '0' && pattern[i] <= '9')
+            width = width * 10 + (pattern[i++] - '0');
+        if (i == pattern.size())
+            throw std::invalid_argument("log pattern ends with a bare %: " +
+                                        pattern);
+        if (!literal.empty()) {
+            add(OpType::LITERAL, literal);
+            literal.clear();
+        }
+        switch (char conversion = pattern[i++]) {
+        case 'd':
+            if (i < pattern.size() && pattern[i] == '{') {
+                size_t end = pattern.find('}', i);
+                if (end == std::string::npos)
+                    throw std::invalid_argument("unterminated %d{ in log "
+                                                "pattern: " +
+                                                pattern);
+                compileDate(pattern.substr(i + 1, end - i - 1));
+                i = end + 1;
+            } else {
+                compileDate("%F %T.%us");
+            }
+            break;
+        case 'l':
+            add(OpType::LEVEL, std::string(), width, left);
+            break;
+        case 't':
+            add(OpType::THREAD, std::string(), width, left);
+            break;
+        case 'n':
+            add(OpType::LOGGER, std::string(), width, left);
+            break;
+        case 'f':
+            add(OpType::FILE, std::string(), width, left);
+            break;
+        case 'L':
+            add(OpType::LINE, std::string(), width, left);
+            break;
+        case 'm':
+            add(OpType::MESSAGE, std::string(), width, left);
+            break;
+        default:
+            throw std::invalid_argument(std::string("unknown conversion %") +
+                                        conversion + " in log pattern: " +
+                                        pattern);
+        }
+    }
+    if (!literal.empty())
+        add(OpType::LITERAL, literal);
+}
+
+void LogLayout::compileDate(const std::string &format) {
+    // Split around %us and %ms, which strftime does not know; everything
+    // else is left to it
+    std::string text;
+    for (size_t i = 0; i < format.size(); ++i) {
+        if (format[i] != '%' || i + 1 == format.size()) {
+            text.push_back(format[i]);
+            continue;
+        }
+        if ((format[i + 1] == 'u' || format[i + 1] == 'm') &&
+            i + 2 < format.size() && format[i + 2] == 's') {
+            if (!text.empty()) {
+                add(OpType::DATE, text);
+                text.clear();
+            }
+            add(format[i + 1] == 'u' ? OpType::MICROSECONDS
+                                     : OpType::MILLISECONDS);
+            i += 2;
+            continue;
+        }
+        // Keep strftime's own conversions, including %%, whole
+        text.push_back(format[i]);
+        text.push_back(format[++i]);
+    }
+    if (!text.empty())
+        add(OpType::DATE, text);
+}
+
+void LogLayout::add(OpType type, const std::string &text, size_t width,
+                    bool left) {
+    m_fixedBytes += width;
+    switch (type) {
+    case OpType::LITERAL:
+        m_fixedBytes += text.size();
+        if (!m_ops.empty() && m_ops.back().type == OpType::LITERAL) {
+            m_ops.back().text.append(text);
+            return;
+        }
+        break;
+    case OpType::MICROSECONDS:
+    case OpType::MILLISECONDS:
+    case OpType::THREAD:
+    case OpType::LINE:
+        m_fixedBytes += kMaxNumberBytes;
+        break;
+    case OpType::LEVEL:
+        ++m_levels;
+        break;
+    case OpType::LOGGER:
+        ++m_loggers;
+        break;
+    case OpType::FILE:
+        ++m_files;
+        break;
+    case OpType::MESSAGE:
+        ++m_messages;
+        break;
+    case OpType::DATE:
+        ++m_dates;
+        break;
+    }
+    Op op = {type, text, width, left};
+    m_ops.push_back(op);
+}
+
+const LogLayout::DateCache &LogLayout::dates(int64_t second) const {
+    static thread_local DateCache caches[kDateCaches];
+    static thread_local size_t next = 0;
+    uint64_t timezone = Timestamp::timezoneGeneration();
+    DateCache *cache = NULL;
+    for (size_t i = 0; i < kDateCaches; ++i) {
+        if (caches[i].layout == m_id) {
+            cache = &caches[i];
+            if (cache->second == second && cache->timezone == timezone)
+                return *cache;
+            break;
+        }
+    }
+    if (!cache) {
+        cache = &caches[next++ % kDateCaches];
+        cache->layout = m_id;
+    }
+
+    std::time_t t = second;
+    std::tm local_tm;
+    if (!localtime_r(&t, &local_tm))
+        memset(&local_tm, 0, sizeof(local_tm));
+    cache->text.clear();
+    cache->ends.clear();
+    for (const Op &op : m_ops) {
+        if (op.type != OpType::DATE)
+            continue;
+        // strftime returns 0 both when the date does not fit and when it is
+        // empty, so size the room from the format, and only take 0 for empty
+        // once several times that has not been enough
+        size_t from = cache->text.size();
+        size_t room = op.text.size() * kDateBytesPerFormatByte;
+        size_t len = 0;
+        for (int tries = 0; !len && tries < 3; ++tries, room *= 8) {
+            cache->text.resize(from + room);
+            len = strftime(&cache->text[from], room, op.text.c_str(),
+                           &local_tm);
+        }
+        cache->text.resize(from + len);
+        cache->ends.push_back(cache->text.size());
+    }
+    cache->second = second;
+    cache->timezone = timezone;
+    return *cache;
+}
+
+void LogLayout::format(std::string &buf, const LogRecord &record) const {
+    int64_t seconds = record.now / kMicroSecondsPerSecond;
+    int64_t micros = record.now % kMicroSecondsPerSecond;
+    if (micros < 0) {
+        --seconds;
+        micros += kMicroSecondsPerSecond;
+    }
+    const DateCache *dates = NULL;
+    size_t levelLen = m_levels ? strlen(levelString(record.level)) : 0;
+    size_t fileLen = m_files && record.file ? strlen(record.file) : 0;
+
+    // Write into a per-thread buffer big enough for the longest message the
+    // fields could make, and append that to buf at once; appending each
+    // field to the string costs more than formatting it
+    size_t bound = m_fixedBytes + m_levels * levelLen +
+                   m_loggers * record.logger.len + m_files * fileLen +
+                   m_messages * record.str.len;
+    if (m_dates) {
+        dates = &this->dates(seconds);
+        bound += dates->text.size();
+    }
+    static thread_local std::vector<char> scratch;
+    if (scratch.size() < bound)
+        scratch.resize(bound);
+    char *begin = scratch.data();
+    char *p = begin;
+    size_t date = 0;
+
+    for (const Op &op : m_ops) {
+        char *field = p;
+        switch (op.type) {
+        case OpType::LITERAL:
+            memcpy(p, op.text.data(), op.text.size());
+            p += op.text.size();
+            break;
+        case OpType::DATE: {
+            size_t from = date ? dates->ends[date - 1] : 0;
+            size_t len = dates->ends[date++] - from;
+            memcpy(p, dates->text.data() + from, len);
+            p += len;
+            break;
+        }
+        case OpType::MICROSECONDS: {
+            uint32_t v = static_cast<uint32_t>(micros);
+            LogFormat::formatPair(p, v / 10000);
+            LogFormat::formatPair(p + 2, v / 100 % 100);
+            LogFormat::formatPair(p + 4, v % 100);
+            p += 6;
+            break;
+        }
+        case OpType::MILLISECONDS: {
+            uint32_t v = static_cast<uint32_t>(micros / 1000);
+            *p = static_cast<char>('0' + v / 100);
+            LogFormat::formatPair(p + 1, v % 100);
+            p += 3;
+            break;
+        }
+        case OpType::LEVEL:
+            memcpy(p, levelString(record.level), levelLen);
+            p += levelLen;
+            break;
+        case OpType::THREAD:
+            p = writeNumber(p, record.thread);
+            break;
+        case OpType::LOGGER:
+            memcpy(p, record.logger.data, record.logger.len);
+            p += record.logger.len;
+            break;
+        case OpType::FILE:
+            // record.file may be NULL
+            if (fileLen)
+                memcpy(p, record.file, fileLen);
+            p += fileLen;
+            break;
+        case OpType::LINE:
+            p = writeNumber(p, record.line);
+            break;
+        case OpType::MESSAGE:
+            memcpy(p, record.str.data, record.str.len);
+            p += record.str.len;
+            break;
+        }
+        size_t len = p - field;
+        if (len < op.width) {
+            size_t padding = op.width - len;
+            if (!op.left)
+                memmove(field + padding, field, len);
+            memset(op.left ? p : field, ' ', padding);
+            p += padding;
+        }
+    }
+    buf.append(begin, p - begin);
+}
+
+} // namespace Mordor2
@@ -0,0 +1,293 @@
+#include "mappedfilelogsink.h"
+#include "config.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace Mordor2 {
+
+static ConfigVar<size_t>::ptr g_mmapChunkSize = Config::lookup(
+    "log.mmap.chunksize", size_t(16 * 1024 * 1024),
+    "Bytes of a memory-mapped log file mapped at a time.");
+static ConfigVar<uint64_t>::ptr g_mmapSyncInterval = Config::lookup(
+    "log.mmap.syncusec", uint64_t(1000000),
+    "Microseconds between msyncs of a memory-mapped log file; 0 leaves "
+    "writing it back to the kernel.");
+
+// Address space reserved for each file; it only costs page tables for the
+// chunks actually mapped.  Messages past it are dropped
+static const uint64_t kReserved =
+    sizeof(void *) >= 8 ? (uint64_t(1) << 40) : (uint64_t(1) << 30);
+// Chunks kept mapped beyond the one being written
+static const uint64_t kChunksAhead = 2;
+// How long to wait before mapping again after it failed, doubling each time
+static const std::chrono::milliseconds kMinRetryDelay(10);
+static const std::chrono::milliseconds kMaxRetryDelay(1000);
+
+MappedFileLogSink::MappedFileLogSink(const std::string &file,
+                                     size_t chunkSize,
+                                     std::chrono::microseconds syncInterval)
+    : m_file(file),
+      m_chunkSize(chunkSize ? chunkSize : g_mmapChunkSize->val()),
+      m_syncInterval(syncInterval.count() >= 0
+                         ? syncInterval
+                         : std::chrono::microseconds(
+                               g_mmapSyncInterval->val())),
+      m_tail(0),
+      m_mapped(0),
+      m_full(false),
+      m_mapFailing(false),
+      m_dropped(0),
+      m_retryDelay(0),
+      m_unmapped(0),
+      m_synced(0),
+      m_stopping(false) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    m_chunkSize = std::max(page, (m_chunkSize + page - 1) / page * page);
+    m_reserved = kReserved / m_chunkSize * m_chunkSize;
+
+    m_fd = open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (m_fd < 0)
+        throw std::system_error(errno, std::system_category(), file);
+    struct stat st;
+    if (fstat(m_fd, &st) < 0) {
+        int error = errno;
+        close(m_fd);
+        throw std::system_error(error, std::system_category(), file);
+    }
+    void *base = mmap(NULL, m_reserved, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        int error = errno;
+        close(m_fd);
+        throw std::system_error(error, std::system_category(), file);
+    }
+    m_base = static_cast<char *>(base);
+
+    // Mappings start on a page boundary, so map the last partial page of an
+    // existing file, and count what is already in it as written
+    m_fileBase = st.st_size / page * page;
+    uint64_t start = st.st_size - m_fileBase;
+    m_committed.reset(new std::atomic<uint64_t>[m_reserved / m_chunkSize]);
+    for (uint64_t i = 0; i < m_reserved / m_chunkSize; ++i)
+        m_committed[i].store(0, std::memory_order_relaxed);
+    m_committed[0].store(start, std::memory_order_relaxed);
+    m_tail.store(start, std::memory_order_relaxed);
+    m_synced = start;
+
+    mapAhead();
+    m_thread = std::thread(&MappedFileLogSink::run, this);
+}
+
+MappedFileLogSink::~MappedFileLogSink() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+        m_cond.notify_one();
+    }
+    m_thread.join();
+    uint64_t end = std::min(m_tail.load(std::memory_order_acquire),
+                            m_mapped.load(std::memory_order_acquire));
+    if (m_syncInterval.count())
+        sync(end);
+    munmap(m_base, m_reserved);
+    ftruncate(m_fd, m_fileBase + end);
+    close(m_fd);
+}
+
+void MappedFileLogSink::log(const std::string &logger, int64_t now,
+                            tid_t thread, Log::Level level,
+                            const std::string &str, const char *file,
+                            int line) {
+    static thread_local std::string record;
+    record.clear();
+    FileLogSink::format(record, logger, now, thread, level, str, file, line);
+    append(record.data(), record.size());
+}
+
+void MappedFileLogSink::logBatch(const LogRecord *records, size_t count) {
+    static thread_local std::string buf;
+    buf.clear();
+    for (size_t i = 0; i < count; ++i)
+        FileLogSink::format(buf, records[i]);
+    append(buf.data(), buf.size());
+}
+
+void MappedFileLogSink::append(const char *data, uint64_t len) {
+    uint64_t pos = m_tail.fetch_add(len, std::memory_order_relaxed);
+    uint64_t end = pos + len;
+    bool dropped = false;
+    if (end > m_mapped.load(std::memory_order_acquire)) {
+        // Outran the background thread
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.notify_one();
+        while (end > m_mapped.load(std::memory_order_acquire) &&
+               !m_full.load(std::memory_order_acquire) &&
+               !m_mapFailing.load(std::memory_order_acquire))
+            m_mappedCond.wait(lock);
+        dropped = end > m_mapped.load(std::memory_order_acquire);
+    } else if (pos / m_chunkSize != end / m_chunkSize) {
+        // Moved on to the next chunk; have the one after that mapped
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cond.notify_one();
+    }
+    if (dropped)
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+    else
+        memcpy(m_base + pos, data, len);
+
+    // Count the space as written even if it was dropped, so the chunk can
+    // still be unmapped
+    uint64_t chunks = m_reserved / m_chunkSize;
+    while (pos < end && pos / m_chunkSize < chunks) {
+        uint64_t chunk = pos / m_chunkSize;
+        uint64_t n = std::min(end, (chunk + 1) * m_chunkSize) - pos;
+        m_committed[chunk].fetch_add(n, std::memory_order_release);
+        pos += n;
+    }
+}
+
+void MappedFileLogSink::flush() {
+    // Messages still being copied in hold back the end that can be synced;
+    // they only take a memcpy, or the background thread mapping more
+    uint64_t tail = m_tail.load(std::memory_order_acquire);
+    std::lock_guard<std::mutex> lock(m_syncMutex);
+    uint64_t end;
+    while ((end = committedEnd()) < tail &&
+           end < m_mapped.load(std::memory_order_acquire))
+        std::this_thread::yield();
+    sync(end);
+}
+
+uint64_t MappedFileLogSink::committedEnd() const {
+    uint64_t chunks = m_reserved / m_chunkSize;
+    for (uint64_t chunk = m_synced / m_chunkSize; chunk < chunks; ++chunk) {
+        // Read the copied bytes before the claimed ones: if they are equal,
+        // every byte claimed had already been copied
+        uint64_t committed = m_committed[chunk].load(std::memory_order_acquire);
+        uint64_t tail = m_tail.load(std::memory_order_acquire);
+        uint64_t begin = chunk * m_chunkSize;
+        if (tail <= begin)
+            return begin;
+        uint64_t end = std::min(tail, begin + m_chunkSize);
+        if (committed != end - begin)
+            return begin;
+        if (end < begin + m_chunkSize)
+            return end;
+    }
+    return chunks * m_chunkSize;
+}
+
+void MappedFileLogSink::mapAhead() {
+    uint64_t tail = m_tail.load(std::memory_order_relaxed);
+    uint64_t want = std::min(
+        m_reserved,
+        (tail / m_chunkSize + 1 + kChunksAhead) * m_chunkSize);
+    uint64_t mapped = m_mapped.load(std::memory_order_relaxed);
+    if (mapped >= want || m_full.load(std::memory_order_relaxed))
+        return;
+    std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
+    if (now < m_retryAt)
+        return;
+    while (mapped < want) {
+        off_t offset = m_fileBase + mapped;
+        if (m_committed[mapped / m_chunkSize].load(
+                std::memory_order_acquire) == m_chunkSize) {
+            // Every message in it was dropped while mapping failed; leave a
+            // hole rather than allocate it
+        } else if (posix_fallocate(m_fd, offset, m_chunkSize) != 0 ||
+                   // Allocate the disk first, so writing to the mapping
+                   // cannot fault with SIGBUS
+                   mmap(m_base + mapped, m_chunkSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_FIXED, m_fd, offset) == MAP_FAILED) {
+            // The disk may only be full for a while; drop messages, and try
+            // again, less and less often
+            m_retryDelay = std::min(
+                std::max(m_retryDelay * 2, kMinRetryDelay), kMaxRetryDelay);
+            m_retryAt = now + m_retryDelay;
+            m_mapFailing.store(true, std::memory_order_release);
+            break;
+        }
+        mapped += m_chunkSize;
+        m_mapped.store(mapped, std::memory_order_release);
+    }
+    if (mapped >= want) {
+        m_retryDelay = std::chrono::milliseconds(0);
+        m_mapFailing.store(false, std::memory_order_release);
+    }
+    if (mapped == m_reserved)
+        m_full.store(true, std::memory_order_release);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_mappedCond.notify_all();
+}
+
+void MappedFileLogSink::unmapCommitted() {
+    uint64_t mapped = m_mapped.load(std::memory_order_acquire);
+    while ((m_unmapped + 1) * m_chunkSize <= mapped &&
+           m_committed[m_unmapped].load(std::memory_order_acquire) ==
+               m_chunkSize) {
+        char *chunk = m_base + m_unmapped * m_chunkSize;
+        if (m_syncInterval.count() &&
+            m_synced < (m_unmapped + 1) * m_chunkSize)
+            sync((m_unmapped + 1) * m_chunkSize);
+        // Replace the chunk, rather than unmapping it, to keep the address
+        // space reserved
+        mmap(chunk, m_chunkSize, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        ++m_unmapped;
+    }
+}
+
+void MappedFileLogSink::sync(uint64_t end) {
+    end = std::min(end, m_mapped.load(std::memory_order_acquire));
+    uint64_t begin = std::max(m_synced, m_unmapped * m_chunkSize);
+    if (begin >= end)
+        return;
+    size_t page = sysconf(_SC_PAGESIZE);
+    begin = begin / page * page;
+    msync(m_base + begin, end - begin, MS_SYNC);
+    m_synced = end;
+}
+
+void MappedFileLogSink::run() {
+    typedef std::chrono::steady_clock Clock;
+    // Wake up at least this often to unmap finished chunks
+    std::chrono::microseconds interval(100000);
+    if (m_syncInterval.count() && m_syncInterval < interval)
+        interval = m_syncInterval;
+    Clock::time_point lastSync = Clock::now();
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stopping) {
+        lock.unlock();
+        mapAhead();
+        {
+            std::lock_guard<std::mutex> syncLock(m_syncMutex);
+            unmapCommitted();
+            Clock::time_point now = Clock::now();
+            if (m_syncInterval.count() && now - lastSync >= m_syncInterval) {
+                sync(committedEnd());
+                lastSync = now;
+            }
+        }
+        lock.lock();
+        m_cond.wait_for(lock, interval, [this]() {
+            if (m_stopping)
+                return true;
+            // A writer may have asked for more while we were busy
+            uint64_t tail = m_tail.load(std::memory_order_relaxed);
+            return !m_full.load(std::memory_order_relaxed) &&
+                   !m_mapFailing.load(std::memory_order_relaxed) &&
+                   (tail / m_chunkSize + 1 + kChunksAhead) * m_chunkSize >
+                       m_mapped.load(std::memory_order_relaxed);
+        });
+    }
+}
+
+} // namespace Mordor2
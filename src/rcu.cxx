@@ -0,0 +1,68 @@
+#include "rcu.h"
+
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Mordor2 {
+
+Rcu::Shard Rcu::s_shards[Rcu::kShards];
+std::atomic<unsigned> Rcu::s_phase(0);
+std::atomic<unsigned> Rcu::s_nextShard(0);
+
+namespace {
+
+struct Retired {
+    const void *p;
+    void (*free)(const void *);
+};
+
+} // namespace
+
+// What has been retired, and not reclaimed yet; function statics, since
+// ConfigVars may be set during static initialization
+static std::mutex &retiredMutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+static std::vector<Retired> &retired() {
+    static std::vector<Retired> retired;
+    return retired;
+}
+
+void Rcu::retire(const void *p, void (*free)(const void *)) {
+    Retired entry = {p, free};
+    std::lock_guard<std::mutex> lock(retiredMutex());
+    retired().push_back(entry);
+}
+
+void Rcu::reclaim() {
+    if (reading())
+        return;
+    std::vector<Retired> entries;
+    {
+        std::lock_guard<std::mutex> lock(retiredMutex());
+        entries.swap(retired());
+    }
+    if (entries.empty())
+        return;
+    synchronize();
+    for (const Retired &entry : entries)
+        entry.free(entry.p);
+}
+
+void Rcu::synchronize() {
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int i = 0; i < 2; ++i) {
+        unsigned phase = s_phase.fetch_add(1, std::memory_order_seq_cst) & 1;
+        for (unsigned shard = 0; shard < kShards; ++shard) {
+            while (s_shards[shard].readers[phase].load(
+                       std::memory_order_seq_cst) != 0)
+                std::this_thread::yield();
+        }
+    }
+}
+
+} // namespace Mordor2
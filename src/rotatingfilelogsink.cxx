@@ -0,0 +1,335 @@
+#include "rotatingfilelogsink.h"
+#include "config.h"
+#include "timestamp.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#ifdef MORDOR2_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace Mordor2 {
+
+static ConfigVar<uint64_t>::ptr g_fileMaxSize = Config::lookup(
+    "log.file.maxsize", uint64_t(100 * 1024 * 1024),
+    "Bytes a rotating log file grows to before it is rotated; 0 for no "
+    "limit.");
+static ConfigVar<uint64_t>::ptr g_fileRotateInterval = Config::lookup(
+    "log.file.rotateinterval", uint64_t(0),
+    "Seconds after which a rotating log file is rotated, aligned to local "
+    "time; 0 never rotates by time.");
+static ConfigVar<size_t>::ptr g_fileMaxFiles = Config::lookup(
+    "log.file.maxfiles", size_t(0),
+    "Number of rotated log files to keep; 0 keeps all of them.");
+static ConfigVar<bool>::ptr g_fileCompress =
+    Config::lookup("log.file.compress", true, "gzip rotated log files.");
+static ConfigVar<bool>::ptr g_filePreallocate =
+    Config::lookup("log.file.preallocate", true,
+                   "Reserve log.file.maxsize bytes of disk for each new "
+                   "rotating log file.");
+
+static const int64_t kMicroSecondsPerSecond = 1000000;
+
+// The first time after now that is a multiple of interval seconds in local
+// time
+static int64_t nextRotation(int64_t now, uint64_t interval) {
+    if (!interval)
+        return std::numeric_limits<int64_t>::max();
+    std::time_t seconds = now / kMicroSecondsPerSecond;
+    std::tm local_tm;
+    int64_t offset = 0;
+    if (localtime_r(&seconds, &local_tm))
+        offset = local_tm.tm_gmtoff;
+    int64_t local = seconds + offset;
+    int64_t next = (local / static_cast<int64_t>(interval) + 1) * interval;
+    return (next - offset) * kMicroSecondsPerSecond;
+}
+
+// Splits a rotated file name (after the "file." prefix) into its timestamp
+// and sequence number, so they sort in the order they were rotated
+static bool parseRotated(const std::string &name,
+                         std::pair<std::string, long> &key) {
+    // YYYYmmdd-HHMMSS[.N][.gz]
+    if (name.size() < 15 || name[8] != '-')
+        return false;
+    for (size_t i = 0; i < 15; ++i) {
+        if (i != 8 && (name[i] < '0' || name[i] > '9'))
+            return false;
+    }
+    std::string rest = name.substr(15);
+    if (rest.size() >= 3 && rest.compare(rest.size() - 3, 3, ".gz") == 0)
+        rest.resize(rest.size() - 3);
+    key.first = name.substr(0, 15);
+    key.second = 0;
+    if (!rest.empty()) {
+        char *end;
+        if (rest[0] != '.')
+            return false;
+        key.second = strtol(rest.c_str() + 1, &end, 10);
+        if (*end)
+            return false;
+    }
+    return true;
+}
+
+RotatingFileLogSink::RotatingFileLogSink(const std::string &file)
+    : RotatingFileLogSink(file, g_fileMaxSize->val(),
+                          g_fileRotateInterval->val(), g_fileMaxFiles->val(),
+                          g_fileCompress->val(), g_filePreallocate->val()) {}
+
+RotatingFileLogSink::RotatingFileLogSink(const std::string &file,
+                                         uint64_t maxSize, uint64_t interval,
+                                         size_t maxFiles, bool compress,
+                                         bool preallocate)
+    : m_file(file),
+      m_maxSize(maxSize),
+      m_interval(interval),
+      m_maxFiles(maxFiles),
+      m_compress(compress),
+      m_preallocate(preallocate && maxSize),
+      m_fd(-1),
+      m_stopping(false) {
+    openFile(Timestamp::MicrosecondsNow());
+    if (m_fd < 0)
+        throw std::system_error(errno, std::system_category(), file);
+    m_thread = std::thread(&RotatingFileLogSink::run, this);
+}
+
+RotatingFileLogSink::~RotatingFileLogSink() {
+    {
+        std::lock_guard<std::mutex> lock(m_tasksMutex);
+        m_stopping = true;
+        m_tasksCond.notify_one();
+    }
+    m_thread.join();
+    // Give back whatever was preallocated past the end
+    struct stat st;
+    if (m_preallocate && fstat(m_fd, &st) == 0)
+        ftruncate(m_fd, st.st_size);
+    close(m_fd);
+}
+
+void RotatingFileLogSink::log(const std::string &logger, int64_t now,
+                              tid_t thread, Log::Level level,
+                              const std::string &str, const char *file,
+                              int line) {
+    static thread_local std::string record;
+    record.clear();
+    FileLogSink::format(record, logger, now, thread, level, str, file, line);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (now >= m_nextRotation ||
+        (m_maxSize && m_size && m_size + record.size() > m_maxSize))
+        rotate(now);
+    writeAll(record.data(), record.size());
+    m_size += record.size();
+}
+
+void RotatingFileLogSink::logBatch(const LogRecord *records, size_t count) {
+    static thread_local std::string buf;
+    buf.clear();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (size_t i = 0; i < count; ++i) {
+        // What is already in buf is written to the current file, before it
+        // is rotated
+        size_t pending = buf.size();
+        FileLogSink::format(buf, records[i]);
+        if (records[i].now >= m_nextRotation ||
+            (m_maxSize && m_size + pending &&
+             m_size + buf.size() > m_maxSize)) {
+            writeAll(buf.data(), pending);
+            m_size += pending;
+            buf.erase(0, pending);
+            rotate(records[i].now);
+        }
+    }
+    writeAll(buf.data(), buf.size());
+    m_size += buf.size();
+}
+
+void RotatingFileLogSink::openFile(int64_t now) {
+    m_fd = ::open(m_file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                  0644);
+    if (m_fd < 0)
+        return;
+    struct stat st;
+    m_size = fstat(m_fd, &st) == 0 ? st.st_size : 0;
+    m_started = now;
+    m_nextRotation = nextRotation(now, m_interval);
+    if (m_preallocate)
+        post(dup(m_fd), std::string());
+}
+
+void RotatingFileLogSink::rotate(int64_t now) {
+    char suffix[32];
+    std::time_t seconds = m_started / kMicroSecondsPerSecond;
+    std::tm local_tm;
+    localtime_r(&seconds, &local_tm);
+    strftime(suffix, sizeof(suffix), ".%Y%m%d-%H%M%S", &local_tm);
+    std::string base = m_file + suffix;
+    std::string path = base;
+    for (int i = 1; access(path.c_str(), F_OK) == 0 ||
+                    access((path + ".gz").c_str(), F_OK) == 0;
+         ++i) {
+        snprintf(suffix, sizeof(suffix), ".%d", i);
+        path = base + suffix;
+    }
+
+    int fd = -1;
+    if (::rename(m_file.c_str(), path.c_str()) == 0) {
+        fd = m_fd;
+        openFile(now);
+        if (m_fd < 0) {
+            // Keep logging to the old file, and try again later
+            ::rename(path.c_str(), m_file.c_str());
+            m_fd = fd;
+            fd = -1;
+        }
+    }
+    if (fd < 0) {
+        m_size = 0;
+        m_nextRotation = nextRotation(now, m_interval);
+        return;
+    }
+    post(fd, path);
+}
+
+void RotatingFileLogSink::writeAll(const char *buf, size_t len) {
+    while (len) {
+        ssize_t written = ::write(m_fd, buf, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            // Nowhere to report it; drop the message rather than spin
+            return;
+        }
+        buf += written;
+        len -= written;
+    }
+}
+
+void RotatingFileLogSink::post(int fd, const std::string &path) {
+    if (fd < 0 && path.empty())
+        return;
+    Task task;
+    task.fd = fd;
+    task.path = path;
+    std::lock_guard<std::mutex> lock(m_tasksMutex);
+    m_tasks.push_back(task);
+    m_tasksCond.notify_one();
+}
+
+void RotatingFileLogSink::run() {
+    std::unique_lock<std::mutex> lock(m_tasksMutex);
+    for (;;) {
+        while (m_tasks.empty() && !m_stopping)
+            m_tasksCond.wait(lock);
+        if (m_tasks.empty())
+            break;
+        Task task = m_tasks.front();
+        m_tasks.pop_front();
+        lock.unlock();
+        finish(task);
+        lock.lock();
+    }
+}
+
+void RotatingFileLogSink::finish(const Task &task) {
+    if (task.fd >= 0) {
+        struct stat st;
+        if (task.path.empty()) {
+            fallocate(task.fd, FALLOC_FL_KEEP_SIZE, 0, m_maxSize);
+        } else if (m_preallocate && fstat(task.fd, &st) == 0) {
+            // Nothing more is written to a rotated file
+            ftruncate(task.fd, st.st_size);
+        }
+        close(task.fd);
+    }
+    if (!task.path.empty()) {
+        if (m_compress)
+            compress(task.path);
+        prune();
+    }
+}
+
+void RotatingFileLogSink::compress(const std::string &path) {
+#ifdef MORDOR2_HAVE_ZLIB
+    std::string gz = path + ".gz";
+    std::string tmp = gz + ".tmp";
+    int in = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        return;
+    gzFile out = gzopen(tmp.c_str(), "wb");
+    if (!out) {
+        close(in);
+        return;
+    }
+    char buf[65536];
+    bool ok = true;
+    for (;;) {
+        ssize_t n = read(in, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            ok = n == 0;
+            break;
+        }
+        if (gzwrite(out, buf, static_cast<unsigned>(n)) != n) {
+            ok = false;
+            break;
+        }
+    }
+    if (gzclose(out) != Z_OK)
+        ok = false;
+    close(in);
+    if (ok && ::rename(tmp.c_str(), gz.c_str()) == 0)
+        unlink(path.c_str());
+    else
+        unlink(tmp.c_str());
+#endif
+}
+
+void RotatingFileLogSink::prune() {
+    if (!m_maxFiles)
+        return;
+    std::string dir = ".";
+    std::string prefix = m_file;
+    size_t slash = m_file.rfind('/');
+    if (slash != std::string::npos) {
+        dir = slash ? m_file.substr(0, slash) : "/";
+        prefix = m_file.substr(slash + 1);
+    }
+    prefix.push_back('.');
+
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+        return;
+    std::vector<std::pair<std::pair<std::string, long>, std::string>> rotated;
+    while (struct dirent *entry = readdir(d)) {
+        std::string name = entry->d_name;
+        std::pair<std::string, long> key;
+        if (name.compare(0, prefix.size(), prefix) == 0 &&
+            parseRotated(name.substr(prefix.size()), key))
+            rotated.push_back(std::make_pair(key, name));
+    }
+    closedir(d);
+    if (rotated.size() <= m_maxFiles)
+        return;
+    std::sort(rotated.begin(), rotated.end());
+    for (size_t i = 0; i < rotated.size() - m_maxFiles; ++i)
+        unlink((dir + "/" + rotated[i].second).c_str());
+}
+
+} // namespace Mordor2
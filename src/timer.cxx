@@ -0,0 +1,494 @@
+#include "timer.h"
+
+#include <stdexcept>
+
+namespace Mordor2 {
+
+// How often timers bound to ConfigVars look at them again
+static const int64_t kConfigRecheckSeconds = 1;
+// The longest the driver thread sleeps at once; a timer that far away only
+// needs moving down the wheel when it wakes up, and the condition variable
+// would overflow waiting for much longer
+static const int64_t kMaxWaitSeconds = 3600;
+
+Timer::Timer(TimerManager *manager, std::function<void()> dg,
+             Duration interval, bool recurring)
+    : m_manager(manager),
+      m_dg(dg),
+      m_interval(interval),
+      m_recurring(recurring),
+      m_paused(false),
+      m_cancelled(false),
+      m_expiry(0),
+      m_start(0),
+      m_level(-1),
+      m_slot(0),
+      m_prev(NULL),
+      m_next(NULL),
+      m_boundPrev(NULL),
+      m_boundNext(NULL) {}
+
+bool Timer::cancel() {
+    // Released after the lock, in case it is the last reference
+    ptr self;
+    if (!m_manager)
+        return false;
+    std::lock_guard<std::mutex> lock(m_manager->m_mutex);
+    if (m_level < 0)
+        return false;
+    m_manager->unlink(this);
+    if (m_intervalVar)
+        m_manager->unbind(this);
+    m_cancelled.store(true, std::memory_order_seq_cst);
+    --m_manager->m_count;
+    self.swap(m_self);
+    return true;
+}
+
+bool Timer::refresh() {
+    if (!m_manager)
+        return false;
+    std::lock_guard<std::mutex> lock(m_manager->m_mutex);
+    if (m_level < 0)
+        return false;
+    m_manager->unlink(this);
+    m_start = m_manager->ticks(m_manager->elapsed());
+    m_manager->schedule(this, m_start + m_manager->period(this));
+    return true;
+}
+
+bool Timer::reset(Duration interval, bool fromNow) {
+    if (!m_manager)
+        return false;
+    std::lock_guard<std::mutex> lock(m_manager->m_mutex);
+    if (m_level < 0)
+        return false;
+    m_manager->unlink(this);
+    if (m_intervalVar)
+        m_manager->unbind(this);
+    m_interval = interval;
+    m_intervalVar.reset();
+    m_paused = false;
+    if (fromNow)
+        m_start = m_manager->ticks(m_manager->elapsed());
+    m_manager->schedule(this, m_start + m_manager->period(this));
+    return true;
+}
+
+Duration Timer::interval() const {
+    if (!m_manager)
+        return m_interval;
+    std::lock_guard<std::mutex> lock(m_manager->m_mutex);
+    if (m_intervalVar)
+        return m_interval * static_cast<int64_t>(m_intervalVar->val());
+    return m_interval;
+}
+
+TimerManager::TimerManager(Duration resolution)
+    : m_start(MonotonicTimestamp::Now()),
+      m_resolution(resolution),
+      m_current(0),
+      m_target(0),
+      m_count(0),
+      m_wheel(),
+      m_occupied(),
+      m_configGeneration(Config::generation()),
+      m_running(false),
+      m_wakeTick(UINT64_MAX),
+      m_wakeups(0) {
+    if (resolution <= Duration())
+        throw std::invalid_argument("timer resolution must be positive");
+}
+
+TimerManager::~TimerManager() {
+    stop();
+    // Released after the lock, in case a callback holds on to something that
+    // uses a timer
+    std::vector<Timer::ptr> timers;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    timers.reserve(m_count);
+    for (int level = 0; level <= kDue; ++level) {
+        for (size_t slot = 0; slot < kSlots; ++slot) {
+            for (Timer *timer = m_wheel[level][slot]; timer;) {
+                Timer *next = timer->m_next;
+                timer->m_manager = NULL;
+                timer->m_level = -1;
+                timer->m_prev = timer->m_next = NULL;
+                timers.push_back(std::move(timer->m_self));
+                timer = next;
+            }
+            m_wheel[level][slot] = NULL;
+        }
+    }
+    m_count = 0;
+    m_bound.clear();
+}
+
+Timer::ptr TimerManager::registerTimer(Duration delay,
+                                       std::function<void()> dg,
+                                       bool recurring) {
+    Timer::ptr timer(new Timer(this, dg, delay, recurring));
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Duration now = elapsed();
+    timer->m_start = ticks(now);
+    return add(timer, ticks(now + delay));
+}
+
+Timer::ptr TimerManager::registerTimer(Timestamp when,
+                                       std::function<void()> dg) {
+    return registerTimer(
+        Duration::fromMicroseconds(when.microseconds_since_epoch() -
+                                   Timestamp::MicrosecondsNow()),
+        dg);
+}
+
+Timer::ptr TimerManager::registerTimer(ConfigVar<uint64_t>::ptr interval,
+                                       std::function<void()> dg,
+                                       Duration unit) {
+    Timer::ptr timer(new Timer(this, dg, unit, true));
+    timer->m_intervalVar = interval;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    timer->m_start = ticks(elapsed());
+    bind(timer.get());
+    return add(timer, timer->m_start + period(timer.get()));
+}
+
+void TimerManager::start() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_running)
+        return;
+    m_running = true;
+    m_thread = std::thread(&TimerManager::run, this);
+}
+
+void TimerManager::stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_running)
+            return;
+        m_running = false;
+        m_wakeTick = UINT64_MAX;
+    }
+    m_cond.notify_one();
+    m_thread.join();
+}
+
+bool TimerManager::nextTimer(Duration &wait) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_count)
+        return false;
+    wait = m_resolution * static_cast<int64_t>(nextEvent()) - elapsed();
+    if (wait < Duration())
+        wait = Duration();
+    if (wait > longestWait())
+        wait = longestWait();
+    return true;
+}
+
+size_t TimerManager::processTimers() {
+    // Reuse the storage, but not the vector itself, in case a callback
+    // processes timers too
+    static thread_local std::vector<Timer::ptr> scratch;
+    std::vector<Timer::ptr> fired;
+    fired.swap(scratch);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        uint64_t generation = Config::generation();
+        if (generation != m_configGeneration) {
+            m_configGeneration = generation;
+            rebind();
+        }
+        advance(elapsed() / m_resolution, fired);
+    }
+    for (const Timer::ptr &timer : fired) {
+        // Cancelled since it was collected
+        if (!timer->m_cancelled.load(std::memory_order_seq_cst))
+            timer->m_dg();
+    }
+    size_t count = fired.size();
+    fired.clear();
+    if (fired.capacity() > scratch.capacity())
+        fired.swap(scratch);
+    return count;
+}
+
+size_t TimerManager::size() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_count;
+}
+
+Duration TimerManager::elapsed() const {
+    return MonotonicTimestamp::Now() - m_start;
+}
+
+uint64_t TimerManager::ticks(Duration duration) const {
+    if (duration <= Duration())
+        return 0;
+    int64_t resolution = m_resolution.nanoseconds();
+    return (duration.nanoseconds() - 1) / resolution + 1;
+}
+
+uint64_t TimerManager::period(Timer *timer) {
+    Duration interval = timer->m_interval;
+    if (timer->m_intervalVar) {
+        interval *= static_cast<int64_t>(timer->m_intervalVar->val());
+        timer->m_paused = interval <= Duration();
+        if (timer->m_paused)
+            interval = Duration::fromSeconds(kConfigRecheckSeconds);
+    }
+    uint64_t result = ticks(interval);
+    return result ? result : 1;
+}
+
+Timer::ptr TimerManager::add(Timer::ptr timer, uint64_t expiry) {
+    timer->m_self = timer;
+    ++m_count;
+    schedule(timer.get(), expiry);
+    return timer;
+}
+
+void TimerManager::schedule(Timer *timer, uint64_t expiry) {
+    timer->m_expiry = expiry;
+    link(timer);
+    // Wake the driver thread if it would sleep past the new timer
+    if (m_running && expiry < m_wakeTick) {
+        m_wakeTick = expiry;
+        ++m_wakeups;
+        m_cond.notify_one();
+    }
+}
+
+void TimerManager::link(Timer *timer) {
+    uint64_t expiry = timer->m_expiry;
+    int level = kDue;
+    size_t slot = 0;
+    if (expiry > m_current) {
+        uint64_t delta = expiry - m_current;
+        level = 0;
+        while (level < kLevels - 1 &&
+               delta >> (kSlotBits * (level + 1)) != 0)
+            ++level;
+        int shift = kSlotBits * level;
+        if (delta >> (shift + kSlotBits) != 0)
+            // Out of reach; wait in the top level's slot that comes round
+            // last, and be placed again from there
+            slot = ((m_current >> shift) - 1) & (kSlots - 1);
+        else
+            slot = (expiry >> shift) & (kSlots - 1);
+        m_occupied[level][slot / 64] |= uint64_t(1) << (slot % 64);
+    }
+    Timer *&head = m_wheel[level][slot];
+    timer->m_level = level;
+    timer->m_slot = slot;
+    timer->m_prev = NULL;
+    timer->m_next = head;
+    if (head)
+        head->m_prev = timer;
+    head = timer;
+}
+
+void TimerManager::unlink(Timer *timer) {
+    if (timer->m_next)
+        timer->m_next->m_prev = timer->m_prev;
+    if (timer->m_prev) {
+        timer->m_prev->m_next = timer->m_next;
+    } else {
+        Timer *&head = m_wheel[timer->m_level][timer->m_slot];
+        head = timer->m_next;
+        if (!head && timer->m_level != kDue)
+            m_occupied[timer->m_level][timer->m_slot / 64] &=
+                ~(uint64_t(1) << (timer->m_slot % 64));
+    }
+    timer->m_level = -1;
+    timer->m_prev = timer->m_next = NULL;
+}
+
+size_t TimerManager::nextSlot(int level, size_t index) const {
+    const uint64_t *words = m_occupied[level];
+    size_t from = (index + 1) & (kSlots - 1);
+    // Once round every word, and the first again for the bits before from
+    for (size_t i = 0; i <= kWords; ++i) {
+        size_t word = (from / 64 + i) % kWords;
+        uint64_t bits = words[word];
+        if (i == 0)
+            bits &= ~uint64_t(0) << (from % 64);
+        if (bits) {
+            size_t slot = word * 64 + __builtin_ctzll(bits);
+            size_t distance = (slot - index) & (kSlots - 1);
+            return distance ? distance : kSlots;
+        }
+    }
+    return 0;
+}
+
+uint64_t TimerManager::nextEvent() const {
+    if (m_wheel[kDue][0])
+        return m_current;
+    uint64_t result = UINT64_MAX;
+    for (int level = 0; level < kLevels; ++level) {
+        int shift = kSlotBits * level;
+        uint64_t span = m_current >> shift;
+        size_t distance = nextSlot(level, span & (kSlots - 1));
+        if (!distance)
+            continue;
+        // The slot comes round when the tick enters its span
+        uint64_t tick = (span + distance) << shift;
+        if (tick < result)
+            result = tick;
+    }
+    return result;
+}
+
+void TimerManager::advance(uint64_t target, std::vector<Timer::ptr> &fired) {
+    m_target = target;
+    expire(kDue, 0, fired);
+    while (m_current < target) {
+        uint64_t next = nextEvent();
+        if (next > target) {
+            m_current = target;
+            break;
+        }
+        // Nothing happens on the ticks in between
+        m_current = next - 1;
+        tick(fired);
+    }
+}
+
+void TimerManager::tick(std::vector<Timer::ptr> &fired) {
+    size_t index = ++m_current & (kSlots - 1);
+    if (index == 0) {
+        // Moving into a new span of each level whose lower levels came round
+        for (int level = 1; level < kLevels; ++level) {
+            size_t slot = (m_current >> (kSlotBits * level)) & (kSlots - 1);
+            cascade(level, slot);
+            if (slot != 0)
+                break;
+        }
+    }
+    // Due before the slot's timers, which were placed for this tick too
+    expire(kDue, 0, fired);
+    expire(0, index, fired);
+}
+
+void TimerManager::cascade(int level, size_t slot) {
+    Timer *timer = m_wheel[level][slot];
+    if (!timer)
+        return;
+    m_wheel[level][slot] = NULL;
+    m_occupied[level][slot / 64] &= ~(uint64_t(1) << (slot % 64));
+    while (timer) {
+        Timer *next = timer->m_next;
+        link(timer);
+        timer = next;
+    }
+}
+
+void TimerManager::expire(int level, size_t slot,
+                          std::vector<Timer::ptr> &fired) {
+    while (Timer *timer = m_wheel[level][slot]) {
+        unlink(timer);
+        if (timer->m_paused) {
+            rearm(timer);
+        } else if (timer->m_recurring) {
+            fired.push_back(timer->m_self);
+            rearm(timer);
+        } else {
+            --m_count;
+            fired.push_back(std::move(timer->m_self));
+        }
+    }
+}
+
+void TimerManager::rearm(Timer *timer) {
+    bool paused = timer->m_paused;
+    uint64_t period = this->period(timer);
+    // Keep to the schedule, unless that is already due again by the time
+    // being processed up to, or it is only now being started
+    uint64_t start = timer->m_expiry;
+    if (paused || start + period <= m_target)
+        start = m_target;
+    timer->m_start = start;
+    schedule(timer, start + period);
+}
+
+void TimerManager::rebind() {
+    for (auto &entry : m_bound) {
+        uint64_t value = entry.first->val();
+        if (value == entry.second.value)
+            continue;
+        entry.second.value = value;
+        for (Timer *timer = entry.second.timers; timer;
+             timer = timer->m_boundNext) {
+            // Due already; it reads the ConfigVar again when it is rearmed
+            if (timer->m_level == kDue)
+                continue;
+            uint64_t expiry = timer->m_start + period(timer);
+            if (expiry == timer->m_expiry)
+                continue;
+            unlink(timer);
+            schedule(timer, expiry);
+        }
+    }
+}
+
+void TimerManager::bind(Timer *timer) {
+    const ConfigVar<uint64_t> *var = timer->m_intervalVar.get();
+    auto it = m_bound.find(var);
+    if (it == m_bound.end()) {
+        BoundVar bound = {var->val(), NULL};
+        it = m_bound.insert(std::make_pair(var, bound)).first;
+    }
+    Timer *&head = it->second.timers;
+    timer->m_boundPrev = NULL;
+    timer->m_boundNext = head;
+    if (head)
+        head->m_boundPrev = timer;
+    head = timer;
+}
+
+void TimerManager::unbind(Timer *timer) {
+    if (timer->m_boundNext)
+        timer->m_boundNext->m_boundPrev = timer->m_boundPrev;
+    if (timer->m_boundPrev) {
+        timer->m_boundPrev->m_boundNext = timer->m_boundNext;
+    } else {
+        auto it = m_bound.find(timer->m_intervalVar.get());
+        it->second.timers = timer->m_boundNext;
+        if (!it->second.timers)
+            m_bound.erase(it);
+    }
+    timer->m_boundPrev = timer->m_boundNext = NULL;
+}
+
+Duration TimerManager::longestWait() const {
+    return Duration::fromSeconds(m_bound.empty() ? kMaxWaitSeconds
+                                                 : kConfigRecheckSeconds);
+}
+
+void TimerManager::run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_running) {
+        m_wakeTick = 0;
+        lock.unlock();
+        processTimers();
+        lock.lock();
+        if (!m_running)
+            break;
+        uint64_t next = nextEvent();
+        m_wakeTick = next;
+        uint64_t wakeups = m_wakeups;
+        auto woken = [&] { return !m_running || m_wakeups != wakeups; };
+        if (next == UINT64_MAX) {
+            m_cond.wait(lock, woken);
+            continue;
+        }
+        Duration wait = m_resolution * static_cast<int64_t>(next) - elapsed();
+        if (wait > longestWait())
+            wait = longestWait();
+        if (wait > Duration())
+            m_cond.wait_for(lock, std::chrono::nanoseconds(wait.nanoseconds()),
+                            woken);
+    }
+}
+
+} // namespace Mordor2
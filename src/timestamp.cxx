@@ -1,4 +1,6 @@
 #include "timestamp.h"
+#include "config.h"
+#include "logformat.h"
 
 #include <stdio.h>
 #include <sys/time.h>
@@ -7,54 +9,656 @@
 #define __STDC_FORMAT_MACROS
 #endif
 
+#include <atomic>
 #include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
 #include <inttypes.h>
+#include <mutex>
+#include <ostream>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
 
 namespace Mordor2 {
 
 static_assert(sizeof(Timestamp) == sizeof(int64_t),
               "Timestamp is same size as int64_t");
 
+static const int64_t kSecondsPerDay = 86400;
+// Time zones only change their offset from UTC on a quarter hour (since they
+// stopped using local mean time, anyway)
+static const int64_t kSecondsPerQuarterHour = 900;
+
+static std::atomic<uint64_t> g_timezoneGeneration(0);
+
+static int64_t floorDiv(int64_t a, int64_t b) {
+    int64_t q = a / b;
+    return q * b > a ? q - 1 : q;
+}
+
+// Days since 1970-01-01 of a date in the proleptic Gregorian calendar; see
+// http://howardhinnant.github.io/date_algorithms.html
+static int64_t daysFromCivil(int64_t year, unsigned month, unsigned day) {
+    year -= month <= 2;
+    int64_t era = floorDiv(year, 400);
+    unsigned yearOfEra = static_cast<unsigned>(year - era * 400);
+    unsigned dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 +
+                         day - 1;
+    unsigned dayOfEra =
+        yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + static_cast<int64_t>(dayOfEra) - 719468;
+}
+
+static void civilFromDays(int64_t days, int64_t &year, unsigned &month,
+                          unsigned &day) {
+    days += 719468;
+    int64_t era = floorDiv(days, 146097);
+    unsigned dayOfEra = static_cast<unsigned>(days - era * 146097);
+    unsigned yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 -
+                          dayOfEra / 146096) /
+                         365;
+    unsigned dayOfYear =
+        dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    unsigned mp = (5 * dayOfYear + 2) / 153;
+    day = dayOfYear - (153 * mp + 2) / 5 + 1;
+    month = mp < 10 ? mp + 3 : mp - 9;
+    year = yearOfEra + era * 400 + (month <= 2);
+}
+
+// Offset of local time from UTC at seconds since the epoch, looked up once
+// per quarter hour per thread
+static int64_t utcOffset(int64_t seconds) {
+    static thread_local int64_t cachedQuarter = INT64_MIN;
+    static thread_local uint64_t cachedGeneration;
+    static thread_local int64_t cachedOffset;
+    int64_t quarter = floorDiv(seconds, kSecondsPerQuarterHour);
+    uint64_t generation = Timestamp::timezoneGeneration();
+    if (quarter != cachedQuarter || generation != cachedGeneration) {
+        std::time_t t = seconds;
+        std::tm local_tm;
+        cachedOffset = localtime_r(&t, &local_tm) ? local_tm.tm_gmtoff : 0;
+        cachedQuarter = quarter;
+        cachedGeneration = generation;
+    }
+    return cachedOffset;
+}
+
 std::string Timestamp::FormattedString(bool showMicroseconds) const {
-    char buf[64] = {0};
-    time_t seconds =
-        static_cast<time_t>(microseconds_since_epoch_ / kMicroSecondsPerSecond);
-    struct tm tm_time;
-    gmtime_r(&seconds, &tm_time);
-
-    if (showMicroseconds) {
-        int microseconds = static_cast<int>(microseconds_since_epoch_ %
-                                            kMicroSecondsPerSecond);
-        snprintf(buf, sizeof(buf), "%4d%02d%02d %02d:%02d:%02d.%06d",
-                 tm_time.tm_year + 1900, tm_time.tm_mon + 1, tm_time.tm_mday,
-                 tm_time.tm_hour, tm_time.tm_min, tm_time.tm_sec, microseconds);
+    char buf[kMaxFormattedSize];
+    size_t len = formatTo(buf, sizeof(buf),
+                          showMicroseconds ? Format::UTC
+                                           : Format::UTC_MILLISECONDS);
+    return std::string(buf, len);
+}
+
+size_t Timestamp::formatTo(char *buf, size_t size, Format format) const {
+    int64_t seconds =
+        floorDiv(microseconds_since_epoch_, kMicroSecondsPerSecond);
+    uint32_t micros = static_cast<uint32_t>(
+        microseconds_since_epoch_ - seconds * kMicroSecondsPerSecond);
+    int64_t offset = 0;
+    if (format == Format::LOCAL || format == Format::ISO8601) {
+        offset = utcOffset(seconds);
+        seconds += offset;
+    }
+    int64_t days = floorDiv(seconds, kSecondsPerDay);
+    uint32_t secondOfDay =
+        static_cast<uint32_t>(seconds - days * kSecondsPerDay);
+    int64_t year;
+    unsigned month, day;
+    civilFromDays(days, year, month, day);
+
+    bool iso = format == Format::ISO8601 || format == Format::ISO8601_UTC;
+    char str[kMaxFormattedSize];
+    char *p = str;
+    if (year >= 0 && year <= 9999) {
+        LogFormat::formatPair(p, static_cast<unsigned>(year / 100));
+        LogFormat::formatPair(p + 2, static_cast<unsigned>(year % 100));
+        p += 4;
     } else {
-        int milliseconds = static_cast<int>(microseconds_since_epoch_ /
-                                            kMicroSecondsPerMilliSecond %
-                                            kMilliSecondsPerSecond);
-        snprintf(buf, sizeof(buf), "%4d%02d%02d %02d:%02d:%02d.%03d",
-                 tm_time.tm_year + 1900, tm_time.tm_mon + 1, tm_time.tm_mday,
-                 tm_time.tm_hour, tm_time.tm_min, tm_time.tm_sec, milliseconds);
+        // Years before 0 or after 9999 are outside ISO 8601's basic range;
+        // just write them whole
+        p += snprintf(p, 24, "%" PRId64, year);
+    }
+    if (iso)
+        *p++ = '-';
+    LogFormat::formatPair(p, month);
+    p += 2;
+    if (iso)
+        *p++ = '-';
+    LogFormat::formatPair(p, day);
+    p += 2;
+    *p++ = iso ? 'T' : ' ';
+    LogFormat::formatPair(p, secondOfDay / 3600);
+    p[2] = ':';
+    LogFormat::formatPair(p + 3, secondOfDay / 60 % 60);
+    p[5] = ':';
+    LogFormat::formatPair(p + 6, secondOfDay % 60);
+    p[8] = '.';
+    p += 9;
+    if (format == Format::UTC_MILLISECONDS) {
+        uint32_t millis = micros / kMicroSecondsPerMilliSecond;
+        *p = static_cast<char>('0' + millis / 100);
+        LogFormat::formatPair(p + 1, millis % 100);
+        p += 3;
+    } else {
+        LogFormat::formatPair(p, micros / 10000);
+        LogFormat::formatPair(p + 2, micros / 100 % 100);
+        LogFormat::formatPair(p + 4, micros % 100);
+        p += 6;
+    }
+    if (format == Format::ISO8601_UTC) {
+        *p++ = 'Z';
+    } else if (format == Format::ISO8601) {
+        *p++ = offset < 0 ? '-' : '+';
+        uint32_t minutes =
+            static_cast<uint32_t>((offset < 0 ? -offset : offset) / 60);
+        LogFormat::formatPair(p, minutes / 60);
+        p[2] = ':';
+        LogFormat::formatPair(p + 3, minutes % 60);
+        p += 5;
+    }
+
+    size_t len = p - str;
+    if (len >= size)
+        return 0;
+    memcpy(buf, str, len);
+    buf[len] = '\0';
+    return len;
+}
+
+void Timestamp::formatTo(std::string &buf, Format format) const {
+    char str[kMaxFormattedSize];
+    buf.append(str, formatTo(str, sizeof(str), format));
+}
+
+// Reads exactly n digits
+static bool parseDigits(const char *&p, const char *end, int n,
+                        unsigned &value) {
+    if (end - p < n)
+        return false;
+    unsigned v = 0;
+    for (int i = 0; i < n; ++i) {
+        unsigned digit = static_cast<unsigned char>(p[i]) - '0';
+        if (digit > 9)
+            return false;
+        v = v * 10 + digit;
     }
-    return buf;
+    p += n;
+    value = v;
+    return true;
 }
 
-Timestamp Timestamp::Now() {
-    return Timestamp(std::chrono::duration_cast<std::chrono::microseconds>(
-                         std::chrono::system_clock::now().time_since_epoch())
-                         .count());
+static bool expect(const char *&p, const char *end, char c) {
+    if (p == end || *p != c)
+        return false;
+    ++p;
+    return true;
 }
 
+bool Timestamp::parse(const char *str, size_t len, Timestamp &result,
+                      bool local) {
+    static const uint8_t kDaysInMonth[] = {31, 29, 31, 30, 31, 30,
+                                           31, 31, 30, 31, 30, 31};
+    const char *p = str;
+    const char *end = str + len;
+    unsigned year, month, day, hour, minute, second;
+    if (!parseDigits(p, end, 4, year))
+        return false;
+    // ISO 8601 separates the date with "-"; Format::UTC does not
+    bool iso = p != end && *p == '-';
+    if (!(iso ? expect(p, end, '-') && parseDigits(p, end, 2, month) &&
+                    expect(p, end, '-') && parseDigits(p, end, 2, day)
+              : parseDigits(p, end, 2, month) && parseDigits(p, end, 2, day)))
+        return false;
+    if (p == end || (*p != ' ' && !(iso && (*p == 'T' || *p == 't'))))
+        return false;
+    ++p;
+    if (!(parseDigits(p, end, 2, hour) && expect(p, end, ':') &&
+          parseDigits(p, end, 2, minute) && expect(p, end, ':') &&
+          parseDigits(p, end, 2, second)))
+        return false;
+    // 60 is a leap second; it is taken as the first second of the next
+    // minute
+    if (month < 1 || month > 12 || day < 1 || day > kDaysInMonth[month - 1] ||
+        hour > 23 || minute > 59 || second > 60)
+        return false;
+    if (month == 2 && day == 29 &&
+        (year % 4 != 0 || (year % 100 == 0 && year % 400 != 0)))
+        return false;
+
+    uint32_t micros = 0;
+    if (p != end && (*p == '.' || *p == ',')) {
+        ++p;
+        int digits = 0;
+        for (; p != end; ++p, ++digits) {
+            unsigned digit = static_cast<unsigned char>(*p) - '0';
+            if (digit > 9)
+                break;
+            if (digits < 6)
+                micros = micros * 10 + digit;
+        }
+        if (!digits)
+            return false;
+        for (; digits < 6; ++digits)
+            micros *= 10;
+    }
+
+    int64_t seconds = daysFromCivil(year, month, day) * kSecondsPerDay +
+                      hour * 3600 + minute * 60 + second;
+    if (p == end) {
+        if (local) {
+            // Near a change, the offset at the time taken as UTC can differ
+            // from the offset at the actual time; look it up again there
+            int64_t offset = utcOffset(seconds - utcOffset(seconds));
+            seconds -= offset;
+        }
+    } else if (*p == 'Z' || *p == 'z') {
+        ++p;
+    } else if (*p == '+' || *p == '-') {
+        bool negative = *p++ == '-';
+        unsigned offsetHours, offsetMinutes = 0;
+        if (!parseDigits(p, end, 2, offsetHours))
+            return false;
+        if (p != end) {
+            expect(p, end, ':');
+            if (!parseDigits(p, end, 2, offsetMinutes))
+                return false;
+        }
+        if (offsetHours > 23 || offsetMinutes > 59)
+            return false;
+        int64_t offset = offsetHours * 3600 + offsetMinutes * 60;
+        seconds -= negative ? -offset : offset;
+    } else {
+        return false;
+    }
+    if (p != end)
+        return false;
+    result = Timestamp(seconds * kMicroSecondsPerSecond + micros);
+    return true;
+}
+
+void Timestamp::timezoneChanged() {
+    tzset();
+    g_timezoneGeneration.fetch_add(1, std::memory_order_release);
+}
+
+uint64_t Timestamp::timezoneGeneration() {
+    return g_timezoneGeneration.load(std::memory_order_acquire);
+}
+
+namespace {
+
+enum ClockSource { SYSTEM, COARSE, TSC, CACHED };
+
+std::atomic<int> g_clockSource(SYSTEM);
+// Stored by the ticker for CACHED
+std::atomic<int64_t> g_cachedNow(0);
+std::atomic<int64_t> g_cachedMonotonic(0);
+
+// @return clock, in microseconds
+int64_t realtime(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// @return clock, in nanoseconds
+int64_t clockNanoseconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void storeCachedTime() {
+    g_cachedNow.store(realtime(CLOCK_REALTIME), std::memory_order_relaxed);
+    g_cachedMonotonic.store(clockNanoseconds(CLOCK_MONOTONIC),
+                            std::memory_order_relaxed);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+bool hasInvariantTsc() {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007)
+        return false;
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return edx & (1 << 8);
+}
+
+// The TSC reading at a known time, both since the epoch and on the
+// monotonic clock, and microseconds per tick, << 32.
+//
+// Readers retry while seq is odd, or changes under them, so they never see
+// the base of one calibration with the rate of another.  There is only ever
+// one writer, under g_clockMutex.
+struct TscCalibration {
+    std::atomic<uint32_t> seq;
+    std::atomic<uint64_t> tsc;
+    std::atomic<int64_t> micros;
+    std::atomic<int64_t> nanos;
+    std::atomic<uint64_t> rate;
+};
+
+TscCalibration g_tsc;
+
+struct TscSample {
+    uint64_t tsc;
+    int64_t micros;
+};
+
+struct TscParams {
+    uint64_t tsc;
+    int64_t micros;
+    int64_t nanos;
+    uint64_t rate;
+};
+
+// The last sample the rate was measured from
+TscSample g_lastSync;
+
+TscSample sampleTsc() {
+    // Take the TSC halfway through reading the clock
+    uint64_t before = __rdtsc();
+    int64_t micros = realtime(CLOCK_REALTIME);
+    uint64_t after = __rdtsc();
+    TscSample sample = {before + (after - before) / 2, micros};
+    return sample;
+}
+
+// @return The TSC, read consistently with the calibration in params
+uint64_t readTsc(TscParams &params) {
+    for (;;) {
+        uint32_t seq = g_tsc.seq.load(std::memory_order_acquire);
+        uint64_t tsc = __rdtsc();
+        params.tsc = g_tsc.tsc.load(std::memory_order_relaxed);
+        params.micros = g_tsc.micros.load(std::memory_order_relaxed);
+        params.nanos = g_tsc.nanos.load(std::memory_order_relaxed);
+        params.rate = g_tsc.rate.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (!(seq & 1) && g_tsc.seq.load(std::memory_order_relaxed) == seq)
+            return tsc;
+    }
+}
+
+// @return ticks past the base, in microseconds times perMicrosecond
+int64_t scaleTicks(const TscParams &params, uint64_t tsc,
+                   unsigned perMicrosecond) {
+    // Another thread's TSC can be slightly behind the base
+    if (tsc < params.tsc)
+        return 0;
+    return static_cast<int64_t>(static_cast<unsigned __int128>(
+                                    tsc - params.tsc) *
+                                    params.rate * perMicrosecond >>
+                                32);
+}
+
+void publishTsc(const TscSample &base, int64_t nanos, uint64_t rate) {
+    uint32_t seq = g_tsc.seq.load(std::memory_order_relaxed);
+    g_tsc.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    g_tsc.tsc.store(base.tsc, std::memory_order_relaxed);
+    g_tsc.micros.store(base.micros, std::memory_order_relaxed);
+    g_tsc.nanos.store(nanos, std::memory_order_relaxed);
+    g_tsc.rate.store(rate, std::memory_order_relaxed);
+    g_tsc.seq.store(seq + 2, std::memory_order_release);
+}
+
+// @return The rate between two samples, or 0 if the clock went backwards
+uint64_t measureRate(const TscSample &from, const TscSample &to) {
+    if (to.tsc <= from.tsc || to.micros <= from.micros)
+        return 0;
+    return (static_cast<unsigned __int128>(to.micros - from.micros) << 32) /
+           (to.tsc - from.tsc);
+}
+
+// Rebase on the current time; the rate is only replaced by one measured
+// since the last resync if it is within 1% of it, so a step of the clock
+// (by NTP, say) does not skew the TSC clock until the next one.  The
+// monotonic time carries on from where the old calibration puts it, so it
+// never jumps
+void resyncTsc() {
+    TscSample now = sampleTsc();
+    TscParams params;
+    readTsc(params);
+    int64_t nanos = params.nanos + scaleTicks(params, now.tsc, 1000);
+    uint64_t rate = params.rate;
+    uint64_t measured = measureRate(g_lastSync, now);
+    if (measured && measured > rate - rate / 100 &&
+        measured < rate + rate / 100)
+        rate = measured;
+    publishTsc(now, nanos, rate);
+    g_lastSync = now;
+}
+
+// @return false without an invariant TSC
+bool calibrateTsc() {
+    if (!hasInvariantTsc())
+        return false;
+    TscSample first = sampleTsc();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    TscSample second = sampleTsc();
+    uint64_t rate = measureRate(first, second);
+    if (!rate)
+        return false;
+    // Start the monotonic time from CLOCK_MONOTONIC's, so it is close to
+    // what the other clock sources return
+    publishTsc(second, clockNanoseconds(CLOCK_MONOTONIC), rate);
+    g_lastSync = second;
+    return true;
+}
+
+int64_t tscNow() {
+    TscParams params;
+    uint64_t tsc = readTsc(params);
+    return params.micros + scaleTicks(params, tsc, 1);
+}
+
+int64_t tscMonotonicNow() {
+    TscParams params;
+    uint64_t tsc = readTsc(params);
+    return params.nanos + scaleTicks(params, tsc, 1000);
+}
+
+#else
+
+bool calibrateTsc() { return false; }
+void resyncTsc() {}
+int64_t tscNow() { return realtime(CLOCK_REALTIME); }
+int64_t tscMonotonicNow() { return clockNanoseconds(CLOCK_MONOTONIC); }
+
+#endif
+
+// Serializes changes of the clock source, and of the TSC calibration
+std::mutex g_clockMutex;
+
+// Keeps the cached time current, and the TSC clock in sync, from a
+// background thread that only runs while one of them is in use
+class ClockTicker {
+public:
+    ClockTicker() : m_running(false), m_wakeups(0) {}
+    ~ClockTicker() { stop(); }
+
+    void start() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_running)
+            return;
+        m_running = true;
+        m_thread = std::thread(&ClockTicker::run, this);
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_running)
+                return;
+            m_running = false;
+        }
+        m_cond.notify_one();
+        m_thread.join();
+    }
+
+    /// Make the thread notice a new clock source now, rather than after
+    /// it next wakes up
+    void wake() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_wakeups;
+        }
+        m_cond.notify_one();
+    }
+
+private:
+    void run() {
+        // The first calibration is short; refine it soon
+        auto nextResync = std::chrono::steady_clock::now() +
+                          std::chrono::milliseconds(100);
+        uint64_t wakeups = 0;
+        for (;;) {
+            int source = g_clockSource.load(std::memory_order_relaxed);
+            if (source == CACHED)
+                storeCachedTime();
+            auto now = std::chrono::steady_clock::now();
+            if (source == TSC && now >= nextResync) {
+                // The source is being changed (and this thread may be about
+                // to be stopped) if the lock is taken; try again later
+                std::unique_lock<std::mutex> lock(g_clockMutex,
+                                                  std::try_to_lock);
+                if (lock) {
+                    resyncTsc();
+                    nextResync = now + std::chrono::seconds(1);
+                }
+            }
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait_for(lock,
+                            source == CACHED ? std::chrono::milliseconds(1)
+                                             : std::chrono::milliseconds(100),
+                            [&] { return !m_running || m_wakeups != wakeups; });
+            if (!m_running)
+                return;
+            wakeups = m_wakeups;
+        }
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    bool m_running;
+    uint64_t m_wakeups;
+    std::thread m_thread;
+};
+
+ClockTicker g_ticker;
+
+} // namespace
+
+static void updateClockSource();
+
+static ConfigVar<std::string>::ptr g_timeClockSource = Config::lookup(
+    "time.clocksource", std::string("system"),
+    "Clock of Timestamp::Now and log messages: system (CLOCK_REALTIME), "
+    "coarse (CLOCK_REALTIME_COARSE), tsc (the CPU's time stamp counter, "
+    "resynced every second) or cached (updated every millisecond)");
+
+static struct TimestampInitializer {
+    TimestampInitializer() {
+        g_timeClockSource->monitor(&updateClockSource);
+    }
+} g_init;
+
+static void updateClockSource() {
+    std::string name = g_timeClockSource->val();
+    std::lock_guard<std::mutex> lock(g_clockMutex);
+    int source = SYSTEM;
+    if (name == "coarse") {
+        source = COARSE;
+    } else if (name == "tsc") {
+        if (calibrateTsc())
+            source = TSC;
+    } else if (name == "cached") {
+        storeCachedTime();
+        source = CACHED;
+    }
+    g_clockSource.store(source, std::memory_order_relaxed);
+    if (source == TSC || source == CACHED) {
+        g_ticker.start();
+        g_ticker.wake();
+    } else {
+        g_ticker.stop();
+    }
+}
+
+Timestamp Timestamp::Now() { return Timestamp(MicrosecondsNow()); }
+
 int64_t Timestamp::MicrosecondsNow() {
-    return std::chrono::duration_cast<std::chrono::microseconds>(
-               std::chrono::system_clock::now().time_since_epoch())
-        .count();
+    switch (g_clockSource.load(std::memory_order_relaxed)) {
+    case COARSE:
+        return realtime(CLOCK_REALTIME_COARSE);
+    case TSC:
+        return tscNow();
+    case CACHED:
+        return g_cachedNow.load(std::memory_order_relaxed);
+    default:
+        return realtime(CLOCK_REALTIME);
+    }
+}
+
+MonotonicTimestamp MonotonicTimestamp::Now() {
+    switch (g_clockSource.load(std::memory_order_relaxed)) {
+    case COARSE:
+        return MonotonicTimestamp(clockNanoseconds(CLOCK_MONOTONIC_COARSE));
+    case TSC:
+        return MonotonicTimestamp(tscMonotonicNow());
+    case CACHED:
+        return MonotonicTimestamp(
+            g_cachedMonotonic.load(std::memory_order_relaxed));
+    default:
+        return MonotonicTimestamp(clockNanoseconds(CLOCK_MONOTONIC));
+    }
+}
+
+std::ostream &operator<<(std::ostream &os, Duration duration) {
+    static const struct {
+        uint64_t nanoseconds;
+        const char *suffix;
+    } kUnits[] = {{1000000000, "s"}, {1000000, "ms"}, {1000, "us"}, {1, "ns"}};
+    int64_t nanoseconds = duration.nanoseconds();
+    // Negate in unsigned, so the most negative value works
+    uint64_t n = nanoseconds;
+    if (nanoseconds < 0) {
+        os << '-';
+        n = 0 - n;
+    }
+    size_t unit = 0;
+    while (n < kUnits[unit].nanoseconds && kUnits[unit].nanoseconds > 1)
+        ++unit;
+    uint64_t scale = kUnits[unit].nanoseconds;
+    os << n / scale;
+    // Up to three decimals, without trailing zeros
+    if (scale >= 1000) {
+        uint64_t fraction = n % scale / (scale / 1000);
+        if (fraction) {
+            char digits[5] = {'.', static_cast<char>('0' + fraction / 100),
+                              static_cast<char>('0' + fraction / 10 % 10),
+                              static_cast<char>('0' + fraction % 10), 0};
+            size_t len = 4;
+            while (digits[len - 1] == '0')
+                --len;
+            os.write(digits, len);
+        }
+    }
+    return os << kUnits[unit].suffix;
 }
 
 int64_t Timestamp::MillisecondsNow() {
-    return std::chrono::duration_cast<std::chrono::milliseconds>(
-               std::chrono::system_clock::now().time_since_epoch())
-        .count();
+    return MicrosecondsNow() / kMicroSecondsPerMilliSecond;
 }
 
 } // namespace Mordor
@@ -0,0 +1,68 @@
+// mordor2-logdecode: converts files written by BinaryLogSink (log.binaryfile)
+// back into the text format of FileLogSink.
+//
+// usage: mordor2-logdecode [-o output] [file...]
+//
+// Reads stdin if no files are given, and writes to stdout unless -o is given.
+
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string.h>
+
+#include "binarylog.h"
+
+using namespace Mordor2;
+
+static void usage() {
+    std::cerr << "usage: mordor2-logdecode [-o output] [file...]" << std::endl;
+}
+
+static bool decode(std::istream &is, const std::string &name, LogSink &sink) {
+    BinaryLogReader reader(is);
+    BinaryLogReader::Message message;
+    try {
+        while (reader.next(message))
+            sink.log(message.logger, message.now, message.thread,
+                     message.level, message.str, message.file.c_str(),
+                     message.line);
+    } catch (std::exception &e) {
+        std::cerr << name << ": " << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    std::string output = "/dev/stdout";
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; ++i) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "--") == 0) {
+            ++i;
+            break;
+        } else {
+            usage();
+            return 2;
+        }
+    }
+
+    FileLogSink sink(output);
+    bool ok = true;
+    if (i == argc) {
+        ok = decode(std::cin, "<stdin>", sink);
+    } else {
+        for (; i < argc; ++i) {
+            std::ifstream is(argv[i], std::ios::binary);
+            if (!is) {
+                std::cerr << argv[i] << ": " << strerror(errno) << std::endl;
+                ok = false;
+                continue;
+            }
+            ok = decode(is, argv[i], sink) && ok;
+        }
+    }
+    sink.flush();
+    return ok ? 0 : 1;
+}